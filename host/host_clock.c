@@ -0,0 +1,15 @@
+#include "host_clock.h"
+#include "pico/stdlib.h"
+
+// Shared by the threads of the pipe test, hence the atomics
+static uint64_t host_clock = 0;
+
+_Thread_local uint host_core_num = 0;
+
+uint64_t host_clock_ns(void) {
+    return __atomic_load_n(&host_clock, __ATOMIC_RELAXED);
+}
+
+void host_clock_advance_ns(uint64_t ns) {
+    __atomic_fetch_add(&host_clock, ns, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,618 @@
+#include "sd_emu.h"
+#include "host_clock.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Bytes the card has queued for MISO: the longest sequence is a response
+// followed by a start token, a 512-byte block and its CRC
+#define SD_EMU_OUT_SIZE 1024
+
+typedef enum {
+    SD_EMU_IDLE,            // Waiting for a command frame
+    SD_EMU_READ,            // CMD17/CMD18: next block due at ready_ns
+    SD_EMU_STALLED,         // Read that never produces a token
+    SD_EMU_WRITE_TOKEN,     // CMD24/CMD25: waiting for a start or stop token
+    SD_EMU_WRITE_DATA,      // Receiving a block and its CRC
+} sd_emu_state_t;
+
+static struct {
+    sd_emu_config_t config;
+    int fd;
+    uint32_t sectors;
+    uint8_t csd[16];
+    
+    bool selected;
+    uint32_t clock_hz;
+    sd_emu_state_t state;
+    
+    // Card state
+    bool initialized;       // ACMD41 done, R1 idle bit clear
+    bool app_cmd;           // Previous command was CMD55
+    bool crc_enabled;       // CMD59
+    uint32_t acmd41_polls;
+    uint32_t erase_start, erase_end;
+    bool erase_start_set, erase_end_set;
+    bool status_error;      // Reported and cleared by CMD13
+    
+    // Incoming command frame
+    uint8_t frame[6];
+    int frame_len;
+    
+    // Outgoing bytes; 0xFF (or 0x00 while busy) once drained
+    uint8_t out[SD_EMU_OUT_SIZE];
+    int out_head, out_len;
+    uint64_t busy_until_ns;
+    
+    // Data streams
+    uint32_t sector;        // Next block of the current read or write
+    bool multi;             // CMD18/CMD25
+    bool first_block;       // Write latency is charged once per command
+    uint64_t ready_ns;      // Read: when the next block may start
+    bool gap_pending;       // Read: start the inter-block gap once drained
+    uint8_t rx[514];
+    int rx_len;
+    
+    // Fault injection
+    uint32_t fault_count[SD_EMU_FAULT_COUNT];
+    uint32_t fault_ppm[SD_EMU_FAULT_COUNT];
+    uint32_t rng;
+    
+    sd_emu_stats_t stats;
+} emu = { .fd = -1, .rng = 1 };
+
+static const char* const sd_emu_fault_names[SD_EMU_FAULT_COUNT] = {
+    "cmd-crc", "read-crc", "write-crc", "no-token", "write-error", "program-error"
+};
+
+// Helper functions
+static uint8_t sd_emu_crc7(const uint8_t* data, int len) {
+    uint8_t crc = 0;
+    for (int i = 0; i < len; i++) {
+        uint8_t byte = data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc <<= 1;
+            if ((byte ^ crc) & 0x80) crc ^= 0x09;
+            byte <<= 1;
+        }
+    }
+    return crc & 0x7F;
+}
+
+static uint16_t sd_emu_crc16(const uint8_t* data, int len) {
+    uint16_t crc = 0;
+    for (int i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+static uint32_t sd_emu_random(void) {
+    // xorshift32: reproducible across runs for a given seed
+    emu.rng ^= emu.rng << 13;
+    emu.rng ^= emu.rng >> 17;
+    emu.rng ^= emu.rng << 5;
+    return emu.rng;
+}
+
+// Whether this opportunity for the fault fires
+static bool sd_emu_fault(sd_emu_fault_t fault) {
+    bool fire = false;
+    if (emu.fault_count[fault] > 0) {
+        emu.fault_count[fault]--;
+        fire = true;
+    } else if (emu.fault_ppm[fault] > 0) {
+        fire = sd_emu_random() % 1000000 < emu.fault_ppm[fault];
+    }
+    if (fire) emu.stats.faults[fault]++;
+    return fire;
+}
+
+// Marginal wiring: above the limit one bit per block is lost
+static bool sd_emu_signal_bad(void) {
+    return emu.config.signal_limit_hz && emu.clock_hz > emu.config.signal_limit_hz;
+}
+
+static void sd_emu_push(uint8_t byte) {
+    if (emu.out_len == SD_EMU_OUT_SIZE) return;
+    emu.out[(emu.out_head + emu.out_len) % SD_EMU_OUT_SIZE] = byte;
+    emu.out_len++;
+}
+
+static void sd_emu_push_block(const uint8_t* data, int len, uint16_t crc) {
+    sd_emu_push(0xFE);
+    for (int i = 0; i < len; i++) {
+        sd_emu_push(data[i]);
+    }
+    sd_emu_push(crc >> 8);
+    sd_emu_push(crc & 0xFF);
+}
+
+// Ncr of one byte, then the response
+static void sd_emu_respond(uint8_t r1) {
+    sd_emu_push(0xFF);
+    sd_emu_push(r1);
+}
+
+static void sd_emu_set_busy_us(uint32_t us) {
+    emu.busy_until_ns = host_clock_ns() + (uint64_t)us * 1000;
+}
+
+// SDHC CSD v2: 512-byte blocks, erase class with single-block erase
+static void sd_emu_build_csd(void) {
+    uint32_t c_size = emu.sectors / 1024 - 1;
+    uint8_t* csd = emu.csd;
+    
+    memset(csd, 0, sizeof(emu.csd));
+    csd[0] = 0x40;                                  // CSD_STRUCTURE 1
+    csd[1] = 0x0E;                                  // TAAC
+    csd[3] = emu.config.max_clock_hz > 25000000 ? 0x5A : 0x32;
+    csd[4] = 0x5B;                                  // CCC 0x5B5
+    csd[5] = 0x59;                                  // READ_BL_LEN 9
+    csd[7] = (c_size >> 16) & 0x3F;
+    csd[8] = (c_size >> 8) & 0xFF;
+    csd[9] = c_size & 0xFF;
+    csd[10] = 0x7F;                                 // ERASE_BLK_EN, SECTOR_SIZE
+    csd[11] = 0x80;
+    csd[12] = 0x0A;                                 // R2W_FACTOR, WRITE_BL_LEN
+    csd[13] = 0x40;
+    csd[15] = (sd_emu_crc7(csd, 15) << 1) | 0x01;
+}
+
+//--------------------------------------------------------------------+
+// Data blocks
+//--------------------------------------------------------------------+
+
+// Queue the next block of a read; called once the access latency is over
+static void sd_emu_read_block(void) {
+    uint8_t data[512];
+    
+    if (sd_emu_fault(SD_EMU_FAULT_NO_TOKEN)) {
+        emu.state = SD_EMU_STALLED;
+        return;
+    }
+    
+    if (emu.sector >= emu.sectors) {
+        sd_emu_push(0x08);                          // Error token: out of range
+        emu.state = SD_EMU_IDLE;
+        return;
+    }
+    
+    if (pread(emu.fd, data, 512, (off_t)emu.sector * 512) != 512) {
+        sd_emu_push(0x01);                          // Error token: error
+        emu.state = SD_EMU_IDLE;
+        return;
+    }
+    
+    uint16_t crc = sd_emu_crc16(data, 512);
+    if (sd_emu_fault(SD_EMU_FAULT_READ_CRC) || sd_emu_signal_bad()) {
+        data[sd_emu_random() % 512] ^= 1u << (sd_emu_random() % 8);
+    }
+    sd_emu_push_block(data, 512, crc);
+    emu.stats.blocks_read++;
+    
+    emu.sector++;
+    if (emu.multi) {
+        emu.gap_pending = true;
+    } else {
+        emu.state = SD_EMU_IDLE;
+    }
+}
+
+// A whole block and its CRC have arrived
+static void sd_emu_write_block(void) {
+    uint16_t crc = ((uint16_t)emu.rx[512] << 8) | emu.rx[513];
+    uint8_t response = 0x05;
+    
+    if (sd_emu_signal_bad()) emu.rx[sd_emu_random() % 512] ^= 0x01;
+    
+    if (emu.crc_enabled && crc != sd_emu_crc16(emu.rx, 512)) {
+        emu.stats.crc_rejects++;
+        response = 0x0B;
+    } else if (sd_emu_fault(SD_EMU_FAULT_WRITE_CRC)) {
+        response = 0x0B;
+    } else if (sd_emu_fault(SD_EMU_FAULT_WRITE_ERROR) || emu.sector >= emu.sectors) {
+        response = 0x0D;
+    } else if (sd_emu_fault(SD_EMU_FAULT_PROGRAM_ERROR)) {
+        // Accepted, but programming fails: the block is lost and only the
+        // status register says so once busy is over
+        emu.status_error = true;
+    } else if (pwrite(emu.fd, emu.rx, 512, (off_t)emu.sector * 512) != 512) {
+        response = 0x0D;
+    }
+    
+    sd_emu_push(0xE0 | response);
+    
+    if (response == 0x05) {
+        emu.stats.blocks_written++;
+        emu.sector++;
+        sd_emu_set_busy_us(emu.config.write_block_us +
+                           (emu.first_block ? emu.config.write_latency_us : 0));
+        emu.first_block = false;
+    } else {
+        sd_emu_set_busy_us(1);
+    }
+    
+    // A rejected block in a CMD25 stream still waits for the stop token
+    emu.state = emu.multi ? SD_EMU_WRITE_TOKEN : SD_EMU_IDLE;
+}
+
+static uint8_t sd_emu_erase(void) {
+    static const uint8_t zero[512];
+    
+    if (!emu.erase_start_set || !emu.erase_end_set || emu.erase_end < emu.erase_start) {
+        return 0x10;                                // Erase sequence error
+    }
+    if (emu.erase_end >= emu.sectors) return 0x20;  // Address error
+    
+    for (uint32_t s = emu.erase_start; s <= emu.erase_end; s++) {
+        if (pwrite(emu.fd, zero, 512, (off_t)s * 512) != 512) return 0x20;
+    }
+    emu.stats.sectors_erased += emu.erase_end - emu.erase_start + 1;
+    emu.erase_start_set = emu.erase_end_set = false;
+    sd_emu_set_busy_us(emu.config.erase_us);
+    return 0x00;
+}
+
+//--------------------------------------------------------------------+
+// Commands
+//--------------------------------------------------------------------+
+
+static void sd_emu_start_read(uint32_t sector, bool multi) {
+    emu.state = SD_EMU_READ;
+    emu.sector = sector;
+    emu.multi = multi;
+    emu.gap_pending = false;
+    emu.ready_ns = host_clock_ns() + (uint64_t)emu.config.read_latency_us * 1000;
+}
+
+static void sd_emu_start_write(uint32_t sector, bool multi) {
+    emu.state = SD_EMU_WRITE_TOKEN;
+    emu.sector = sector;
+    emu.multi = multi;
+    emu.first_block = true;
+}
+
+static void sd_emu_command(void) {
+    uint8_t cmd = emu.frame[0] & 0x3F;
+    uint32_t arg = ((uint32_t)emu.frame[1] << 24) | ((uint32_t)emu.frame[2] << 16) |
+                   ((uint32_t)emu.frame[3] << 8) | emu.frame[4];
+    bool app = emu.app_cmd;
+    uint8_t r1 = emu.initialized ? 0x00 : 0x01;
+    
+    emu.stats.commands++;
+    emu.app_cmd = false;
+    
+    // Whatever the card was sending is abandoned
+    emu.out_len = 0;
+    
+    // CMD0 and CMD8 always carry a valid CRC7; the rest only with CMD59
+    bool bad_crc = (emu.crc_enabled || cmd == 0 || cmd == 8) &&
+                   (emu.frame[5] >> 1) != sd_emu_crc7(emu.frame, 5);
+    if (bad_crc) emu.stats.crc_rejects++;
+    if (bad_crc || sd_emu_fault(SD_EMU_FAULT_CMD_CRC)) {
+        sd_emu_respond(r1 | 0x08);
+        return;
+    }
+    
+    // Data commands only exist once the card has left the idle state
+    bool ready = emu.initialized;
+    
+    if (cmd == 12) {
+        // Stuff byte, then R1 (this model has no busy after the stop)
+        sd_emu_push(0xFF);
+        sd_emu_respond(r1);
+        if (emu.state == SD_EMU_READ || emu.state == SD_EMU_STALLED) emu.state = SD_EMU_IDLE;
+        return;
+    }
+    
+    // A new command ends an abandoned read (single block or stalled)
+    if (emu.state == SD_EMU_READ || emu.state == SD_EMU_STALLED) emu.state = SD_EMU_IDLE;
+    
+    if (app) {
+        switch (cmd) {
+        case 41:
+            if (!emu.initialized && ++emu.acmd41_polls >= emu.config.init_polls) {
+                emu.initialized = true;
+            }
+            sd_emu_respond(emu.initialized ? 0x00 : 0x01);
+            return;
+        case 23:
+            sd_emu_respond(ready ? r1 : r1 | 0x04);
+            return;
+        default:
+            break;
+        }
+    }
+    
+    switch (cmd) {
+    case 0:
+        emu.initialized = false;
+        emu.crc_enabled = false;
+        emu.acmd41_polls = 0;
+        emu.state = SD_EMU_IDLE;
+        emu.busy_until_ns = 0;
+        emu.status_error = false;
+        sd_emu_respond(0x01);
+        break;
+    
+    case 8:
+        sd_emu_respond(r1);
+        sd_emu_push(0x00);
+        sd_emu_push(0x00);
+        sd_emu_push((arg >> 8) & 0x0F);             // Voltage accepted
+        sd_emu_push(arg & 0xFF);                    // Check pattern
+        break;
+    
+    case 9: {
+        // A data block like any other, so marginal wiring hits it too
+        uint8_t csd[16];
+        memcpy(csd, emu.csd, sizeof(csd));
+        uint16_t crc = sd_emu_crc16(csd, sizeof(csd));
+        if (sd_emu_signal_bad()) csd[sd_emu_random() % 16] ^= 1u << (sd_emu_random() % 8);
+        sd_emu_respond(r1);
+        sd_emu_push(0xFF);
+        sd_emu_push_block(csd, sizeof(csd), crc);
+        break;
+    }
+    
+    case 13:
+        sd_emu_respond(r1);
+        sd_emu_push(emu.status_error ? 0x04 : 0x00);    // Second R2 byte: error
+        emu.status_error = false;
+        break;
+    
+    case 16:
+        sd_emu_respond(arg == 512 ? r1 : r1 | 0x40);
+        break;
+    
+    case 17:
+    case 18:
+    case 24:
+    case 25:
+        if (!ready) {
+            sd_emu_respond(r1 | 0x04);
+        } else if (arg >= emu.sectors) {
+            sd_emu_respond(r1 | 0x20);
+        } else {
+            sd_emu_respond(r1);
+            if (cmd == 17 || cmd == 18) {
+                sd_emu_start_read(arg, cmd == 18);
+            } else {
+                sd_emu_start_write(arg, cmd == 25);
+            }
+        }
+        break;
+    
+    case 32:
+    case 33:
+        if (!ready) {
+            sd_emu_respond(r1 | 0x04);
+        } else if (arg >= emu.sectors) {
+            sd_emu_respond(r1 | 0x20);
+        } else {
+            if (cmd == 32) {
+                emu.erase_start = arg;
+                emu.erase_start_set = true;
+            } else {
+                emu.erase_end = arg;
+                emu.erase_end_set = true;
+            }
+            sd_emu_respond(r1);
+        }
+        break;
+    
+    case 38:
+        sd_emu_respond(ready ? r1 | sd_emu_erase() : r1 | 0x04);
+        break;
+    
+    case 55:
+        emu.app_cmd = true;
+        sd_emu_respond(r1);
+        break;
+    
+    case 58:
+        sd_emu_respond(r1);
+        // Power up done and CCS (block addressing) once initialized
+        sd_emu_push(emu.initialized ? 0xC0 : 0x00);
+        sd_emu_push(0xFF);
+        sd_emu_push(0x80);
+        sd_emu_push(0x00);
+        break;
+    
+    case 59:
+        emu.crc_enabled = arg & 1;
+        sd_emu_respond(r1);
+        break;
+    
+    default:
+        sd_emu_respond(r1 | 0x04);
+        break;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Bus
+//--------------------------------------------------------------------+
+
+static uint8_t sd_emu_output(uint64_t now) {
+    if (emu.out_len > 0) {
+        uint8_t byte = emu.out[emu.out_head];
+        emu.out_head = (emu.out_head + 1) % SD_EMU_OUT_SIZE;
+        emu.out_len--;
+        return byte;
+    }
+    
+    if (now < emu.busy_until_ns) return 0x00;
+    
+    if (emu.state == SD_EMU_READ) {
+        if (emu.gap_pending) {
+            emu.gap_pending = false;
+            emu.ready_ns = now + (uint64_t)emu.config.read_gap_us * 1000;
+        }
+        if (now >= emu.ready_ns) {
+            sd_emu_read_block();
+            if (emu.out_len > 0) return sd_emu_output(now);
+        }
+    }
+    
+    return 0xFF;
+}
+
+static void sd_emu_input(uint8_t mosi, uint64_t now) {
+    switch (emu.state) {
+    case SD_EMU_WRITE_TOKEN:
+        if (now < emu.busy_until_ns) return;
+        if (mosi == (emu.multi ? 0xFC : 0xFE)) {
+            emu.state = SD_EMU_WRITE_DATA;
+            emu.rx_len = 0;
+        } else if (emu.multi && mosi == 0xFD) {
+            emu.state = SD_EMU_IDLE;
+            sd_emu_set_busy_us(emu.config.stop_busy_us);
+        } else if (!emu.multi && (mosi & 0xC0) == 0x40) {
+            // A CMD24 abandoned before its token
+            emu.state = SD_EMU_IDLE;
+            emu.frame[0] = mosi;
+            emu.frame_len = 1;
+        }
+        return;
+    
+    case SD_EMU_WRITE_DATA:
+        emu.rx[emu.rx_len++] = mosi;
+        if (emu.rx_len == (int)sizeof(emu.rx)) sd_emu_write_block();
+        return;
+    
+    default:
+        break;
+    }
+    
+    // Command frames: start bits 01, then five more bytes. The card does
+    // not listen while it holds DO low.
+    if (emu.frame_len == 0 && ((mosi & 0xC0) != 0x40 || now < emu.busy_until_ns)) return;
+    
+    emu.frame[emu.frame_len++] = mosi;
+    if (emu.frame_len == 6) {
+        emu.frame_len = 0;
+        sd_emu_command();
+    }
+}
+
+void sd_emu_select(bool selected) {
+    emu.selected = selected;
+    emu.frame_len = 0;
+}
+
+void sd_emu_set_clock_hz(uint32_t hz) {
+    emu.clock_hz = hz;
+}
+
+uint8_t sd_emu_exchange(uint8_t mosi) {
+    // Deselected: DO floats high and clocks are ignored, but programming
+    // and read access times keep running
+    if (!emu.selected) return 0xFF;
+    
+    uint64_t now = host_clock_ns();
+    uint8_t miso = sd_emu_output(now);
+    sd_emu_input(mosi, now);
+    return miso;
+}
+
+//--------------------------------------------------------------------+
+// Setup
+//--------------------------------------------------------------------+
+
+void sd_emu_default_config(sd_emu_config_t* config) {
+    // Roughly a class 10 SDHC card
+    config->read_latency_us = 300;
+    config->read_gap_us = 20;
+    config->write_latency_us = 1000;
+    config->write_block_us = 100;
+    config->stop_busy_us = 500;
+    config->erase_us = 2000;
+    config->max_clock_hz = 25000000;
+    config->signal_limit_hz = 0;
+    config->init_polls = 3;
+}
+
+int sd_emu_open(const char* path, const sd_emu_config_t* config) {
+    struct stat st;
+    
+    sd_emu_close();
+    
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    
+    uint32_t sectors = (uint32_t)(st.st_size / 512) / 1024 * 1024;
+    if (sectors == 0) {
+        fprintf(stderr, "%s: image smaller than 512 KiB\n", path);
+        close(fd);
+        return -1;
+    }
+    
+    emu.fd = fd;
+    emu.sectors = sectors;
+    emu.config = *config;
+    emu.state = SD_EMU_IDLE;
+    emu.initialized = false;
+    emu.crc_enabled = false;
+    emu.out_len = 0;
+    emu.frame_len = 0;
+    emu.busy_until_ns = 0;
+    emu.status_error = false;
+    sd_emu_build_csd();
+    return 0;
+}
+
+void sd_emu_close(void) {
+    if (emu.fd >= 0) close(emu.fd);
+    emu.fd = -1;
+    emu.sectors = 0;
+}
+
+uint32_t sd_emu_sectors(void) {
+    return emu.sectors;
+}
+
+void sd_emu_inject(sd_emu_fault_t fault, uint32_t count) {
+    emu.fault_count[fault] += count;
+}
+
+void sd_emu_set_fault_rate(sd_emu_fault_t fault, uint32_t ppm) {
+    emu.fault_ppm[fault] = ppm;
+}
+
+void sd_emu_seed(uint32_t seed) {
+    emu.rng = seed ? seed : 1;
+}
+
+int sd_emu_fault_from_name(const char* name) {
+    for (int i = 0; i < SD_EMU_FAULT_COUNT; i++) {
+        if (strcmp(name, sd_emu_fault_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void sd_emu_get_stats(sd_emu_stats_t* stats) {
+    *stats = emu.stats;
+}
+
+void sd_emu_print_stats(void) {
+    printf("Card: %lu commands, %lu blocks read, %lu written, %lu erased, %lu CRC rejects\n",
+           (unsigned long)emu.stats.commands, (unsigned long)emu.stats.blocks_read,
+           (unsigned long)emu.stats.blocks_written, (unsigned long)emu.stats.sectors_erased,
+           (unsigned long)emu.stats.crc_rejects);
+    printf("Card faults:");
+    for (int i = 0; i < SD_EMU_FAULT_COUNT; i++) {
+        printf(" %s %lu", sd_emu_fault_names[i], (unsigned long)emu.stats.faults[i]);
+    }
+    printf("\n");
+}
@@ -0,0 +1,70 @@
+#ifndef SD_EMU_H
+#define SD_EMU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// SPI-mode SD card (SDHC, CSD v2) backed by an image file, driven one byte
+// at a time by the host transport in sd_spi_emu.c. Commands, R1/R2/R3/R7
+// responses, data tokens, CRC7/CRC16 checking once CMD59 enables it, busy
+// periods and the CMD18/CMD25 streams follow the SD physical layer spec.
+// Timing is in virtual time (host_clock.h).
+
+typedef struct {
+    uint32_t read_latency_us;   // CMD17/CMD18 to the first start block token
+    uint32_t read_gap_us;       // Between blocks of a CMD18 stream
+    uint32_t write_latency_us;  // Extra busy after the first block of a write
+    uint32_t write_block_us;    // Busy after every written block
+    uint32_t stop_busy_us;      // Busy after the CMD25 stop token
+    uint32_t erase_us;          // Busy after CMD38
+    uint32_t max_clock_hz;      // Advertised in CSD TRAN_SPEED: 25 or 50 MHz
+    uint32_t signal_limit_hz;   // Data is corrupted above this clock; 0 = never
+    uint32_t init_polls;        // ACMD41 calls before the card leaves idle
+} sd_emu_config_t;
+
+typedef enum {
+    SD_EMU_FAULT_CMD_CRC,       // Command answered with the CRC error bit
+    SD_EMU_FAULT_READ_CRC,      // One bit of a read block flipped
+    SD_EMU_FAULT_WRITE_CRC,     // Written block rejected with 0x0B
+    SD_EMU_FAULT_NO_TOKEN,      // Read never produces a start block token
+    SD_EMU_FAULT_WRITE_ERROR,   // Written block refused with 0x0D
+    SD_EMU_FAULT_PROGRAM_ERROR, // Block accepted, then not programmed; CMD13 tells
+    SD_EMU_FAULT_COUNT
+} sd_emu_fault_t;
+
+typedef struct {
+    uint32_t commands;
+    uint32_t blocks_read;
+    uint32_t blocks_written;
+    uint32_t sectors_erased;
+    uint32_t crc_rejects;       // Frames or blocks that failed a real CRC check
+    uint32_t faults[SD_EMU_FAULT_COUNT];
+} sd_emu_stats_t;
+
+void sd_emu_default_config(sd_emu_config_t* config);
+
+// The image must hold at least 1024 sectors; capacity is rounded down to
+// the CSD v2 granularity of 512 KiB. Returns -1 if it cannot be opened.
+int sd_emu_open(const char* path, const sd_emu_config_t* config);
+void sd_emu_close(void);
+uint32_t sd_emu_sectors(void);
+
+// Bus side, called by the transport and the GPIO shim
+void sd_emu_select(bool selected);
+void sd_emu_set_clock_hz(uint32_t hz);
+uint8_t sd_emu_exchange(uint8_t mosi);
+
+// Fault injection: the next count opportunities fail, and/or each one
+// fails with the given probability in parts per million
+void sd_emu_inject(sd_emu_fault_t fault, uint32_t count);
+void sd_emu_set_fault_rate(sd_emu_fault_t fault, uint32_t ppm);
+void sd_emu_seed(uint32_t seed);
+
+// "cmd-crc", "read-crc", "write-crc", "no-token", "write-error",
+// "program-error"; -1 if unknown
+int sd_emu_fault_from_name(const char* name);
+
+void sd_emu_get_stats(sd_emu_stats_t* stats);
+void sd_emu_print_stats(void);
+
+#endif // SD_EMU_H
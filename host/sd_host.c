@@ -0,0 +1,260 @@
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pico/stdlib.h"
+#include "ff.h"
+#include "diskio.h"
+#include "sd_card.h"
+#include "block_dev.h"
+#include "log.h"
+#include "storage_bench.h"
+#include "sd_emu.h"
+
+// Host run of the real SD stack: sd_card.c, block_dev.c, diskio.c and
+// FatFs on top of the emulated card. Formats the image if asked, mounts
+// it, writes a test file, reads it back, deletes it (TRIM) and prints the
+// driver's counters. With --bench it runs the storage benchmark suite
+// instead. Times are virtual: bus clocks plus card latencies.
+
+#define HOST_TEST_FILE  "SDHOST.BIN"
+#define HOST_CHUNK      4096
+
+static FATFS fs;
+static uint8_t chunk[HOST_CHUNK];
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+        "usage: %s [options] IMAGE\n"
+        "  --create MB           create IMAGE with this size and format it\n"
+        "  --size KB             test file size (default 1024)\n"
+        "  --bench               run the benchmark suite instead of the file test\n"
+        "  --read-us US          read access latency\n"
+        "  --gap-us US           gap between blocks of a multi-block read\n"
+        "  --write-us US         extra busy after the first block of a write\n"
+        "  --block-us US         busy after every written block\n"
+        "  --erase-us US         busy after an erase\n"
+        "  --max-clock HZ        clock advertised in the CSD (25 or 50 MHz)\n"
+        "  --signal-limit HZ     corrupt data above this bus clock\n"
+        "  --fault NAME:COUNT    fail the next COUNT opportunities\n"
+        "  --fault-rate NAME:PPM fail opportunities at random\n"
+        "  --seed N              random seed for --fault-rate\n"
+        "faults: cmd-crc read-crc write-crc no-token write-error program-error\n",
+        argv0);
+}
+
+// NAME:VALUE for --fault and --fault-rate
+static int parse_fault(const char* spec, int* fault, uint32_t* value) {
+    char name[32];
+    const char* colon = strchr(spec, ':');
+    if (!colon || colon - spec >= (int)sizeof(name)) return -1;
+    
+    memcpy(name, spec, colon - spec);
+    name[colon - spec] = '\0';
+    *fault = sd_emu_fault_from_name(name);
+    *value = strtoul(colon + 1, NULL, 0);
+    return *fault < 0 ? -1 : 0;
+}
+
+static int create_image(const char* path, uint32_t mb) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)mb * 1024 * 1024) != 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static void fill_chunk(uint32_t offset) {
+    for (int i = 0; i < HOST_CHUNK; i += 4) {
+        uint32_t word = (offset + i) * 2654435761u;
+        memcpy(&chunk[i], &word, 4);
+    }
+}
+
+static void print_rate(const char* what, uint32_t bytes, uint64_t start_us) {
+    uint64_t elapsed = time_us_64() - start_us;
+    printf("%s: %lu KB in %llu us (%llu KB/s)\n", what, (unsigned long)(bytes / 1024),
+           (unsigned long long)elapsed,
+           (unsigned long long)(elapsed ? (uint64_t)bytes * 1000000 / 1024 / elapsed : 0));
+}
+
+static int write_test_file(uint32_t size) {
+    FIL file;
+    UINT written;
+    uint64_t start = time_us_64();
+    
+    FRESULT fr = f_open(&file, HOST_TEST_FILE, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr != FR_OK) {
+        printf("f_open for write failed: %d\n", fr);
+        return -1;
+    }
+    for (uint32_t offset = 0; offset < size && fr == FR_OK; offset += HOST_CHUNK) {
+        fill_chunk(offset);
+        fr = f_write(&file, chunk, HOST_CHUNK, &written);
+        if (fr == FR_OK && written != HOST_CHUNK) fr = FR_DENIED;
+    }
+    FRESULT close_fr = f_close(&file);
+    if (fr == FR_OK) fr = close_fr;
+    if (fr != FR_OK) {
+        printf("Write failed: %d\n", fr);
+        return -1;
+    }
+    
+    print_rate("Write", size, start);
+    return 0;
+}
+
+static int verify_test_file(uint32_t size) {
+    static uint8_t expected[HOST_CHUNK];
+    FIL file;
+    UINT read;
+    uint64_t start = time_us_64();
+    int result = 0;
+    
+    FRESULT fr = f_open(&file, HOST_TEST_FILE, FA_READ);
+    if (fr != FR_OK) {
+        printf("f_open for read failed: %d\n", fr);
+        return -1;
+    }
+    for (uint32_t offset = 0; offset < size; offset += HOST_CHUNK) {
+        fr = f_read(&file, expected, HOST_CHUNK, &read);
+        if (fr != FR_OK || read != HOST_CHUNK) {
+            printf("Read failed at %lu: %d\n", (unsigned long)offset, fr);
+            result = -1;
+            break;
+        }
+        fill_chunk(offset);
+        if (memcmp(chunk, expected, HOST_CHUNK) != 0) {
+            printf("Data mismatch at %lu\n", (unsigned long)offset);
+            result = -1;
+            break;
+        }
+    }
+    f_close(&file);
+    
+    if (result == 0) print_rate("Read", size, start);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "create", required_argument, NULL, 'c' },
+        { "size", required_argument, NULL, 's' },
+        { "bench", no_argument, NULL, 'B' },
+        { "read-us", required_argument, NULL, 'r' },
+        { "gap-us", required_argument, NULL, 'g' },
+        { "write-us", required_argument, NULL, 'w' },
+        { "block-us", required_argument, NULL, 'b' },
+        { "erase-us", required_argument, NULL, 'e' },
+        { "max-clock", required_argument, NULL, 'm' },
+        { "signal-limit", required_argument, NULL, 'l' },
+        { "fault", required_argument, NULL, 'f' },
+        { "fault-rate", required_argument, NULL, 'p' },
+        { "seed", required_argument, NULL, 'S' },
+        { NULL, 0, NULL, 0 }
+    };
+    sd_emu_config_t config;
+    uint32_t create_mb = 0;
+    uint32_t size = 1024 * 1024;
+    bool bench = false;
+    int fault;
+    uint32_t value;
+    int opt;
+    
+    sd_emu_default_config(&config);
+    
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'c': create_mb = strtoul(optarg, NULL, 0); break;
+        case 's': size = strtoul(optarg, NULL, 0) * 1024; break;
+        case 'B': bench = true; break;
+        case 'r': config.read_latency_us = strtoul(optarg, NULL, 0); break;
+        case 'g': config.read_gap_us = strtoul(optarg, NULL, 0); break;
+        case 'w': config.write_latency_us = strtoul(optarg, NULL, 0); break;
+        case 'b': config.write_block_us = strtoul(optarg, NULL, 0); break;
+        case 'e': config.erase_us = strtoul(optarg, NULL, 0); break;
+        case 'm': config.max_clock_hz = strtoul(optarg, NULL, 0); break;
+        case 'l': config.signal_limit_hz = strtoul(optarg, NULL, 0); break;
+        case 'f':
+        case 'p':
+            if (parse_fault(optarg, &fault, &value) != 0) {
+                fprintf(stderr, "Bad fault '%s'\n", optarg);
+                return 2;
+            }
+            if (opt == 'f') {
+                sd_emu_inject(fault, value);
+            } else {
+                sd_emu_set_fault_rate(fault, value);
+            }
+            break;
+        case 'S': sd_emu_seed(strtoul(optarg, NULL, 0)); break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char* image = argv[optind];
+    
+    // Whole chunks only, so verification can compare chunk by chunk
+    size = (size + HOST_CHUNK - 1) / HOST_CHUNK * HOST_CHUNK;
+    
+    if (create_mb && create_image(image, create_mb) != 0) return 1;
+    if (sd_emu_open(image, &config) != 0) return 1;
+    
+    sd_bus_init();
+    int result = -1;
+    
+    if (create_mb) {
+        static BYTE work[FF_MAX_SS];
+        MKFS_PARM parm = { FM_FAT | FM_FAT32, 0, 0, 0, 0 };
+        FRESULT fr = f_mkfs("", &parm, work, sizeof(work));
+        log_flush();
+        if (fr != FR_OK) {
+            printf("f_mkfs failed: %d\n", fr);
+            goto done;
+        }
+        printf("Formatted %lu MB\n", (unsigned long)create_mb);
+    }
+    
+    uint64_t start = time_us_64();
+    FRESULT fr = f_mount(&fs, "", 1);
+    log_flush();
+    if (fr != FR_OK) {
+        printf("f_mount failed: %d\n", fr);
+        goto done;
+    }
+    block_set_metadata_end((uint32_t)fs.database);
+    printf("Mounted in %llu us\n", (unsigned long long)(time_us_64() - start));
+    
+    if (bench) {
+        result = storage_bench_run(&fs) == 0 ? 0 : -1;
+    } else {
+        result = write_test_file(size);
+        log_flush();
+        if (result == 0) result = verify_test_file(size);
+        log_flush();
+        if (result == 0 && f_unlink(HOST_TEST_FILE) != FR_OK) result = -1;
+    }
+    f_unmount("");
+    log_flush();
+    
+    sd_print_stats();
+    block_print_stats();
+    sd_emu_print_stats();
+
+done:
+    log_flush();
+    sd_emu_close();
+    printf("%s\n", result == 0 ? "PASS" : "FAIL");
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+#include "sd_spi.h"
+#include "sd_emu.h"
+#include "host_clock.h"
+
+// Transport for the host build: every byte goes through the emulated card
+// and costs eight clock periods of virtual time. Block transfers complete
+// synchronously, so the poll functions never see work in flight.
+
+// clk_peri on the RP2040, for the divider model below
+#define SD_SPI_EMU_CLK_PERI_HZ 125000000u
+
+static uint32_t sd_spi_byte_ns;
+static uint16_t sd_spi_crc;
+
+// CRC16-CCITT, zero seed: what the DMA sniffer produces on the device
+static uint16_t sd_spi_crc16_update(uint16_t crc, uint8_t byte) {
+    crc ^= (uint16_t)byte << 8;
+    for (int bit = 0; bit < 8; bit++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+void sd_spi_init(void) {
+    sd_spi_set_baudrate(SD_INIT_CLOCK_HZ);
+}
+
+// Divider search of the pico-sdk spi_set_baudrate(), so the host sees the
+// same rounded clocks (50 MHz requested gives 31.25 MHz) as the device
+uint32_t sd_spi_set_baudrate(uint32_t hz) {
+    uint32_t prescale, postdiv;
+    
+    for (prescale = 2; prescale <= 254; prescale += 2) {
+        if (SD_SPI_EMU_CLK_PERI_HZ < (uint64_t)(prescale + 2) * 256 * hz) break;
+    }
+    for (postdiv = 256; postdiv > 1; --postdiv) {
+        if (SD_SPI_EMU_CLK_PERI_HZ / (prescale * (postdiv - 1)) > hz) break;
+    }
+    
+    uint32_t actual = SD_SPI_EMU_CLK_PERI_HZ / (prescale * postdiv);
+    sd_spi_byte_ns = (uint32_t)(8000000000ull / actual);
+    sd_emu_set_clock_hz(actual);
+    return actual;
+}
+
+uint8_t sd_spi_write(uint8_t data) {
+    host_clock_advance_ns(sd_spi_byte_ns);
+    return sd_emu_exchange(data);
+}
+
+void sd_spi_transfer_start(const uint8_t* tx, uint8_t* rx, size_t len) {
+    uint16_t crc = 0;
+    
+    for (size_t i = 0; i < len; i++) {
+        uint8_t out = tx ? tx[i] : 0xFF;
+        uint8_t in = sd_spi_write(out);
+        if (rx) rx[i] = in;
+        crc = sd_spi_crc16_update(crc, tx ? out : in);
+    }
+    sd_spi_crc = crc;
+}
+
+bool sd_spi_transfer_poll(uint16_t* crc) {
+    *crc = sd_spi_crc;
+    return true;
+}
+
+uint16_t sd_spi_transfer_block(const uint8_t* tx, uint8_t* rx, size_t len) {
+    uint16_t crc;
+    
+    sd_spi_transfer_start(tx, rx, len);
+    sd_spi_transfer_poll(&crc);
+    return crc;
+}
+
+uint8_t sd_spi_wait_token(absolute_time_t deadline) {
+    uint8_t token;
+    do {
+        token = sd_spi_write(0xFF);
+    } while (token == 0xFF && !time_reached(deadline));
+    return token;
+}
+
+// Same per-call budget as the hardware transport
+bool sd_spi_poll_token(uint8_t* token) {
+    for (int i = 0; i < 8; i++) {
+        *token = sd_spi_write(0xFF);
+        if (*token != 0xFF) return true;
+    }
+    return false;
+}
+
+void sd_spi_cancel_token(void) {
+}
+
+const char* sd_spi_transport_name(void) {
+    return "EMU";
+}
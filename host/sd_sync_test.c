@@ -0,0 +1,68 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sd_card.h"
+#include "log.h"
+#include "sd_emu.h"
+
+// sd_sync() against the emulated card's program-error fault: a block the
+// card accepts but then fails to program is only visible in the CMD13
+// status. Every such write must be reported by the next sync, even when
+// another command has already waited for the card's busy period.
+
+#define TEST_IMAGE_MB 4
+
+static int failed = 0;
+
+static void check(bool ok, const char* what) {
+    log_flush();
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) failed++;
+}
+
+int main(int argc, char** argv) {
+    static uint8_t block[512];
+    const char* image = argc > 1 ? argv[1] : "sd_sync_test.img";
+    sd_emu_config_t config;
+    
+    int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, TEST_IMAGE_MB * 1024 * 1024) != 0) {
+        perror(image);
+        return 1;
+    }
+    close(fd);
+    
+    sd_emu_default_config(&config);
+    if (sd_emu_open(image, &config) != 0) return 1;
+    
+    sd_bus_init();
+    if (sd_init_driver() != 0) {
+        log_flush();
+        printf("FAIL\n");
+        return 1;
+    }
+    memset(block, 0x5A, sizeof(block));
+    
+    check(sd_write_sectors(block, 100, 1) == 0 && sd_sync() == 0, "clean write");
+    
+    sd_emu_inject(SD_EMU_FAULT_PROGRAM_ERROR, 1);
+    check(sd_write_sectors(block, 101, 1) == 0 && sd_sync() != 0, "program error, sync right after");
+    check(sd_sync() == 0, "reported once");
+    
+    // The read waits out the write's busy period before the sync does
+    sd_emu_inject(SD_EMU_FAULT_PROGRAM_ERROR, 1);
+    check(sd_write_sectors(block, 102, 1) == 0 && sd_read_sectors(block, 200, 1) == 0 &&
+          sd_sync() != 0, "program error, read before sync");
+    
+    sd_emu_inject(SD_EMU_FAULT_PROGRAM_ERROR, 1);
+    check(sd_write_sectors(block, 103, 1) == 0 && sd_erase_sectors(0, 64) == 0 &&
+          sd_sync() != 0, "program error, erase before sync");
+    
+    check(sd_sync() == 0, "nothing written since");
+    
+    sd_emu_close();
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? 1 : 0;
+}
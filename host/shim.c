@@ -0,0 +1,14 @@
+#include "sd_card.h"
+#include "sd_emu.h"
+#include "hardware/gpio.h"
+
+// Same pin numbers as main.c; only CS means anything here
+spi_inst_t* const SD_SPI_PORT = NULL;
+const uint SD_PIN_MISO = 4;
+const uint SD_PIN_CS   = 5;
+const uint SD_PIN_SCK  = 2;
+const uint SD_PIN_MOSI = 3;
+
+void gpio_put(uint gpio, bool value) {
+    if (gpio == SD_PIN_CS) sd_emu_select(!value);
+}
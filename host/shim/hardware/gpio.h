@@ -0,0 +1,10 @@
+#ifndef HOST_HARDWARE_GPIO_H
+#define HOST_HARDWARE_GPIO_H
+
+#include <stdbool.h>
+#include "pico/stdlib.h"
+
+// Only chip select reaches the emulated card; other pins are ignored
+void gpio_put(uint gpio, bool value);
+
+#endif // HOST_HARDWARE_GPIO_H
@@ -0,0 +1,9 @@
+#ifndef HOST_HARDWARE_SPI_H
+#define HOST_HARDWARE_SPI_H
+
+#include "pico/stdlib.h"
+
+// Only the type is needed: the emulated transport replaces the SPI block
+typedef struct spi_inst spi_inst_t;
+
+#endif // HOST_HARDWARE_SPI_H
@@ -0,0 +1,13 @@
+#ifndef HOST_CLOCK_H
+#define HOST_CLOCK_H
+
+#include <stdint.h>
+
+// Virtual time for the host build, in nanoseconds since start
+uint64_t host_clock_ns(void);
+void host_clock_advance_ns(uint64_t ns);
+
+// Cost charged for one iteration of a polling loop
+#define HOST_CLOCK_POLL_NS 1000
+
+#endif // HOST_CLOCK_H
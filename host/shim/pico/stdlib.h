@@ -0,0 +1,69 @@
+#ifndef HOST_PICO_STDLIB_H
+#define HOST_PICO_STDLIB_H
+
+// Host stand-in for the parts of pico/stdlib.h the SD code uses. Time is
+// virtual (host_clock.h): it advances with emulated bus traffic and with
+// explicit waits, never with host CPU time, so runs are reproducible.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "host_clock.h"
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+static inline uint64_t time_us_64(void) {
+    return host_clock_ns() / 1000;
+}
+
+static inline uint32_t time_us_32(void) {
+    return (uint32_t)time_us_64();
+}
+
+static inline absolute_time_t get_absolute_time(void) {
+    return time_us_64();
+}
+
+static inline absolute_time_t make_timeout_time_us(uint64_t us) {
+    return time_us_64() + us;
+}
+
+static inline absolute_time_t make_timeout_time_ms(uint32_t ms) {
+    return make_timeout_time_us((uint64_t)ms * 1000);
+}
+
+static inline bool time_reached(absolute_time_t t) {
+    return time_us_64() >= t;
+}
+
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) {
+    return (int64_t)(to - from);
+}
+
+static inline uint32_t to_ms_since_boot(absolute_time_t t) {
+    return (uint32_t)(t / 1000);
+}
+
+static inline void sleep_us(uint64_t us) {
+    host_clock_advance_ns(us * 1000);
+}
+
+static inline void sleep_ms(uint32_t ms) {
+    sleep_us((uint64_t)ms * 1000);
+}
+
+// Busy-wait loops must make progress in virtual time
+static inline void tight_loop_contents(void) {
+    host_clock_advance_ns(HOST_CLOCK_POLL_NS);
+}
+
+// Core the calling thread stands for: 0 unless a test runs core1 code on
+// a thread of its own (host_clock.c)
+extern _Thread_local uint host_core_num;
+
+static inline uint get_core_num(void) {
+    return host_core_num;
+}
+
+#endif // HOST_PICO_STDLIB_H
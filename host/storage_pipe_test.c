@@ -0,0 +1,235 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "storage_pipe.h"
+#include "block_dev.h"
+#include "sd_card.h"
+#include "pico/stdlib.h"
+
+// The cross-core pipeline on two threads: this one is core0, a second one
+// runs storage_pipe_core1_run() as core1. The block layer and the driver
+// are replaced by a RAM disk whose reads and discards can be held back,
+// so requests can be caught while they are still queued or in flight.
+
+#define DISK_SECTORS (64 * 1024)
+
+static uint8_t* disk;
+
+// Set by the test, read by core1
+static int hold_io = 0;             // Reads and discards wait while set
+static uint32_t fail_sector = UINT32_MAX;   // A write covering it fails
+
+// Updated by core1, read by the test
+static int reads_at_100 = 0;
+static uint32_t discarded = 0;
+
+static int failed = 0;
+
+static void check(bool ok, const char* what) {
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    if (!ok) failed++;
+}
+
+static void wait_io(void) {
+    while (__atomic_load_n(&hold_io, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+//--------------------------------------------------------------------+
+// RAM disk in place of the block layer and the SD driver (core1)
+//--------------------------------------------------------------------+
+
+int block_read(void* buffer, uint32_t sector, uint32_t count) {
+    memcpy(buffer, disk + sector * 512, count * 512);
+    return 0;
+}
+
+// Copies before waiting, like a read the card has already answered
+int block_read_bulk(void* buffer, uint32_t sector, uint32_t count) {
+    if (sector == 100) __atomic_fetch_add(&reads_at_100, 1, __ATOMIC_RELAXED);
+    memcpy(buffer, disk + sector * 512, count * 512);
+    wait_io();
+    return 0;
+}
+
+int block_write(const void* buffer, uint32_t sector, uint32_t count) {
+    uint32_t fail = __atomic_load_n(&fail_sector, __ATOMIC_ACQUIRE);
+    
+    if (fail >= sector && fail < sector + count) return -1;
+    memcpy(disk + sector * 512, buffer, count * 512);
+    return 0;
+}
+
+int block_sync(void) {
+    return 0;
+}
+
+int block_discard(uint32_t sector, uint32_t count) {
+    wait_io();
+    memset(disk + sector * 512, 0, count * 512);
+    __atomic_fetch_add(&discarded, count, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void block_task(void) {
+    sched_yield();
+}
+
+void block_invalidate_all(void) {}
+void block_print_stats(void) {}
+void block_reset_stats(void) {}
+
+int sd_init_driver(void) {
+    return 0;
+}
+
+uint32_t sd_get_sectors_count(void) {
+    return DISK_SECTORS;
+}
+
+void sd_task(void) {}
+void sd_print_stats(void) {}
+void sd_reset_stats(void) {}
+
+static void* core1_main(void* arg) {
+    (void)arg;
+    host_core_num = 1;
+    storage_pipe_core1_run();
+    return NULL;
+}
+
+//--------------------------------------------------------------------+
+// Core0
+//--------------------------------------------------------------------+
+
+static void fill(uint8_t* buffer, uint32_t sector, uint32_t count, uint8_t salt) {
+    for (uint32_t i = 0; i < count * 512; i++) {
+        buffer[i] = (uint8_t)((sector + i / 512) * 7 + i + salt);
+    }
+}
+
+static int32_t msc_read(void* buffer, uint32_t sector, uint32_t count) {
+    int32_t result;
+    while ((result = storage_msc_read(buffer, sector, count)) == 0) sched_yield();
+    return result;
+}
+
+static int32_t msc_write(const void* buffer, uint32_t sector, uint32_t count) {
+    int32_t result;
+    while ((result = storage_msc_write(buffer, sector, count)) == 0) sched_yield();
+    return result;
+}
+
+static bool sectors_zero(uint32_t sector, uint32_t count) {
+    for (uint32_t i = 0; i < count * 512; i++) {
+        if (disk[sector * 512 + i]) return false;
+    }
+    return true;
+}
+
+// A sequential stream is served from prefetched slots; a jump drops them
+static void test_prefetch(void) {
+    static uint8_t buffer[4096], expect[4096];
+    storage_pipe_stats_t stats;
+    
+    storage_pipe_reset_stats();
+    check(storage_msc_read(buffer, 0, 8) == 0, "first read reports busy");
+    fill(expect, 0, 8, 0);
+    check(msc_read(buffer, 0, 8) == 4096 && memcmp(buffer, expect, 4096) == 0, "first read");
+    
+    fill(expect, 8, 8, 0);
+    check(msc_read(buffer, 8, 8) == 4096 && memcmp(buffer, expect, 4096) == 0, "next read");
+    storage_pipe_get_stats(&stats);
+    check(stats.read_hits == 1 && stats.prefetched >= 1, "next read hits a prefetched slot");
+    
+    fill(expect, 1000, 8, 0);
+    check(msc_read(buffer, 1000, 8) == 4096 && memcmp(buffer, expect, 4096) == 0, "read elsewhere");
+    storage_pipe_get_stats(&stats);
+    check(stats.read_hits == 1 && stats.wasted >= 1, "read elsewhere misses and drops the prefetch");
+}
+
+// A write to sectors whose read core1 has already done must not let the
+// old data through to a later read
+static void test_write_over_read(void) {
+    static uint8_t buffer[4096], data[4096];
+    
+    storage_msc_sync();
+    __atomic_store_n(&hold_io, 1, __ATOMIC_RELEASE);
+    check(storage_msc_read(buffer, 100, 8) == 0, "read queued");
+    while (__atomic_load_n(&reads_at_100, __ATOMIC_RELAXED) == 0) sched_yield();
+    
+    fill(data, 100, 8, 0x55);
+    check(msc_write(data, 100, 8) == 4096, "write over the read in flight");
+    __atomic_store_n(&hold_io, 0, __ATOMIC_RELEASE);
+    
+    check(msc_read(buffer, 100, 8) == 4096 && memcmp(buffer, data, 4096) == 0, "read returns the new data");
+    check(__atomic_load_n(&reads_at_100, __ATOMIC_RELAXED) == 2, "read issued again");
+}
+
+// A write into an UNMAP range still waiting on core0 splits the range
+static void test_discard_trim(void) {
+    static uint8_t data[4096];
+    const uint32_t start = 2 * SD_ERASE_MAX_SECTORS;
+    const uint32_t count = 3 * SD_ERASE_MAX_SECTORS;
+    const uint32_t hole = start + SD_ERASE_MAX_SECTORS + 1000;
+    storage_pipe_stats_t stats;
+    
+    storage_msc_sync();
+    storage_pipe_reset_stats();
+    uint32_t before = __atomic_load_n(&discarded, __ATOMIC_ACQUIRE);
+    
+    // Core1 sits on the first piece while the rest waits here
+    __atomic_store_n(&hold_io, 1, __ATOMIC_RELEASE);
+    check(storage_msc_discard(start, count) == 0, "discard queued");
+    fill(data, hole, 8, 0xAA);
+    check(msc_write(data, hole, 8) == 4096, "write into the discarded range");
+    __atomic_store_n(&hold_io, 0, __ATOMIC_RELEASE);
+    
+    for (long i = 0; i < 100000000 &&
+         __atomic_load_n(&discarded, __ATOMIC_ACQUIRE) - before < count - 8; i++) {
+        storage_pipe_task();
+        sched_yield();
+    }
+    check(storage_msc_sync() == 0, "sync");
+    
+    storage_pipe_get_stats(&stats);
+    check(__atomic_load_n(&discarded, __ATOMIC_ACQUIRE) - before == count - 8 && stats.unmap_dropped == 0,
+          "everything but the written sectors discarded");
+    check(memcmp(disk + hole * 512, data, 4096) == 0, "written sectors kept");
+    check(sectors_zero(start, hole - start) && sectors_zero(hole + 8, start + count - hole - 8),
+          "rest of the range discarded");
+}
+
+// A queued write is acknowledged at once, so its failure can only be
+// reported by the next SYNCHRONIZE CACHE
+static void test_write_failure(void) {
+    static uint8_t data[512];
+    
+    check(storage_msc_sync() == 0, "clean sync");
+    __atomic_store_n(&fail_sector, 777, __ATOMIC_RELEASE);
+    check(msc_write(data, 777, 1) == 512, "failing write acknowledged");
+    check(storage_msc_sync() == -1, "sync reports the failed write");
+    check(storage_msc_sync() == 0, "reported once");
+    __atomic_store_n(&fail_sector, UINT32_MAX, __ATOMIC_RELEASE);
+}
+
+int main(void) {
+    pthread_t core1;
+    
+    disk = malloc((size_t)DISK_SECTORS * 512);
+    if (!disk) return 1;
+    fill(disk, 0, DISK_SECTORS, 0);
+    
+    storage_pipe_enable();
+    if (pthread_create(&core1, NULL, core1_main, NULL) != 0) return 1;
+    
+    test_prefetch();
+    test_write_over_read();
+    test_discard_trim();
+    test_write_failure();
+    
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,542 @@
+#include "block_dev.h"
+#include "sd_card.h"
+#include "log.h"
+#include "pico/stdlib.h"
+#include <string.h>
+#include <stdio.h>
+
+typedef struct {
+    uint32_t sector;
+    uint32_t last_used;     // block_tick at the last hit or fill; 0 = invalid
+} block_line_t;
+
+static block_line_t block_lines[BLOCK_CACHE_SETS][BLOCK_CACHE_WAYS];
+static uint8_t block_data[BLOCK_CACHE_SETS][BLOCK_CACHE_WAYS][512];
+static uint32_t block_tick = 0;
+static block_stats_t block_stats;
+
+#if BLOCK_READAHEAD_SECTORS > 0
+// One prefetch window, filled by an asynchronous SD request
+typedef struct {
+    sd_request_t request;
+    bool armed;             // Submitted since the last invalidate
+    uint8_t data[BLOCK_READAHEAD_SECTORS * 512];
+} block_window_t;
+
+static block_window_t block_ra[2];
+#endif
+
+#if BLOCK_WRITEBACK_SECTORS > 0
+// Write-back buffer: one run of consecutive sectors
+static uint8_t block_wb_data[BLOCK_WRITEBACK_SECTORS * 512];
+static uint32_t block_wb_sector = 0;
+static uint32_t block_wb_count = 0;
+static uint64_t block_wb_since_us = 0;  // When the run was started
+#endif
+static bool block_wb_failed = false;    // A flush failed since the last sync
+static uint32_t block_metadata_end = 0;
+
+static uint32_t block_ra_depth = BLOCK_READAHEAD_SECTORS;
+static uint32_t block_stream_next = 0;  // Sector a sequential read would start at
+static uint32_t block_stream_run = 0;   // Sequential reads seen in a row
+
+static inline uint32_t block_set_of(uint32_t sector) {
+    return sector % BLOCK_CACHE_SETS;
+}
+
+static int block_lookup(uint32_t sector) {
+    block_line_t* set = block_lines[block_set_of(sector)];
+    for (int way = 0; way < BLOCK_CACHE_WAYS; way++) {
+        if (set[way].last_used && set[way].sector == sector) {
+            return way;
+        }
+    }
+    return -1;
+}
+
+static void block_touch(uint32_t sector, int way) {
+    // Tick 0 marks an invalid line, so skip it on wrap-around
+    if (++block_tick == 0) block_tick = 1;
+    block_lines[block_set_of(sector)][way].last_used = block_tick;
+}
+
+// Invalid way if there is one, otherwise the least recently used
+static int block_victim(uint32_t sector) {
+    block_line_t* set = block_lines[block_set_of(sector)];
+    int victim = 0;
+    for (int way = 0; way < BLOCK_CACHE_WAYS; way++) {
+        if (!set[way].last_used) return way;
+        if (set[way].last_used < set[victim].last_used) victim = way;
+    }
+    block_stats.evictions++;
+    return victim;
+}
+
+static void block_fill(uint32_t sector, const uint8_t* data) {
+    int way = block_lookup(sector);
+    if (way < 0) {
+        way = block_victim(sector);
+        block_lines[block_set_of(sector)][way].sector = sector;
+    }
+    memcpy(block_data[block_set_of(sector)][way], data, 512);
+    block_touch(sector, way);
+}
+
+//--------------------------------------------------------------------+
+// Read-ahead
+//--------------------------------------------------------------------+
+
+#if BLOCK_READAHEAD_SECTORS > 0
+static bool block_window_covers(const block_window_t* w, uint32_t sector) {
+    return w->armed && sector >= w->request.sector &&
+           sector < w->request.sector + w->request.count;
+}
+
+// Covers the sector and has not failed or been cancelled
+static bool block_window_holds(const block_window_t* w, uint32_t sector) {
+    return block_window_covers(w, sector) &&
+           w->request.status != SD_REQUEST_ERROR &&
+           w->request.status != SD_REQUEST_CANCELLED;
+}
+
+static bool block_window_valid(const block_window_t* w) {
+    return w->armed && w->request.status == SD_REQUEST_DONE;
+}
+
+static bool block_window_in_flight(const block_window_t* w) {
+    return w->armed && sd_request_pending(&w->request);
+}
+
+static void block_window_wait(block_window_t* w) {
+    while (block_window_in_flight(w)) {
+        sd_task();
+    }
+}
+
+// Copy a sector out of a landed window
+static bool block_ra_read(uint8_t* buf, uint32_t sector) {
+    for (int i = 0; i < 2; i++) {
+        block_window_t* w = &block_ra[i];
+        if (block_window_valid(w) && block_window_covers(w, sector)) {
+            memcpy(buf, w->data + (sector - w->request.sector) * 512, 512);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Keep a window ahead of the stream: the one holding the next sector
+// (landed or in flight) plus the following one
+static void block_ra_advance(void) {
+    uint32_t next = block_stream_next;
+    uint32_t total = sd_get_sectors_count();
+    
+    for (int step = 0; step < 2 && next < total; step++) {
+        int holder = -1;
+        for (int i = 0; i < 2; i++) {
+            if (block_window_holds(&block_ra[i], next)) holder = i;
+        }
+    
+        if (holder >= 0) {
+            next = block_ra[holder].request.sector + block_ra[holder].request.count;
+            continue;
+        }
+    
+        // Reuse a window that is not in flight and holds nothing still ahead
+        int free_window = -1;
+        for (int i = 0; i < 2; i++) {
+            block_window_t* w = &block_ra[i];
+            if (block_window_in_flight(w)) continue;
+            if (block_window_holds(w, block_stream_next)) continue;
+            free_window = i;
+        }
+        if (free_window < 0) return;
+    
+        block_window_t* w = &block_ra[free_window];
+        uint32_t count = block_ra_depth;
+        if (count > total - next) count = total - next;
+    
+        memset(&w->request, 0, sizeof(w->request));
+        w->request.write = false;
+        w->request.buffer = w->data;
+        w->request.sector = next;
+        w->request.count = count;
+        w->armed = sd_submit(&w->request) == 0;
+        if (!w->armed) return;
+    
+        block_stats.ra_fetched += count;
+        next += count;
+    }
+}
+
+// Drop windows overlapping a range, waiting out any request still filling one
+static void block_ra_invalidate(uint32_t sector, uint32_t count) {
+    for (int i = 0; i < 2; i++) {
+        block_window_t* w = &block_ra[i];
+        if (!w->armed) continue;
+        if (sector + count <= w->request.sector ||
+            sector >= w->request.sector + w->request.count) continue;
+    
+        if (block_window_in_flight(w)) {
+            sd_cancel(&w->request);
+            block_window_wait(w);
+        }
+        w->armed = false;
+    }
+}
+
+// Wait for a prefetch that already covers part of a range instead of
+// reading those sectors a second time
+static void block_ra_wait_overlapping(uint32_t sector, uint32_t count) {
+    for (int i = 0; i < 2; i++) {
+        block_window_t* w = &block_ra[i];
+        if (!block_window_in_flight(w)) continue;
+        if (sector + count <= w->request.sector ||
+            sector >= w->request.sector + w->request.count) continue;
+        block_window_wait(w);
+    }
+}
+#endif
+
+// Track sequential access after a read has been served. Runs long enough
+// to bypass the cache are one multi-block read each already; windows
+// fetched behind them would only be read again by the next run.
+static void block_stream_update(uint32_t sector, uint32_t count) {
+    block_stream_run = (sector == block_stream_next) ? block_stream_run + 1 : 0;
+    block_stream_next = sector + count;
+    
+#if BLOCK_READAHEAD_SECTORS > 0
+    if (block_ra_depth > 0 && block_stream_run >= BLOCK_READAHEAD_TRIGGER &&
+        count <= BLOCK_CACHE_MAX_RUN) {
+        block_ra_advance();
+    }
+#endif
+}
+
+void block_set_readahead(uint32_t sectors) {
+    if (sectors > BLOCK_READAHEAD_SECTORS) sectors = BLOCK_READAHEAD_SECTORS;
+    block_ra_depth = sectors;
+}
+
+//--------------------------------------------------------------------+
+// Write-back
+//--------------------------------------------------------------------+
+
+static bool block_ranges_overlap(uint32_t a, uint32_t a_count, uint32_t b, uint32_t b_count) {
+    return a < b + b_count && b < a + a_count;
+}
+
+// Send the buffered run as one burst. The buffer is emptied even on
+// failure; the error is kept for the next block_sync().
+static int block_wb_flush(void) {
+#if BLOCK_WRITEBACK_SECTORS > 0
+    if (block_wb_count == 0) return 0;
+    
+    uint32_t sector = block_wb_sector;
+    uint32_t count = block_wb_count;
+    block_wb_count = 0;
+    
+    block_stats.wb_flushes++;
+    block_stats.wb_sectors += count;
+    
+    if (sd_write_sectors(block_wb_data, sector, count) != 0) {
+        LOG_ERROR("Write-back flush of %lu+%lu failed\n", (unsigned long)sector, (unsigned long)count);
+        block_invalidate(sector, count);
+        block_wb_failed = true;
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static bool block_wb_overlaps(uint32_t sector, uint32_t count) {
+#if BLOCK_WRITEBACK_SECTORS > 0
+    return block_wb_count && block_ranges_overlap(sector, count, block_wb_sector, block_wb_count);
+#else
+    (void)sector;
+    (void)count;
+    return false;
+#endif
+}
+
+void block_task(void) {
+#if BLOCK_WRITEBACK_SECTORS > 0
+    if (block_wb_count == 0 || sd_is_busy()) return;
+    
+    if (time_us_64() - block_wb_since_us >= BLOCK_WRITEBACK_TIMEOUT_MS * 1000ull) {
+        block_wb_flush();
+    }
+#endif
+}
+
+void block_set_metadata_end(uint32_t sector) {
+    block_metadata_end = sector;
+}
+
+//--------------------------------------------------------------------+
+// Block access
+//--------------------------------------------------------------------+
+
+// One sector from RAM, if it is anywhere
+static bool block_read_ram(uint8_t* buf, uint32_t sector) {
+#if BLOCK_READAHEAD_SECTORS > 0
+    if (block_ra_read(buf, sector)) {
+        block_stats.ra_hits++;
+        return true;
+    }
+#endif
+    
+    int way = block_lookup(sector);
+    if (way < 0) return false;
+    
+    memcpy(buf, block_data[block_set_of(sector)][way], 512);
+    block_touch(sector, way);
+    block_stats.hits++;
+    return true;
+}
+
+bool block_read_cached(void* buffer, uint32_t sector, uint32_t count) {
+    uint8_t* buf = (uint8_t*)buffer;
+    
+    // Buffered writes are newer than anything here
+    if (block_wb_overlaps(sector, count)) return false;
+    
+    // All or nothing, so check before copying (and counting)
+    for (uint32_t i = 0; i < count; i++) {
+        bool present = block_lookup(sector + i) >= 0;
+#if BLOCK_READAHEAD_SECTORS > 0
+        for (int w = 0; w < 2 && !present; w++) {
+            present = block_window_valid(&block_ra[w]) && block_window_covers(&block_ra[w], sector + i);
+        }
+#endif
+        if (!present) return false;
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        block_read_ram(buf + i * 512, sector + i);
+    }
+    
+    block_stream_update(sector, count);
+    return true;
+}
+
+// With fill false, misses are read without taking cache lines
+static int block_read_through(void* buffer, uint32_t sector, uint32_t count, bool fill) {
+    uint8_t* buf = (uint8_t*)buffer;
+    
+#if BLOCK_READAHEAD_SECTORS > 0
+    block_ra_wait_overlapping(sector, count);
+#endif
+    
+    if (block_wb_overlaps(sector, count) && block_wb_flush() != 0) {
+        return -1;
+    }
+    
+    if (block_read_cached(buf, sector, count)) {
+        return 0;
+    }
+    
+    // Cached copies always match the card (writes go through), so long
+    // runs can skip the lookup entirely
+    if (count > BLOCK_CACHE_MAX_RUN) {
+        block_stats.bypassed += count;
+        if (sd_read_sectors(buf, sector, count) != 0) return -1;
+        block_stream_update(sector, count);
+        return 0;
+    }
+    
+    uint32_t i = 0;
+    while (i < count) {
+        if (block_read_ram(buf + i * 512, sector + i)) {
+            i++;
+            continue;
+        }
+    
+        // Read the whole run of consecutive misses in one command
+        uint32_t run = 1;
+        while (i + run < count && block_lookup(sector + i + run) < 0) {
+            run++;
+        }
+    
+        if (sd_read_sectors(buf + i * 512, sector + i, run) != 0) {
+            return -1;
+        }
+    
+        if (fill) {
+            for (uint32_t j = 0; j < run; j++) {
+                block_fill(sector + i + j, buf + (i + j) * 512);
+            }
+            block_stats.misses += run;
+        } else {
+            block_stats.bypassed += run;
+        }
+        i += run;
+    }
+    
+    block_stream_update(sector, count);
+    return 0;
+}
+
+int block_read(void* buffer, uint32_t sector, uint32_t count) {
+    return block_read_through(buffer, sector, count, true);
+}
+
+int block_read_bulk(void* buffer, uint32_t sector, uint32_t count) {
+    return block_read_through(buffer, sector, count, sector < block_metadata_end);
+}
+
+// Refresh copies that are already cached; no allocation on write
+static void block_update_cached(const uint8_t* buf, uint32_t sector, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        int way = block_lookup(sector + i);
+        if (way >= 0) {
+            memcpy(block_data[block_set_of(sector + i)][way], buf + i * 512, 512);
+            block_touch(sector + i, way);
+        }
+    }
+}
+
+int block_write(const void* buffer, uint32_t sector, uint32_t count) {
+    const uint8_t* buf = (const uint8_t*)buffer;
+    
+#if BLOCK_READAHEAD_SECTORS > 0
+    block_ra_invalidate(sector, count);
+#endif
+    
+    block_update_cached(buf, sector, count);
+    block_stats.writes += count;
+    
+#if BLOCK_WRITEBACK_SECTORS > 0
+    bool metadata = sector < block_metadata_end;
+    
+    // Extend the buffered run if this continues it and fits
+    if (!metadata && block_wb_count && sector == block_wb_sector + block_wb_count &&
+        block_wb_count + count <= BLOCK_WRITEBACK_SECTORS) {
+        memcpy(block_wb_data + block_wb_count * 512, buf, count * 512);
+        block_wb_count += count;
+        if (block_wb_count < BLOCK_WRITEBACK_SECTORS) return 0;
+        return block_wb_flush();
+    }
+    
+    // Gap, overflow or metadata: whatever is buffered goes first, so the
+    // card sees writes in the order they were issued
+    if (block_wb_flush() != 0) {
+        block_invalidate(sector, count);
+        return -1;
+    }
+    
+    if (!metadata && count < BLOCK_WRITEBACK_SECTORS) {
+        memcpy(block_wb_data, buf, count * 512);
+        block_wb_sector = sector;
+        block_wb_count = count;
+        block_wb_since_us = time_us_64();
+        return 0;
+    }
+#endif
+    
+    if (sd_write_sectors(buf, sector, count) != 0) {
+        // The card may hold a mix of old and new data now
+        block_invalidate(sector, count);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int block_discard(uint32_t sector, uint32_t count) {
+    // Keep the card's view in issue order: earlier writes land first
+    if (block_wb_overlaps(sector, count) && block_wb_flush() != 0) {
+        return -1;
+    }
+    
+    block_invalidate(sector, count);
+    block_stats.discarded += count;
+    
+    return sd_erase_sectors(sector, count);
+}
+
+int block_sync(void) {
+    int result = block_wb_flush();
+    
+    if (sd_sync() != 0) result = -1;
+    if (block_wb_failed) {
+        block_wb_failed = false;
+        result = -1;
+    }
+    
+    return result;
+}
+
+void block_invalidate(uint32_t sector, uint32_t count) {
+#if BLOCK_READAHEAD_SECTORS > 0
+    block_ra_invalidate(sector, count);
+#endif
+    
+    // A range wider than the cache is cheaper to check line by line
+    if (count > BLOCK_CACHE_SETS * BLOCK_CACHE_WAYS) {
+        for (uint32_t set = 0; set < BLOCK_CACHE_SETS; set++) {
+            for (int way = 0; way < BLOCK_CACHE_WAYS; way++) {
+                block_line_t* line = &block_lines[set][way];
+                if (line->last_used && line->sector - sector < count) {
+                    line->last_used = 0;
+                }
+            }
+        }
+        return;
+    }
+    
+    for (uint32_t i = 0; i < count; i++) {
+        int way = block_lookup(sector + i);
+        if (way >= 0) {
+            block_lines[block_set_of(sector + i)][way].last_used = 0;
+        }
+    }
+}
+
+void block_invalidate_all(void) {
+#if BLOCK_READAHEAD_SECTORS > 0
+    block_ra_invalidate(0, UINT32_MAX);
+#endif
+    
+#if BLOCK_WRITEBACK_SECTORS > 0
+    // Only called after (re)initialising the card; buffered data is stale
+    block_wb_count = 0;
+#endif
+    block_wb_failed = false;
+    
+    memset(block_lines, 0, sizeof(block_lines));
+    block_tick = 0;
+    block_stream_next = 0;
+    block_stream_run = 0;
+}
+
+void block_get_stats(block_stats_t* stats) {
+    *stats = block_stats;
+}
+
+void block_reset_stats(void) {
+    memset(&block_stats, 0, sizeof(block_stats));
+}
+
+// Hit rates in tenths of a percent of all sectors read
+void block_print_stats(void) {
+    uint32_t total = block_stats.hits + block_stats.ra_hits +
+                     block_stats.misses + block_stats.bypassed;
+    if (total == 0) total = 1;
+    
+    printf("Block cache: %lu hits (%lu.%lu%%), %lu misses, %lu bypassed, %lu evictions\n",
+           (unsigned long)block_stats.hits,
+           (unsigned long)(block_stats.hits * 1000ull / total / 10),
+           (unsigned long)(block_stats.hits * 1000ull / total % 10),
+           (unsigned long)block_stats.misses, (unsigned long)block_stats.bypassed,
+           (unsigned long)block_stats.evictions);
+    printf("Write-back: %lu sectors written, %lu bursts of %lu sectors on average, %lu discarded\n",
+           (unsigned long)block_stats.writes, (unsigned long)block_stats.wb_flushes,
+           (unsigned long)(block_stats.wb_flushes ? block_stats.wb_sectors / block_stats.wb_flushes : 0),
+           (unsigned long)block_stats.discarded);
+    printf("Read-ahead: depth %lu, %lu hits (%lu.%lu%%), %lu sectors prefetched\n",
+           (unsigned long)block_ra_depth, (unsigned long)block_stats.ra_hits,
+           (unsigned long)(block_stats.ra_hits * 1000ull / total / 10),
+           (unsigned long)(block_stats.ra_hits * 1000ull / total % 10),
+           (unsigned long)block_stats.ra_fetched);
+}
@@ -0,0 +1,104 @@
+#ifndef BLOCK_DEV_H
+#define BLOCK_DEV_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Block layer between the SD driver and its users (diskio.c for FatFs, the
+// MSC callbacks in main.c). Keeps an N-way set-associative cache of 512-byte
+// sectors so FAT, directory and boot sectors stop going to the card.
+// Writes to consecutive sectors are collected in a write-back buffer and
+// go out as one multi-block burst; cached copies are updated on the way in.
+
+// Cache geometry: BLOCK_CACHE_SETS * BLOCK_CACHE_WAYS sectors of RAM
+#ifndef BLOCK_CACHE_SETS
+#define BLOCK_CACHE_SETS    16
+#endif
+
+#ifndef BLOCK_CACHE_WAYS
+#define BLOCK_CACHE_WAYS    4      // 16 x 4 = 64 sectors, 32 KiB
+#endif
+
+// Read-ahead window in sectors. Two windows are kept, so a sequential
+// stream has the next one filling (async, multi-block DMA) while the
+// current one is being served. 0 disables read-ahead.
+#ifndef BLOCK_READAHEAD_SECTORS
+#define BLOCK_READAHEAD_SECTORS 16  // 2 x 8 KiB
+#endif
+
+// Sequential reads seen in a row before prefetching starts
+#ifndef BLOCK_READAHEAD_TRIGGER
+#define BLOCK_READAHEAD_TRIGGER 2
+#endif
+
+// Write-back buffer in sectors; 0 makes every write go straight through
+#ifndef BLOCK_WRITEBACK_SECTORS
+#define BLOCK_WRITEBACK_SECTORS 32  // 16 KiB
+#endif
+
+// Buffered data older than this is flushed by block_task()
+#ifndef BLOCK_WRITEBACK_TIMEOUT_MS
+#define BLOCK_WRITEBACK_TIMEOUT_MS 100
+#endif
+
+// Reads longer than this go straight to the card so bulk file data does
+// not flush out the metadata the cache is for
+#ifndef BLOCK_CACHE_MAX_RUN
+#define BLOCK_CACHE_MAX_RUN 8
+#endif
+
+typedef struct {
+    uint32_t hits;          // Sectors served from the cache
+    uint32_t misses;        // Sectors read from the card and cached
+    uint32_t bypassed;      // Sectors read from the card without being cached
+    uint32_t writes;        // Sectors written by callers
+    uint32_t wb_flushes;    // Bursts sent from the write-back buffer
+    uint32_t wb_sectors;    // Sectors sent in those bursts
+    uint32_t discarded;     // Sectors passed to block_discard()
+    uint32_t evictions;     // Valid lines replaced
+    uint32_t ra_hits;       // Sectors served from a read-ahead window
+    uint32_t ra_fetched;    // Sectors prefetched
+} block_stats_t;
+
+int block_read(void* buffer, uint32_t sector, uint32_t count);
+
+// Read for the MSC data path: hits and read-ahead are served as usual,
+// but misses above the metadata area take no cache lines. A host copying
+// files reads in MSC-buffer-sized chunks, often no longer than
+// BLOCK_CACHE_MAX_RUN, which would otherwise evict FAT and directory lines.
+int block_read_bulk(void* buffer, uint32_t sector, uint32_t count);
+
+// Serve a read from RAM only (cache and read-ahead); false if any sector
+// would need the card. Safe while the card is busy.
+bool block_read_cached(void* buffer, uint32_t sector, uint32_t count);
+
+int block_write(const void* buffer, uint32_t sector, uint32_t count);
+
+// Flush hook: empties the write-back buffer and returns once everything
+// written has reached the card. Reports a failed earlier flush as well.
+int block_sync(void);
+
+// TRIM/UNMAP: the range no longer holds data. Whole erase units inside it
+// are erased on the card; cached copies are dropped either way.
+int block_discard(uint32_t sector, uint32_t count);
+
+// Flush on the write-back timeout; call from the main loop
+void block_task(void);
+
+// Sectors below this are file system metadata (boot sector, FATs, FAT12/16
+// root directory). They are written through, after any buffered data, so
+// the FAT never points at clusters whose data is still only in RAM.
+void block_set_metadata_end(uint32_t sector);
+
+// Drop cached copies, e.g. after re-initializing the card
+void block_invalidate(uint32_t sector, uint32_t count);
+void block_invalidate_all(void);
+
+// Prefetch depth at run time, clamped to BLOCK_READAHEAD_SECTORS
+void block_set_readahead(uint32_t sectors);
+
+void block_get_stats(block_stats_t* stats);
+void block_reset_stats(void);
+void block_print_stats(void);
+
+#endif // BLOCK_DEV_H
@@ -0,0 +1,70 @@
+#include "console.h"
+#include "storage_pipe.h"
+#include "storage_share.h"
+#include "storage_bench.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+#define CONSOLE_LINE_MAX 64
+
+static char console_line[CONSOLE_LINE_MAX];
+static uint32_t console_len = 0;
+static FATFS* console_fs = NULL;
+
+static void console_execute(const char* line) {
+    if (strcmp(line, "stats") == 0) {
+        storage_print_card_stats();
+        storage_pipe_print_stats();
+        storage_share_print_stats();
+    } else if (strcmp(line, "stats reset") == 0) {
+        storage_reset_card_stats();
+        storage_pipe_reset_stats();
+        storage_share_reset_stats();
+        printf("Stats cleared\n");
+    } else if (strcmp(line, "bench") == 0) {
+        if (!console_fs) {
+            printf("No card mounted\n");
+        } else if (!storage_share_begin()) {
+            printf("Host is writing to the drive, try again\n");
+        } else {
+            // Blocks the main loop for a while; USB is serviced from the
+            // storage wait callback meanwhile. The bench remounts the card
+            // and creates files, so the host is kept off it until the end.
+            storage_share_withdraw();
+            int failed = storage_bench_run(console_fs);
+            storage_share_restore();
+            storage_share_end();
+            printf("Bench done, %d failed\n", failed);
+        }
+    } else if (strcmp(line, "help") == 0) {
+        printf("Commands: stats, stats reset, bench, help\n");
+    } else {
+        printf("Unknown command '%s'\n", line);
+    }
+}
+
+// Consume whatever input is pending without blocking; each call handles at
+// most one line so the main loop keeps its rhythm
+void console_task(void) {
+    while (true) {
+        int c = getchar_timeout_us(0);
+        if (c == PICO_ERROR_TIMEOUT) return;
+        
+        if (c == '\r' || c == '\n') {
+            if (console_len == 0) continue;
+            console_line[console_len] = '\0';
+            console_len = 0;
+            console_execute(console_line);
+            return;
+        }
+        
+        if (console_len < CONSOLE_LINE_MAX - 1) {
+            console_line[console_len++] = (char)c;
+        }
+    }
+}
+
+void console_set_volume(FATFS* fs) {
+    console_fs = fs;
+}
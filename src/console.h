@@ -0,0 +1,18 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "ff.h"
+
+// Line-based command console on stdio (the USB CDC serial port).
+// Commands:
+//   stats        print SD driver, block layer, pipeline and sharing counters
+//   stats reset  clear them
+//   bench        run the storage benchmark suite (storage_bench.h)
+//   help         list commands
+void console_task(void);
+
+// Volume for commands that need the file system; NULL (the default) until
+// core0 owns a mounted card
+void console_set_volume(FATFS* fs);
+
+#endif // CONSOLE_H
@@ -1,16 +1,34 @@
 #include "ff.h"
 #include "diskio.h"
 #include "sd_card.h"
-#include <stdio.h>
+#include "storage_pipe.h"
+#include "log.h"
+#include <string.h>
+
+// Card type flags for MMC_GET_TYPE, as in FatFs's sample MMC/SD drivers
+#define CT_MMC      0x01    // MMC ver 3
+#define CT_SD1      0x02    // SD ver 1
+#define CT_SD2      0x04    // SD ver 2
+#define CT_BLOCK    0x08    // Block addressing
+
+static BYTE disk_card_type(sd_card_type_t type) {
+    switch (type) {
+        case SD_CARD_TYPE_SDSC_V1:
+            return CT_SD1;
+        case SD_CARD_TYPE_SDSC_V2:
+            return CT_SD2;
+        case SD_CARD_TYPE_SDHC:
+            return CT_SD2 | CT_BLOCK;
+        default:
+            return 0;
+    }
+}
 
 DSTATUS disk_initialize(BYTE pdrv) {
-    printf("disk_initialize(%d)\n", pdrv);
+    LOG_DEBUG("disk_initialize(%d)\n", pdrv);
     if (pdrv != 0) return STA_NOINIT;
     
-    if (sd_init_driver() == 0) {
-        return 0;
-    }
-    return STA_NOINIT;
+    return storage_init_card() == 0 ? 0 : STA_NOINIT;
 }
 
 DSTATUS disk_status(BYTE pdrv) {
@@ -19,36 +37,36 @@ DSTATUS disk_status(BYTE pdrv) {
 }
 
 DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count) {
-    printf("disk_read(pdrv=%d, sector=%lu, count=%u)\n", pdrv, sector, count);
+    LOG_DEBUG("disk_read(pdrv=%d, sector=%lu, count=%u)\n", pdrv, sector, count);
     if (pdrv != 0) return RES_PARERR;
     
-    if (sd_read_sectors(buff, sector, count) == 0) {
+    if (storage_read(buff, sector, count) == 0) {
         return RES_OK;
     }
     return RES_ERROR;
 }
 
 DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count) {
-    printf("disk_write(pdrv=%d, sector=%lu, count=%u)\n", pdrv, sector, count);
+    LOG_DEBUG("disk_write(pdrv=%d, sector=%lu, count=%u)\n", pdrv, sector, count);
     if (pdrv != 0) return RES_PARERR;
     
-    if (sd_write_sectors(buff, sector, count) == 0) {
+    if (storage_write(buff, sector, count) == 0) {
         return RES_OK;
     }
     return RES_ERROR;
 }
 
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
-    printf("disk_ioctl(pdrv=%d, cmd=%d)\n", pdrv, cmd);
+    LOG_DEBUG("disk_ioctl(pdrv=%d, cmd=%d)\n", pdrv, cmd);
     if (pdrv != 0) return RES_PARERR;
     
     switch (cmd) {
         case CTRL_SYNC:
-            return RES_OK;
+            return storage_sync() == 0 ? RES_OK : RES_ERROR;
         
         case GET_SECTOR_COUNT:
             *(DWORD*)buff = sd_get_sectors_count();
-            printf("GET_SECTOR_COUNT: %lu\n", *(DWORD*)buff);
+            LOG_DEBUG("GET_SECTOR_COUNT: %lu\n", *(DWORD*)buff);
             return RES_OK;
         
         case GET_SECTOR_SIZE:
@@ -59,6 +77,24 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff) {
             *(DWORD*)buff = 1;
             return RES_OK;
         
+        case MMC_GET_TYPE:
+            *(BYTE*)buff = disk_card_type(sd_get_card_info()->type);
+            return RES_OK;
+        
+        case MMC_GET_CSD:
+            memcpy(buff, sd_get_card_info()->csd, 16);
+            return RES_OK;
+        
+        case MMC_GET_OCR:
+            memcpy(buff, &sd_get_card_info()->ocr, 4);
+            return RES_OK;
+        
+        case CTRL_TRIM: {
+            // Inclusive start/end sectors of clusters FatFs just freed
+            LBA_t* range = (LBA_t*)buff;
+            return storage_discard(range[0], range[1] - range[0] + 1) == 0 ? RES_OK : RES_ERROR;
+        }
+        
         default:
             return RES_PARERR;
     }
@@ -5,9 +5,9 @@
 #define FF_FS_MINIMIZE      0
 #define FF_USE_STRFUNC      0
 #define FF_USE_FIND         0
-#define FF_USE_MKFS         0
-#define FF_USE_FASTSEEK     0
-#define FF_USE_EXPAND       0
+#define FF_USE_MKFS         1
+#define FF_USE_FASTSEEK     1
+#define FF_USE_EXPAND       1
 #define FF_USE_CHMOD        0
 #define FF_USE_LABEL        0
 #define FF_USE_FORWARD      0
@@ -25,7 +25,7 @@
 #define FF_MULTI_PARTITION  0
 #define FF_MIN_SS           512
 #define FF_MAX_SS           4096
-#define FF_USE_TRIM         0
+#define FF_USE_TRIM         1
 #define FF_FS_NOFSINFO      0
 #define FF_FS_TINY          0
 #define FF_FS_EXFAT         0
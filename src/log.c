@@ -0,0 +1,99 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+
+// Entries printed per log_task() call, so a burst cannot stall USB
+#define LOG_DRAIN_PER_TASK 4
+
+typedef struct {
+    const char* fmt;
+    uint32_t args[4];
+    uint32_t time_us;   // Merges the two cores' rings in order
+} log_entry_t;
+
+// Single producer (the owning core), single consumer (core0 main loop).
+// Indices run freely and are masked on access.
+typedef struct {
+    log_entry_t entries[LOG_RING_ENTRIES];
+    volatile uint32_t head;     // Written by the producer only
+    volatile uint32_t tail;     // Written by the consumer only
+    volatile uint32_t dropped;  // Written by the producer only
+} log_ring_t;
+
+static log_ring_t log_rings[2];
+static uint32_t log_dropped_reported[2];
+
+void log_write(const char* fmt, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    log_ring_t* ring = &log_rings[get_core_num()];
+    uint32_t head = ring->head;
+
+    if (head - ring->tail >= LOG_RING_ENTRIES) {
+        ring->dropped++;
+        return;
+    }
+
+    log_entry_t* entry = &ring->entries[head & (LOG_RING_ENTRIES - 1)];
+    entry->fmt = fmt;
+    entry->args[0] = a;
+    entry->args[1] = b;
+    entry->args[2] = c;
+    entry->args[3] = d;
+    entry->time_us = time_us_32();
+
+    // Entry contents must be visible to the other core before the index
+    __mem_fence_release();
+    ring->head = head + 1;
+}
+
+// Print the oldest queued entry of either core; false if both are empty
+static bool log_print_one(void) {
+    log_ring_t* oldest = NULL;
+
+    for (int core = 0; core < 2; core++) {
+        log_ring_t* ring = &log_rings[core];
+        if (ring->head == ring->tail) continue;
+
+        __mem_fence_acquire();
+        if (!oldest ||
+            (int32_t)(ring->entries[ring->tail & (LOG_RING_ENTRIES - 1)].time_us -
+                      oldest->entries[oldest->tail & (LOG_RING_ENTRIES - 1)].time_us) < 0) {
+            oldest = ring;
+        }
+    }
+    if (!oldest) return false;
+
+    // Copy out and free the slot before the (slow) print
+    log_entry_t entry = oldest->entries[oldest->tail & (LOG_RING_ENTRIES - 1)];
+    __mem_fence_release();
+    oldest->tail++;
+
+    printf(entry.fmt, (unsigned long)entry.args[0], (unsigned long)entry.args[1],
+           (unsigned long)entry.args[2], (unsigned long)entry.args[3]);
+    return true;
+}
+
+static void log_report_dropped(void) {
+    for (int core = 0; core < 2; core++) {
+        uint32_t dropped = log_rings[core].dropped;
+        if (dropped != log_dropped_reported[core]) {
+            printf("Log: %lu messages dropped on core %d\n",
+                   (unsigned long)(dropped - log_dropped_reported[core]), core);
+            log_dropped_reported[core] = dropped;
+        }
+    }
+}
+
+void log_task(void) {
+    for (int i = 0; i < LOG_DRAIN_PER_TASK; i++) {
+        if (!log_print_one()) break;
+    }
+    log_report_dropped();
+}
+
+void log_flush(void) {
+    while (log_print_one()) {
+    }
+    log_report_dropped();
+}
@@ -0,0 +1,55 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+// Deferred logging for the I/O paths. A log site stores its format string
+// pointer (the literal lives in flash, so the pointer doubles as the message
+// ID) and up to four integer arguments in a per-core RAM ring; log_task()
+// formats and prints them later from the main loop. Sites above LOG_LEVEL
+// compile to nothing, arguments included.
+//
+// Arguments are stored as 32-bit integers: no strings, no 64-bit values,
+// and no side effects (they are not evaluated when the site is disabled).
+// Format with %d, %u, %X or %lu. Not for use from interrupt handlers.
+
+#define LOG_LEVEL_NONE   0
+#define LOG_LEVEL_ERROR  1
+#define LOG_LEVEL_WARN   2
+#define LOG_LEVEL_INFO   3
+#define LOG_LEVEL_DEBUG  4  // Per-I/O traces
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Entries per core; a power of two. Messages are dropped (and counted)
+// when the ring is full.
+#ifndef LOG_RING_ENTRIES
+#define LOG_RING_ENTRIES 64
+#endif
+
+// Pads the argument list to exactly four, so log_write() is one call
+#define LOG_ARGS4(fmt, a, b, c, d, ...) \
+    fmt, (uint32_t)(a), (uint32_t)(b), (uint32_t)(c), (uint32_t)(d)
+
+#define LOG_AT(level, ...) do { \
+    if ((level) <= LOG_LEVEL) log_write(LOG_ARGS4(__VA_ARGS__, 0, 0, 0, 0, 0)); \
+} while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Producer side; use the macros above
+void log_write(const char* fmt, uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+
+// Print a bounded number of entries from both cores' rings, oldest first.
+// Core0 only; call from the main loop.
+void log_task(void);
+
+// Print everything queued so far
+void log_flush(void);
+
+#endif // LOG_H
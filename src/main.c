@@ -6,18 +6,73 @@
 #include "bsp/board.h"
 #include "tusb.h"
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include "hardware/gpio.h"
+#include "hardware/sync.h"
 #include "hardware/spi.h"
 #include "ff.h"
 #include "diskio.h"
 #include "sd_card.h"
-
+#include "block_dev.h"
+#include "storage_pipe.h"
+#include "storage_share.h"
+#include "sd_bench.h"
+#include "storage_bench.h"
+#include "log.h"
+#include "console.h"
+
+// Deferred MSC data phases need TinyUSB's async I/O (0.19 and later).
+// Without it a callback that is not ready answers "busy", and TinyUSB
+// calls it again straight away from inside tud_task().
+#ifndef MSC_ASYNC_IO
+#if TUSB_VERSION_MAJOR > 0 || TUSB_VERSION_MINOR >= 19
+#define MSC_ASYNC_IO 1
+#else
+#define MSC_ASYNC_IO 0
+#endif
+#endif
+
+#if STORAGE_PIPE_SLOT_SIZE < CFG_TUD_MSC_EP_BUFSIZE
+#error "STORAGE_PIPE_SLOT_SIZE must hold a whole CFG_TUD_MSC_EP_BUFSIZE transfer"
+#endif
+
+#ifndef SCRIPT_BUFFER_SIZE
+#define SCRIPT_BUFFER_SIZE 8192
+#endif
+
+// Static buffers of the storage path. The rest of the 264 KiB goes to the
+// stacks, TinyUSB, stdio and the heap; a larger MSC_BUFFER_SIZE has to be
+// paid for with a smaller cache or benchmark buffer.
+#ifndef STORAGE_RAM_BUDGET
+#define STORAGE_RAM_BUDGET (224 * 1024)
+#endif
+
+#define STORAGE_RAM_USED (CFG_TUD_MSC_EP_BUFSIZE +                       /* TinyUSB MSC buffer */ \
+                          STORAGE_PIPE_SLOTS * STORAGE_PIPE_SLOT_SIZE +  /* Pipeline slots */ \
+                          BLOCK_CACHE_SETS * BLOCK_CACHE_WAYS * 512 +    /* Sector cache */ \
+                          2 * BLOCK_READAHEAD_SECTORS * 512 +            /* Read-ahead windows */ \
+                          BLOCK_WRITEBACK_SECTORS * 512 +                /* Write-back buffer */ \
+                          STORAGE_BENCH_MAX_BLOCK +                      /* Benchmark buffers */ \
+                          SD_BENCH_CHUNK * 512 + \
+                          SCRIPT_BUFFER_SIZE +                           /* ducky.txt */ \
+                          sizeof(FATFS))                                 /* FatFs window */
+
+_Static_assert(STORAGE_RAM_USED <= STORAGE_RAM_BUDGET,
+               "Storage buffers exceed STORAGE_RAM_BUDGET; shrink the cache, benchmark or MSC buffers");
+
+#if SD_BUS_SDIO
+// GPIO pins for the 4-bit SD bus (DAT0-3 consecutive, CLK = DAT0 + 4)
+const uint SD_PIN_D0   = 2;
+const uint SD_PIN_CLK  = 6;
+const uint SD_PIN_CMD  = 7;
+#else
 // GPIO pins for SD card SPI
 spi_inst_t* const SD_SPI_PORT = spi0;
 const uint SD_PIN_MISO = 4;
 const uint SD_PIN_CS   = 5;
 const uint SD_PIN_SCK  = 2;
 const uint SD_PIN_MOSI = 3;
+#endif
 
 // LED pin
 #define LED_PIN 25
@@ -32,7 +87,7 @@ enum {
 };
 
 // Ducky script variables
-static char ducky_script[8192];
+static char ducky_script[SCRIPT_BUFFER_SIZE];
 static bool script_loaded = false;
 static bool script_running = false;
 static size_t script_pos = 0;
@@ -43,6 +98,39 @@ static uint32_t key_delay = 50; // Default delay in ms
 static FATFS fs;
 static bool sd_mounted = false;
 
+// SD boot runs on core1 while core0 brings up USB. Core1 writes sd_mounted,
+// fs and the script, then publishes the result here; core0 leaves the card
+// alone until it sees something other than PENDING.
+typedef enum {
+    SD_BOOT_PENDING = 0,
+    SD_BOOT_READY,
+    SD_BOOT_FAILED,
+} sd_boot_state_t;
+
+static volatile sd_boot_state_t sd_boot_state = SD_BOOT_PENDING;
+static bool sd_boot_seen = false;   // Core0's copy, set once it took over
+
+#if MSC_ASYNC_IO
+// READ10/WRITE10 data phase waiting on core1, finished from the main loop.
+// TinyUSB sends no further MSC callbacks until it is, so one is enough.
+typedef struct {
+    bool active;
+    bool write;
+    void* buffer;       // TinyUSB's endpoint buffer, ours until done
+    uint32_t sector;
+    uint32_t count;
+} msc_async_t;
+
+static msc_async_t msc_async;
+#endif
+
+// Set by PREVENT ALLOW MEDIUM REMOVAL; an eject is refused meanwhile
+static bool msc_prevent_removal = false;
+
+// Boot timing, microseconds since reset
+static uint64_t boot_enumerated_us = 0;
+static uint64_t boot_first_key_us = 0;
+
 // Function prototypes
 void load_ducky_script(void);
 void process_ducky_script(void);
@@ -51,6 +139,11 @@ void parse_ducky_command(char* line);
 uint8_t char_to_keycode(char c);
 void init_sd_card(void);
 void blink_led(int count);
+void usb_task(void);
+static void msc_async_task(void);
+static void storage_wait_task(void);
+static void sd_boot_core1(void);
+static void sd_boot_poll(void);
 
 //--------------------------------------------------------------------+
 // HID Report Descriptor (declare this first)
@@ -150,40 +243,33 @@ uint16_t const* tud_descriptor_string_cb(uint8_t index, uint16_t langid) {
 //--------------------------------------------------------------------+
 
 void init_sd_card(void) {
-    gpio_init(SD_PIN_MISO);
-    gpio_init(SD_PIN_CS);
-    gpio_init(SD_PIN_SCK);
-    gpio_init(SD_PIN_MOSI);
-    
-    gpio_set_function(SD_PIN_MISO, GPIO_FUNC_SPI);
-    gpio_set_function(SD_PIN_SCK, GPIO_FUNC_SPI);
-    gpio_set_function(SD_PIN_MOSI, GPIO_FUNC_SPI);
-    gpio_set_function(SD_PIN_CS, GPIO_FUNC_SIO);
-    
-    gpio_set_dir(SD_PIN_CS, GPIO_OUT);
-    gpio_put(SD_PIN_CS, 1);
-    
-    spi_init(SD_SPI_PORT, 400000); // Start with 400kHz
+    sd_bus_init();
     
     if (sd_init_driver() == 0) {
         FRESULT fr = f_mount(&fs, "", 1);
         if (fr == FR_OK) {
             sd_mounted = true;
-            printf("SD card mounted successfully\n");
+            // Boot sector, FATs and a FAT12/16 root directory end here
+            block_set_metadata_end((uint32_t)fs.database);
+            storage_share_init(&fs);
+            LOG_INFO("SD card mounted successfully\n");
+#ifdef SD_BENCH_ON_BOOT
+            sd_bench_run(&fs);
+#endif
             blink_led(3);
         } else {
-            printf("Failed to mount SD card: %d\n", fr);
+            LOG_ERROR("Failed to mount SD card: %d\n", fr);
             blink_led(5);
         }
     } else {
-        printf("SD card initialization failed\n");
+        LOG_ERROR("SD card initialization failed\n");
         blink_led(5);
     }
 }
 
 void load_ducky_script(void) {
     if (!sd_mounted) {
-        printf("SD card not mounted, using default script...\n");
+        LOG_WARN("SD card not mounted, using default script...\n");
         strcpy(ducky_script, "DELAY 1000\nGUI r\nDELAY 500\nSTRING notepad\nENTER\nDELAY 1000\nSTRING Hello from Pico Ducky!\n");
         script_loaded = true;
         return;
@@ -193,12 +279,15 @@ void load_ducky_script(void) {
     FRESULT fr = f_open(&file, "ducky.txt", FA_READ);
     
     if (fr != FR_OK) {
-        printf("No ducky.txt file found, using default script\n");
+        storage_share_track(NULL);
+        LOG_WARN("No ducky.txt file found, using default script\n");
         strcpy(ducky_script, "DELAY 1000\nGUI r\nDELAY 500\nSTRING notepad\nENTER\nDELAY 1000\nSTRING Hello from Pico Ducky!\n");
         script_loaded = true;
         return;
     }
     
+    storage_share_track(&file);
+    
     UINT bytes_read;
     fr = f_read(&file, ducky_script, sizeof(ducky_script) - 1, &bytes_read);
     f_close(&file);
@@ -206,12 +295,60 @@ void load_ducky_script(void) {
     if (fr == FR_OK) {
         ducky_script[bytes_read] = '\0';
         script_loaded = true;
-        printf("Ducky script loaded: %d bytes\n", bytes_read);
+        LOG_INFO("Ducky script loaded: %d bytes\n", bytes_read);
     } else {
-        printf("Failed to read ducky.txt\n");
+        LOG_ERROR("Failed to read ducky.txt\n");
     }
 }
 
+// Re-read ducky.txt after the host changed the volume; no remount needed.
+// Compared chunk by chunk, so a running script only stops if its text
+// actually changed.
+static void reload_ducky_script(void) {
+    FIL file;
+    if (f_open(&file, "ducky.txt", FA_READ) != FR_OK) {
+        storage_share_track(NULL);
+        LOG_WARN("ducky.txt gone from the drive, keeping the loaded script\n");
+        return;
+    }
+    storage_share_track(&file);
+    
+    size_t old_len = strlen(ducky_script);
+    size_t len = 0;
+    bool changed = false;
+    char chunk[512];
+    UINT n;
+    FRESULT fr;
+    
+    while ((fr = f_read(&file, chunk, sizeof(chunk), &n)) == FR_OK && n > 0) {
+        if (n > sizeof(ducky_script) - 1 - len) n = sizeof(ducky_script) - 1 - len;
+        if (!changed && (len + n > old_len || memcmp(ducky_script + len, chunk, n) != 0)) {
+            changed = true;
+        }
+        memcpy(ducky_script + len, chunk, n);
+        len += n;
+        if (len == sizeof(ducky_script) - 1) break;
+    }
+    f_close(&file);
+    ducky_script[len] = '\0';
+    
+    if (fr != FR_OK) {
+        LOG_ERROR("Failed to reload ducky.txt: %d\n", fr);
+        script_loaded = false;
+        script_running = false;
+        return;
+    }
+    if (!changed && len == old_len) return;
+    
+    script_loaded = true;
+    script_pos = 0;
+    if (script_running) {
+        script_running = false;
+        LOG_INFO("ducky.txt changed, script stopped\n");
+    }
+    LOG_INFO("Ducky script reloaded: %lu bytes\n", len);
+}
+
 //--------------------------------------------------------------------+
 // Ducky Script Processing
 //--------------------------------------------------------------------+
@@ -261,7 +398,7 @@ void parse_ducky_command(char* line) {
     
     if (strncmp(line, "DELAY ", 6) == 0) {
         key_delay = atoi(line + 6);
-        printf("Set delay to %d ms\n", key_delay);
+        LOG_DEBUG("Set delay to %d ms\n", key_delay);
     }
     else if (strncmp(line, "STRING ", 7) == 0) {
         char* text = line + 7;
@@ -360,6 +497,10 @@ void send_hid_report(uint8_t modifier, uint8_t keycode) {
         uint8_t keycode_array[6] = {0};
         if (keycode != 0) {
             keycode_array[0] = keycode;
+            if (boot_first_key_us == 0) {
+                boot_first_key_us = time_us_64();
+                printf("Boot: first keystroke at %lu ms\n", (unsigned long)(boot_first_key_us / 1000));
+            }
         }
         tud_hid_keyboard_report(REPORT_ID_KEYBOARD, modifier, keycode_array);
     }
@@ -401,15 +542,77 @@ void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16
     memcpy(product_rev, rev, strlen(rev));
 }
 
+// Sense for a LUN that cannot take media access yet: "becoming ready"
+// while core1 is still bringing the card up or the firmware has the card
+// to itself, "medium not present" after the boot gave up
+static void msc_set_not_ready_sense(uint8_t lun) {
+    if (!sd_boot_seen || storage_share_withdrawn()) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);
+    } else {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);
+    }
+}
+
+static bool msc_ready(void) {
+    return sd_boot_seen && sd_mounted && !storage_share_withdrawn();
+}
+
+// Gate for SCSI commands handled in tud_msc_scsi_cb, which cannot ask to
+// be called again: report NOT READY so the host reissues them
+static bool msc_card_available(uint8_t lun) {
+    if (!msc_ready()) {
+        msc_set_not_ready_sense(lun);
+        return false;
+    }
+    return true;
+}
+
+// UNMAP parameter list: 8-byte header, then 16-byte block descriptors
+// (8-byte LBA, 4-byte count, all big-endian)
+static int32_t msc_unmap(uint8_t lun, const uint8_t* params, uint16_t len) {
+    if (len < 8) return 0;
+    
+    uint32_t desc_len = ((uint32_t)params[2] << 8) | params[3];
+    if (desc_len > len - 8u) desc_len = len - 8u;
+    
+    uint32_t sectors = sd_get_sectors_count();
+    for (uint32_t off = 8; off + 16 <= desc_len + 8; off += 16) {
+        const uint8_t* d = params + off;
+        uint32_t lba_hi = ((uint32_t)d[0] << 24) | ((uint32_t)d[1] << 16) | ((uint32_t)d[2] << 8) | d[3];
+        uint32_t lba = ((uint32_t)d[4] << 24) | ((uint32_t)d[5] << 16) | ((uint32_t)d[6] << 8) | d[7];
+        uint32_t count = ((uint32_t)d[8] << 24) | ((uint32_t)d[9] << 16) | ((uint32_t)d[10] << 8) | d[11];
+        
+        if (count == 0) continue;
+        if (lba_hi || lba >= sectors || count > sectors - lba) {
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x21, 0x00);  // LBA out of range
+            return -1;
+        }
+        if (storage_msc_discard(lba, count) != 0) {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
 bool tud_msc_test_unit_ready_cb(uint8_t lun) {
-    (void) lun;
-    return sd_mounted;
+    if (!msc_ready()) {
+        msc_set_not_ready_sense(lun);
+        return false;
+    }
+    if (storage_share_medium_changed()) {
+        // The firmware changed the volume while the host was kept off it
+        tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);
+        return false;
+    }
+    return true;
 }
 
 void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size) {
     (void) lun;
     *block_size = 512;
-    if (sd_mounted) {
+    if (msc_ready()) {
         *block_count = sd_get_sectors_count();
     } else {
         *block_count = 0;
@@ -417,47 +620,197 @@ void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_siz
 }
 
 bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
-    (void) lun;
     (void) power_condition;
-    (void) start;
-    (void) load_eject;
+    
+    // Host ejected the drive: end of a session, report how the card and
+    // cache did
+    if (load_eject && !start) {
+        if (msc_prevent_removal) {
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x53, 0x02);  // Medium removal prevented
+            return false;
+        }
+        storage_print_card_stats();
+    }
     return true;
 }
 
-int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
-    (void) lun;
+static int32_t msc_io_try(bool write, void* buffer, uint32_t sector, uint32_t count) {
+    if (!write) return storage_msc_read(buffer, sector, count);
     
-    if (!sd_mounted) return -1;
+    // Held off while the firmware has the file system
+    if (!storage_share_host_may_write()) return 0;
     
-    if (sd_read_sectors(buffer, lba + offset/512, bufsize/512) == 0) {
-        return bufsize;
+    int32_t result = storage_msc_write(buffer, sector, count);
+    if (result > 0) storage_share_host_write(sector, count);
+    return result;
+}
+
+// Data phase of READ10/WRITE10. Served at once when a slot is ready;
+// otherwise it is parked and msc_async_task() finishes it, so tud_task()
+// returns and HID and the main loop keep running meanwhile.
+static int32_t msc_io(bool write, void* buffer, uint32_t sector, uint32_t count) {
+    int32_t result = msc_io_try(write, buffer, sector, count);
+#if MSC_ASYNC_IO
+    if (result == 0) {
+        msc_async = (msc_async_t){
+            .active = true,
+            .write = write,
+            .buffer = buffer,
+            .sector = sector,
+            .count = count,
+        };
+        return TUD_MSC_RET_ASYNC;
     }
-    return -1;
+#endif
+    return result;
 }
 
-int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
-    (void) lun;
+// Main loop: retry a parked data phase and hand the result to TinyUSB
+static void msc_async_task(void) {
+#if MSC_ASYNC_IO
+    if (!msc_async.active) return;
     
-    if (!sd_mounted) return -1;
+    int32_t result = msc_io_try(msc_async.write, msc_async.buffer, msc_async.sector, msc_async.count);
+    if (result == 0) return;
     
-    if (sd_write_sectors(buffer, lba + offset/512, bufsize/512) == 0) {
-        return bufsize;
+    msc_async.active = false;
+    tud_msc_async_io_done(result, false);
+#endif
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
+    if (!msc_ready()) {
+        msc_set_not_ready_sense(lun);
+        return -1;
     }
-    return -1;
+    
+    return msc_io(false, buffer, lba + offset/512, bufsize/512);
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
+    if (!msc_ready()) {
+        msc_set_not_ready_sense(lun);
+        return -1;
+    }
+    
+    return msc_io(true, buffer, lba + offset/512, bufsize/512);
 }
 
 void tud_msc_write10_complete_cb(uint8_t lun) {
     (void) lun;
-    if (sd_mounted) {
-        f_sync(NULL);
+    // End of a host WRITE command: have core1 flush the write-back buffer
+    // once the queued writes are done. Not waited for; a failure shows up
+    // on the next SYNCHRONIZE CACHE.
+    if (msc_ready()) {
+        storage_msc_flush();
+        storage_share_host_write_done();
+    }
+}
+
+static void msc_put_be32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+// MODE SENSE (10) with the caching page, the only one reported. WCE is
+// set because writes are acknowledged from the pipeline slots and the
+// write-back buffer; the host must send SYNCHRONIZE CACHE for durability.
+// DPOFUA stays clear: TinyUSB does not pass the FUA bit on, so the host
+// has to flush rather than rely on FUA writes.
+static int32_t msc_mode_sense10(uint8_t lun, uint8_t const cmd[16], uint8_t* response) {
+    uint8_t page_control = cmd[2] >> 6;
+    uint8_t page = cmd[2] & 0x3F;
+    uint8_t subpage = cmd[3];
+    uint16_t alloc_len = ((uint16_t)cmd[7] << 8) | cmd[8];
+    
+    if (page_control == 3) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x39, 0x00);  // Saving parameters not supported
+        return -1;
+    }
+    if ((page != 0x08 && page != 0x3F) || (subpage != 0x00 && !(page == 0x3F && subpage == 0xFF))) {
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);  // Invalid field in CDB
+        return -1;
+    }
+    
+    // 8-byte header without block descriptors, then the 20-byte page
+    memset(response, 0, 28);
+    response[1] = 26;           // Mode data length, excluding itself
+    response[8] = 0x08;         // Caching page
+    response[9] = 0x12;
+    if (page_control != 1) {    // Changeable values: none
+        response[10] = 0x04;    // WCE; RCD clear, reads are cached too
     }
+    
+    return alloc_len < 28 ? alloc_len : 28;
+}
+
+// READ CAPACITY (16): as (10). LBPME stays clear: a host that sees it
+// looks for the Logical Block Provisioning VPD page, which TinyUSB's
+// builtin INQUIRY cannot serve, and falls back to WRITE SAME (16), which
+// is not implemented. Hosts that send UNMAP regardless are still served.
+static int32_t msc_read_capacity16(uint8_t lun, uint8_t const cmd[16], uint8_t* response) {
+    uint32_t alloc_len = ((uint32_t)cmd[10] << 24) | ((uint32_t)cmd[11] << 16) |
+                         ((uint32_t)cmd[12] << 8) | cmd[13];
+    
+    if ((cmd[1] & 0x1F) != 0x10) {  // Only the READ CAPACITY service action
+        tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x24, 0x00);
+        return -1;
+    }
+    
+    memset(response, 0, 32);
+    msc_put_be32(response + 4, sd_get_sectors_count() - 1);  // Last LBA; upper half 0
+    msc_put_be32(response + 8, 512);
+    
+    return alloc_len < 32 ? (int32_t)alloc_len : 32;
 }
 
 int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize) {
+    static uint8_t reply[32];
     void const* response = NULL;
     int32_t resplen = 0;
     
     switch (scsi_cmd[0]) {
+        case 0x35:  // SYNCHRONIZE CACHE (10)
+        case 0x91:  // SYNCHRONIZE CACHE (16)
+            if (!msc_card_available(lun)) {
+                resplen = -1;
+            } else if (scsi_cmd[1] & 0x02) {
+                // IMMED: status now, core1 flushes behind the next commands
+                storage_msc_flush();
+            } else if (storage_msc_sync() != 0) {
+                tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x0C, 0x00);  // Write error
+                resplen = -1;
+            }
+            break;
+            
+        case 0x1E:  // PREVENT ALLOW MEDIUM REMOVAL
+            msc_prevent_removal = scsi_cmd[4] & 0x01;
+            break;
+            
+        case 0x5A:  // MODE SENSE (10)
+            resplen = msc_mode_sense10(lun, scsi_cmd, reply);
+            response = reply;
+            break;
+            
+        case 0x9E:  // SERVICE ACTION IN (16): READ CAPACITY (16)
+            if (!msc_card_available(lun)) {
+                resplen = -1;
+            } else {
+                resplen = msc_read_capacity16(lun, scsi_cmd, reply);
+                response = reply;
+            }
+            break;
+            
+        case 0x42:  // UNMAP; TinyUSB calls back once the parameter list is in
+            if (!msc_card_available(lun)) {
+                resplen = -1;
+            } else {
+                resplen = msc_unmap(lun, (const uint8_t*)buffer, bufsize);
+            }
+            break;
+            
         default:
             tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
             resplen = -1;
@@ -477,6 +830,66 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, u
 // Utility Functions
 //--------------------------------------------------------------------+
 
+// tud_task() wrapper. It also runs from storage_wait_task() while an MSC
+// callback inside tud_task() waits for core1; those nested calls are skipped
+void usb_task(void) {
+    static bool in_usb_task = false;
+    if (in_usb_task) return;
+    
+    in_usb_task = true;
+    tud_task();
+    in_usb_task = false;
+}
+
+// Run while a synchronous storage call waits for core1: parked MSC data
+// phases need finishing too, or the host stalls until FatFs is done
+static void storage_wait_task(void) {
+#if !MSC_ASYNC_IO
+    // A host write held off by the session would be retried inside
+    // tud_task() until the session ends, which it then never would
+    if (storage_share_in_session()) return;
+#endif
+    usb_task();
+    msc_async_task();
+}
+
+// Invoked when the host has configured the device
+void tud_mount_cb(void) {
+    if (boot_enumerated_us == 0) {
+        boot_enumerated_us = time_us_64();
+        printf("Boot: enumerated at %lu ms\n", (unsigned long)(boot_enumerated_us / 1000));
+    }
+}
+
+// Core1 entry: card identification, mount and script load, then the
+// storage pipeline for good. Nothing here may call into TinyUSB, which
+// belongs to core0.
+static void sd_boot_core1(void) {
+    init_sd_card();
+    load_ducky_script();
+    
+    // From here on core1 owns the card and core0 goes through the queues
+    storage_pipe_enable();
+    __mem_fence_release();
+    sd_boot_state = sd_mounted ? SD_BOOT_READY : SD_BOOT_FAILED;
+    
+    storage_pipe_core1_run();
+}
+
+// Called from core0's loops; picks up the boot result once core1 is done
+static void sd_boot_poll(void) {
+    if (sd_boot_seen || sd_boot_state == SD_BOOT_PENDING) return;
+    
+    __mem_fence_acquire();
+    sd_boot_seen = true;
+    
+    // Keep USB alive while FatFs waits for core1
+    storage_pipe_set_wait_callback(storage_wait_task);
+    if (sd_mounted) console_set_volume(&fs);
+    printf("Boot: SD %s at %lu ms\n", sd_mounted ? "ready" : "unavailable",
+           (unsigned long)(time_us_64() / 1000));
+}
+
 void blink_led(int count) {
     for (int i = 0; i < count; i++) {
         gpio_put(LED_PIN, 1);
@@ -498,35 +911,49 @@ int main(void) {
     
     printf("Pico Ducky with SD Card Storage starting...\n");
     
-    init_sd_card();
-    load_ducky_script();
+    // SD identification (up to a second of ACMD41 polling) and the mount run
+    // on core1 so enumeration does not wait for them
+    multicore_launch_core1(sd_boot_core1);
     
     // Initialize USB with device mode
     tud_init(BOARD_TUD_RHPORT);
     
-    while (!tud_mounted()) {
-        tud_task();
-        sleep_ms(1);
-    }
-    
-    printf("USB connected!\n");
-    blink_led(2);
-    
-    sleep_ms(3000);
-    if (script_loaded) {
-        script_running = true;
-        printf("Starting script execution...\n");
-    }
+    bool script_started = false;
     
     while (1) {
-        tud_task();
+        usb_task();
+        sd_boot_poll();
+        if (sd_boot_seen) {
+            storage_pipe_task();
+            msc_async_task();
+            
+            // Host changed ducky.txt (or the FAT around it) and went quiet
+            if (sd_mounted && storage_share_script_stale() && storage_share_begin()) {
+                reload_ducky_script();
+                storage_share_end();
+            }
+        }
+        log_task();
+        console_task();
+        
+        // Start typing once the script is in and the host has had 3 s
+        // since enumeration to load the keyboard driver
+        if (!script_started && sd_boot_seen && boot_enumerated_us &&
+            time_us_64() - boot_enumerated_us >= 3000 * 1000) {
+            script_started = true;
+            if (script_loaded) {
+                script_running = true;
+                printf("Starting script execution...\n");
+            }
+        }
         
         if (script_running) {
             process_ducky_script();
         }
         
+        // Heartbeat once core1 is done with its own status blinks
         static uint32_t last_blink = 0;
-        if (board_millis() - last_blink > 1000) {
+        if (sd_boot_seen && board_millis() - last_blink > 1000) {
             gpio_put(LED_PIN, !gpio_get(LED_PIN));
             last_blink = board_millis();
         }
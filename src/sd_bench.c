@@ -0,0 +1,118 @@
+#include "sd_bench.h"
+#include "sd_card.h"
+#include "block_dev.h"
+#include "storage_bench.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+
+#define SD_BENCH_FILE "SDBENCH.RAW"
+
+static uint8_t bench_buf[SD_BENCH_CHUNK * 512];
+
+typedef int (*sd_read_fn)(void* buffer, uint32_t sector, uint32_t count);
+typedef int (*sd_write_fn)(const void* buffer, uint32_t sector, uint32_t count);
+
+// Returns elapsed microseconds, or 0 on error
+static uint64_t bench_read_pass(sd_read_fn read_fn, uint32_t sector, uint32_t count) {
+    uint64_t start = time_us_64();
+    
+    for (uint32_t done = 0; done < count; done += SD_BENCH_CHUNK) {
+        uint32_t n = count - done;
+        if (n > SD_BENCH_CHUNK) n = SD_BENCH_CHUNK;
+        
+        if (read_fn(bench_buf, sector + done, n) != 0) {
+            return 0;
+        }
+    }
+    
+    return time_us_64() - start;
+}
+
+// Each chunk is read back first (untimed) and rewritten with its own
+// contents, so the card's data is left unchanged.
+// Returns elapsed microseconds spent writing, or 0 on error
+static uint64_t bench_write_pass(sd_write_fn write_fn, uint32_t sector, uint32_t count) {
+    uint64_t elapsed = 0;
+    
+    for (uint32_t done = 0; done < count; done += SD_BENCH_CHUNK) {
+        uint32_t n = count - done;
+        if (n > SD_BENCH_CHUNK) n = SD_BENCH_CHUNK;
+        
+        if (sd_read_sectors(bench_buf, sector + done, n) != 0) {
+            return 0;
+        }
+        
+        // Include the deferred programming time of the last block
+        uint64_t start = time_us_64();
+        if (write_fn(bench_buf, sector + done, n) != 0 || sd_sync() != 0) {
+            return 0;
+        }
+        elapsed += time_us_64() - start;
+    }
+    
+    return elapsed;
+}
+
+// Same transfer through the request API, pumping sd_task() like the main
+// loop does; shows what the non-blocking state machine costs
+static int bench_read_async(void* buffer, uint32_t sector, uint32_t count) {
+    sd_request_t request = {
+        .write = false,
+        .buffer = buffer,
+        .sector = sector,
+        .count = count,
+    };
+    
+    if (sd_submit(&request) != 0) return -1;
+    while (sd_request_pending(&request)) {
+        sd_task();
+    }
+    return request.status == SD_REQUEST_DONE ? 0 : -1;
+}
+
+// Print throughput as MB/s with two decimals (bytes per microsecond == MB/s)
+static void bench_print(const char* label, uint32_t count, uint64_t us) {
+    if (us == 0) {
+        printf("  %-12s failed\n", label);
+        return;
+    }
+    uint64_t centi_mbps = ((uint64_t)count * 512 * 100) / us;
+    printf("  %-12s %4lu.%02lu MB/s (%lu us)\n", label,
+           (unsigned long)(centi_mbps / 100), (unsigned long)(centi_mbps % 100),
+           (unsigned long)us);
+}
+
+void sd_bench_read(uint32_t sector, uint32_t count) {
+    printf("SD read benchmark: %lu sectors from %lu, %u per call\n",
+           (unsigned long)count, (unsigned long)sector, SD_BENCH_CHUNK);
+    
+    bench_print("CMD17 x N", count, bench_read_pass(sd_read_sectors_single, sector, count));
+    bench_print("CMD18/CMD12", count, bench_read_pass(sd_read_sectors, sector, count));
+    bench_print("sd_submit", count, bench_read_pass(bench_read_async, sector, count));
+}
+
+void sd_bench_write(uint32_t sector, uint32_t count) {
+    printf("SD write benchmark: %lu sectors from %lu, %u per call\n",
+           (unsigned long)count, (unsigned long)sector, SD_BENCH_CHUNK);
+    
+    bench_print("CMD24 x N", count, bench_write_pass(sd_write_sectors_single, sector, count));
+    bench_print("CMD25", count, bench_write_pass(sd_write_sectors, sector, count));
+}
+
+void sd_bench_run(FATFS* fs) {
+    printf("SD transport: %s, bus clock: %lu Hz\n",
+           sd_get_transport_name(), (unsigned long)sd_get_clock_hz());
+    
+    // In a scratch file, so a reset during the write pass cannot leave the
+    // boot sector or the FATs half written
+    uint32_t base = 0;
+    if (storage_bench_scratch_create(fs, SD_BENCH_FILE, SD_BENCH_SECTORS, SD_BENCH_SECTORS, &base) == 0) {
+        printf("SD benchmark skipped: no room for %lu contiguous sectors\n",
+               (unsigned long)SD_BENCH_SECTORS);
+    } else {
+        sd_bench_read(base, SD_BENCH_SECTORS);
+        sd_bench_write(base, SD_BENCH_SECTORS);
+        block_invalidate(base, SD_BENCH_SECTORS);   // Written around the block layer
+    }
+    f_unlink(SD_BENCH_FILE);
+}
@@ -0,0 +1,24 @@
+#ifndef SD_BENCH_H
+#define SD_BENCH_H
+
+#include <stdint.h>
+#include "ff.h"
+
+// Number of sectors moved by each benchmark pass
+#ifndef SD_BENCH_SECTORS
+#define SD_BENCH_SECTORS 2048   // 1 MiB
+#endif
+
+// Sectors handed to the driver per call, like a FatFs cluster or MSC transfer
+#ifndef SD_BENCH_CHUNK
+#define SD_BENCH_CHUNK   32     // 16 KiB
+#endif
+
+// Raw passes at the given sectors; the write pass rewrites what it reads
+void sd_bench_read(uint32_t sector, uint32_t count);
+void sd_bench_write(uint32_t sector, uint32_t count);
+
+// Both passes inside a scratch file on the mounted volume fs, deleted again
+void sd_bench_run(FATFS* fs);
+
+#endif // SD_BENCH_H
@@ -1,54 +1,143 @@
 #include "sd_card.h"
-#include "hardware/spi.h"
+#include "sd_common.h"
+#include "log.h"
+#include "sd_spi.h"
 #include "hardware/gpio.h"
 #include "pico/stdlib.h"
 #include <string.h>
 #include <stdio.h>
 
-static uint32_t sd_sectors = 0;
-static bool sd_initialized = false;
+static const sd_driver_ops_t sd_ops;
+static sd_driver_t sd = { .ops = &sd_ops, .clock_step = -1 };
+static volatile bool sd_bus_busy = false;
+
+// Result of a single data block transfer
+#define SD_BLOCK_OK      0
+#define SD_BLOCK_ERROR  -1  // Token, response or busy timeout
+#define SD_BLOCK_CRC    -2  // CRC16 mismatch on either side; worth retrying
+
+// SPI clock steps tried after identification, fastest first. The rate
+// actually produced by the transport is kept in sd_clock_hz.
+static const uint32_t sd_clock_steps[] = { 50000000, 25000000, 12500000 };
+#define SD_CLOCK_STEP_COUNT ((int)(sizeof(sd_clock_steps) / sizeof(sd_clock_steps[0])))
+
+static uint32_t sd_clock_hz = SD_INIT_CLOCK_HZ;
+
+static void sd_clock_apply(int step);
+static void sd_clock_downshift(void);
+static int sd_read_data_block(uint8_t* buf, size_t len);
+static void sd_wait_request_idle(void);
+static void sd_settle_write(void);
+
+// Asynchronous request state; sd_active holds the bus between sd_task()
+// calls, so it counts as busy even while CS is briefly released
+typedef enum {
+    SD_PHASE_START,         // Issue the read or write command
+    SD_PHASE_TOKEN,         // Read: hunting for the start block token
+    SD_PHASE_DATA,          // Block DMA in flight
+    SD_PHASE_WRITE_BUSY,    // Write: card programming the block
+    SD_PHASE_STOP,          // End the run (CMD12 or stop token)
+} sd_phase_t;
+
+static sd_request_t* sd_queue = NULL;
+static sd_request_t* sd_active = NULL;
+static sd_phase_t sd_phase;
+static bool sd_run_multi;
+static int sd_run_result;       // SD_BLOCK_* outcome of the current run
+static int sd_run_retries;
+static uint8_t sd_data_response;
+static absolute_time_t sd_phase_deadline;
+static uint32_t sd_phase_since_us;      // Start of the current wait, for the stats
+static uint32_t sd_active_since_us;     // When the active request started
+
 
 // Helper functions
-static void sd_cs_select(void) {
+// Whether a CRC failure gets another attempt; counted in the stats
+static bool sd_should_retry(int result, int* retries) {
+    if (result != SD_BLOCK_CRC || ++*retries > SD_CRC_RETRIES) return false;
+    sd.stats.retries++;
+    return true;
+}
+
+static void sd_cs_assert(void) {
+    sd_bus_busy = true;
     gpio_put(SD_PIN_CS, 0);
 }
 
-static void sd_cs_deselect(void) {
-    gpio_put(SD_PIN_CS, 1);
+// Select the card for a new command, first letting a deferred write finish
+static void sd_cs_select(void) {
+    sd_cs_assert();
+    if (sd.write_pending) sd_settle_write();
 }
 
-static uint8_t sd_spi_write(uint8_t data) {
-    uint8_t rx_data;
-    spi_write_read_blocking(SD_SPI_PORT, &data, &rx_data, 1);
-    return rx_data;
+static void sd_cs_deselect(void) {
+    gpio_put(SD_PIN_CS, 1);
+    sd_bus_busy = false;
 }
 
 static uint8_t sd_send_command(uint8_t cmd, uint32_t arg) {
-    uint8_t crc = 0;
+    uint8_t frame[6] = {
+        0x40 | cmd,
+        (arg >> 24) & 0xFF,
+        (arg >> 16) & 0xFF,
+        (arg >> 8) & 0xFF,
+        arg & 0xFF,
+        0
+    };
+    frame[5] = (sd_crc7(frame, 5) << 1) | 0x01;
     
-    // Calculate CRC for CMD0 and CMD8
-    if (cmd == SD_CMD0) crc = 0x95;
-    else if (cmd == SD_CMD8) crc = 0x87;
-    
-    // Send command
-    sd_spi_write(0x40 | cmd);
-    sd_spi_write((arg >> 24) & 0xFF);
-    sd_spi_write((arg >> 16) & 0xFF);
-    sd_spi_write((arg >> 8) & 0xFF);
-    sd_spi_write(arg & 0xFF);
-    sd_spi_write(crc);
-    
-    // Wait for response
-    uint8_t response;
-    for (int i = 0; i < 10; i++) {
-        response = sd_spi_write(0xFF);
-        if (response != 0xFF) break;
+    uint8_t response = 0xFF;
+    for (int attempt = 0; attempt <= SD_CRC_RETRIES; attempt++) {
+        sd.stats.commands++;
+        if (attempt > 0) sd.stats.retries++;
+        
+        // Send command
+        for (int i = 0; i < 6; i++) {
+            sd_spi_write(frame[i]);
+        }
+        
+        // CMD12 is followed by a stuff byte before the R1 response
+        if (cmd == SD_CMD12) sd_spi_write(0xFF);
+        
+        // Wait for response
+        for (int i = 0; i < 10; i++) {
+            response = sd_spi_write(0xFF);
+            if (response != 0xFF) break;
+        }
+        
+        // Resend only if the card saw a corrupted command frame
+        if ((response & 0x80) || !(response & SD_R1_COM_CRC_ERROR)) break;
+        sd.stats.crc_errors++;
     }
     
     return response;
 }
 
-int sd_init_driver(void) {
+// Command argument for a sector: SDSC cards take a byte address
+static uint32_t sd_block_address(uint32_t sector) {
+    return sd.info.block_addressing ? sector : sector * 512;
+}
+
+void sd_bus_init(void) {
+    sd_spi_init();
+}
+
+// CMD9: SEND_CSD, returned as a 16-byte data block
+static int sd_read_csd(uint8_t* csd) {
+    sd_cs_select();
+    uint8_t response = sd_send_command(SD_CMD9, 0);
+    int result = (response == 0 && sd_read_data_block(csd, 16) == SD_BLOCK_OK) ? 0 : -1;
+    sd_cs_deselect();
+    return result;
+}
+
+// Card identification at the identification clock: reset, voltage check,
+// ACMD41, addressing mode and CSD. Leaves sd.info filled in.
+static int sd_identify(void) {
+    // Identification must run at 100-400 kHz
+    sd.clock_step = -1;
+    sd_clock_hz = sd_spi_set_baudrate(SD_INIT_CLOCK_HZ);
+    
     sd_cs_deselect();
     
     // Send 80+ clock cycles with CS high
@@ -62,11 +151,12 @@ int sd_init_driver(void) {
     sd_cs_deselect();
     
     if (response != SD_R1_IDLE_STATE) {
-        printf("CMD0 failed: 0x%02X\n", response);
+        LOG_ERROR("CMD0 failed: 0x%02X\n", response);
         return -1;
     }
     
-    // CMD8: SEND_IF_COND
+    // CMD8: SEND_IF_COND. Version 1 cards reject it as an illegal command.
+    bool v2_card = false;
     sd_cs_select();
     response = sd_send_command(SD_CMD8, 0x1AA);
     if (response == SD_R1_IDLE_STATE) {
@@ -75,152 +165,826 @@ int sd_init_driver(void) {
         for (int i = 0; i < 4; i++) {
             r7[i] = sd_spi_write(0xFF);
         }
-        printf("CMD8 response: %02X %02X %02X %02X\n", r7[0], r7[1], r7[2], r7[3]);
+        LOG_DEBUG("CMD8 response: %02X %02X %02X %02X\n", r7[0], r7[1], r7[2], r7[3]);
+        
+        if ((r7[2] & 0x0F) != 0x01 || r7[3] != 0xAA) {
+            LOG_ERROR("CMD8 voltage/check pattern mismatch\n");
+            sd_cs_deselect();
+            return -1;
+        }
+        v2_card = true;
     }
     sd_cs_deselect();
     
-    // Initialize card with ACMD41
+    // CMD59: CRC_ON_OFF. From here on the card checks CRC7 on every
+    // command and CRC16 on every data block.
+    sd_cs_select();
+    response = sd_send_command(SD_CMD59, 1);
+    sd_cs_deselect();
+    
+    if (response & ~SD_R1_IDLE_STATE) {
+        LOG_ERROR("CMD59 failed: 0x%02X\n", response);
+        return -1;
+    }
+    
+    // Initialize card with ACMD41, advertising high capacity support (HCS)
+    // only to cards that understood CMD8
     int timeout = 1000;
     do {
         sd_cs_select();
         sd_send_command(SD_CMD55, 0);
-        response = sd_send_command(SD_CMD41, 0x40000000);
+        response = sd_send_command(SD_CMD41, v2_card ? 0x40000000 : 0);
         sd_cs_deselect();
         
         if (response == 0) break;
         
-        sleep_ms(1);
+        sd_pause_ms(1);
         timeout--;
     } while (timeout > 0);
     
     if (response != 0) {
-        printf("ACMD41 failed: 0x%02X\n", response);
+        LOG_ERROR("ACMD41 failed: 0x%02X\n", response);
         return -1;
     }
     
-    // Set block size to 512 bytes
-    sd_cs_select();
-    response = sd_send_command(SD_CMD16, 512);
-    sd_cs_deselect();
+    // CMD58: READ_OCR. CCS tells SDHC/SDXC (block addressed) from SDSC.
+    memset(&sd.info, 0, sizeof(sd.info));
+    sd.info.type = SD_CARD_TYPE_SDSC_V1;
+    if (v2_card) {
+        sd_cs_select();
+        response = sd_send_command(SD_CMD58, 0);
+        uint8_t ocr[4];
+        for (int i = 0; i < 4; i++) {
+            ocr[i] = sd_spi_write(0xFF);
+        }
+        sd_cs_deselect();
+        
+        if (response != 0) {
+            LOG_ERROR("CMD58 failed: 0x%02X\n", response);
+            return -1;
+        }
+        
+        sd.info.ocr = ((uint32_t)ocr[0] << 24) | ((uint32_t)ocr[1] << 16) |
+                      ((uint32_t)ocr[2] << 8) | ocr[3];
+        sd.info.block_addressing = (sd.info.ocr & SD_OCR_CCS) != 0;
+        sd.info.type = sd.info.block_addressing ? SD_CARD_TYPE_SDHC : SD_CARD_TYPE_SDSC_V2;
+    }
     
-    if (response != 0) {
-        printf("CMD16 failed: 0x%02X\n", response);
+    // Set block size to 512 bytes (fixed on block-addressed cards)
+    if (!sd.info.block_addressing) {
+        sd_cs_select();
+        response = sd_send_command(SD_CMD16, 512);
+        sd_cs_deselect();
+        
+        if (response != 0) {
+            LOG_ERROR("CMD16 failed: 0x%02X\n", response);
+            return -1;
+        }
+    }
+    
+    if (sd_read_csd(sd.info.csd) != 0) {
+        LOG_ERROR("CMD9 failed\n");
         return -1;
     }
     
-    // Get card capacity (simplified - assume 1GB for now)
-    // In a real implementation, you'd read the CSD register
-    sd_sectors = 2097152; // 1GB = 2097152 * 512 bytes
+    if (sd_parse_csd(sd.info.csd, &sd.info) != 0) {
+        return -1;
+    }
     
-    sd_initialized = true;
-    printf("SD card initialized successfully\n");
     return 0;
 }
 
-int sd_read_sectors(void* buffer, uint32_t sector, uint32_t count) {
-    if (!sd_initialized) {
-        printf("SD card not initialized\n");
+int sd_init_driver(void) {
+    sd.initialized = false;
+    sd.write_pending = false;
+    sd.write_failed = false;
+    sd.status_unchecked = false;
+    
+    if (sd_identify() != 0) {
         return -1;
     }
     
+    // One literal per card type: log arguments cannot be strings
+    const char* card_fmt =
+        sd.info.type == SD_CARD_TYPE_SDHC ? "SD card: SDHC/SDXC, %lu sectors (%lu MB), max %lu Hz\n" :
+        sd.info.type == SD_CARD_TYPE_SDSC_V2 ? "SD card: SDSC v2, %lu sectors (%lu MB), max %lu Hz\n" :
+        "SD card: SDSC v1, %lu sectors (%lu MB), max %lu Hz\n";
+    LOG_INFO(card_fmt, sd.info.sectors, sd.info.sectors / 2048, sd.info.max_clock_hz);
+    
+    sd.initialized = true;
+    sd_driver_clock_ramp(&sd);
+    LOG_INFO("SD card initialized successfully at %lu Hz\n", (unsigned long)sd_clock_hz);
+    return 0;
+}
+
+// Wait for the start block token and clock in one data block
+static int sd_read_data_block(uint8_t* buf, size_t len) {
+    // Wait for data token; bounded in time since the clock is not fixed
+    uint32_t wait_start = time_us_32();
+    uint8_t token = sd_spi_wait_token(make_timeout_time_ms(SD_READ_TIMEOUT_MS));
+    sd.stats.token_wait_us += time_us_32() - wait_start;
+    
+    if (token != 0xFE) {
+        LOG_ERROR("Data token timeout: 0x%02X\n", token);
+        sd_clock_downshift();
+        return SD_BLOCK_ERROR;
+    }
+    
+    // Read data; the sniffer computes CRC16 as it lands
+    uint16_t crc = sd_spi_transfer_block(NULL, buf, len);
+    
+    uint16_t card_crc = (uint16_t)sd_spi_write(0xFF) << 8;
+    card_crc |= sd_spi_write(0xFF);
+    
+    if (crc != card_crc) {
+        LOG_WARN("Read CRC mismatch: 0x%04X != 0x%04X\n", crc, card_crc);
+        sd.stats.crc_errors++;
+        sd_clock_downshift();
+        return SD_BLOCK_CRC;
+    }
+    
+    sd.stats.sectors_read++;
+    return SD_BLOCK_OK;
+}
+
+// Wait until the card releases DO after an R1b response or a data block
+static int sd_wait_not_busy(void) {
+    uint32_t wait_start = time_us_32();
+    absolute_time_t deadline = make_timeout_time_ms(SD_WRITE_TIMEOUT_MS);
+    int result = 0;
+    while (sd_spi_write(0xFF) != 0xFF) {
+        if (time_reached(deadline)) {
+            result = -1;
+            break;
+        }
+    }
+    sd.stats.busy_wait_us += time_us_32() - wait_start;
+    return result;
+}
+
+// Wait out a deferred write with CS asserted
+static void sd_settle_write(void) {
+    uint32_t wait_start = time_us_32();
+    sd.write_pending = false;
+    while (sd_spi_write(0xFF) != 0xFF) {
+        if (time_reached(sd.write_deadline)) {
+            LOG_ERROR("Deferred write busy timeout\n");
+            sd.write_failed = true;
+            break;
+        }
+    }
+    sd.stats.busy_wait_us += time_us_32() - wait_start;
+}
+
+// CMD12: end an open-ended READ_MULTIPLE_BLOCK
+static int sd_stop_transmission(void) {
+    uint8_t response = sd_send_command(SD_CMD12, 0);
+    if (sd_wait_not_busy() != 0) {
+        LOG_ERROR("CMD12 busy timeout\n");
+        return -1;
+    }
+    if (response != 0) {
+        LOG_ERROR("CMD12 failed: 0x%02X\n", response);
+        return -1;
+    }
+    return 0;
+}
+
+// One CMD17 per sector; kept for single sectors and for benchmarking
+static int sd_read_blocks_single(void* buffer, uint32_t sector, uint32_t count) {
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    sd_wait_request_idle();
+    
     uint8_t* buf = (uint8_t*)buffer;
     
     for (uint32_t i = 0; i < count; i++) {
-        sd_cs_select();
+        int result;
+        int retries = 0;
         
-        uint8_t response = sd_send_command(SD_CMD17, sector + i);
-        if (response != 0) {
-            printf("CMD17 failed: 0x%02X\n", response);
+        do {
+            sd_cs_select();
+            
+            uint8_t response = sd_send_command(SD_CMD17, sd_block_address(sector + i));
+            if (response != 0) {
+                LOG_ERROR("CMD17 failed: 0x%02X\n", response);
+                sd_cs_deselect();
+                return -1;
+            }
+            
+            result = sd_read_data_block(buf + i * 512, 512);
             sd_cs_deselect();
+        } while (sd_should_retry(result, &retries));
+        
+        if (result != SD_BLOCK_OK) {
             return -1;
         }
+    }
+    
+    return 0;
+}
+
+static int sd_read_blocks(void* buffer, uint32_t sector, uint32_t count) {
+    if (count <= 1) {
+        return sd_read_blocks_single(buffer, sector, count);
+    }
+    
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    sd_wait_request_idle();
+    
+    uint8_t* buf = (uint8_t*)buffer;
+    uint32_t done = 0;
+    int retries = 0;
+    
+    // CMD18 streams consecutive blocks until CMD12, so the command,
+    // CS toggle and token wait are paid once for the whole run. A CRC
+    // error restarts the stream at the failing block.
+    while (done < count) {
+        sd_cs_select();
         
-        // Wait for data token
-        uint8_t token;
-        int timeout = 1000;
-        do {
-            token = sd_spi_write(0xFF);
-            timeout--;
-        } while (token != 0xFE && timeout > 0);
-        
-        if (token != 0xFE) {
-            printf("Data token timeout: 0x%02X\n", token);
+        uint8_t response = sd_send_command(SD_CMD18, sd_block_address(sector + done));
+        if (response != 0) {
+            LOG_ERROR("CMD18 failed: 0x%02X\n", response);
             sd_cs_deselect();
             return -1;
         }
         
-        // Read data
-        for (int j = 0; j < 512; j++) {
-            buf[i * 512 + j] = sd_spi_write(0xFF);
+        int result = SD_BLOCK_OK;
+        while (done < count) {
+            result = sd_read_data_block(buf + done * 512, 512);
+            if (result != SD_BLOCK_OK) break;
+            done++;
         }
         
-        // Read CRC (ignore)
-        sd_spi_write(0xFF);
-        sd_spi_write(0xFF);
+        if (sd_stop_transmission() != 0) {
+            result = SD_BLOCK_ERROR;
+        }
         
         sd_cs_deselect();
+        
+        if (sd_should_retry(result, &retries)) continue;
+        if (result != SD_BLOCK_OK) return -1;
     }
     
     return 0;
 }
 
-int sd_write_sectors(const void* buffer, uint32_t sector, uint32_t count) {
-    if (!sd_initialized) {
-        printf("SD card not initialized\n");
+// Send one data block behind the given start token and check the data
+// response. With defer_busy an accepted block returns without waiting for
+// the card to finish programming it.
+static int sd_write_data_block(uint8_t token, const uint8_t* buf, bool defer_busy) {
+    // Send data token
+    sd_spi_write(token);
+    
+    // Send data; the sniffer computes CRC16 on the way out
+    uint16_t crc = sd_spi_transfer_block(buf, NULL, 512);
+    
+    sd_spi_write(crc >> 8);
+    sd_spi_write(crc & 0xFF);
+    
+    // Wait for response
+    uint8_t data_response = sd_spi_write(0xFF) & 0x1F;
+    
+    if (defer_busy && data_response == 0x05) {
+        sd_defer_busy(&sd, SD_WRITE_TIMEOUT_MS);
+        sd.stats.sectors_written++;
+        return SD_BLOCK_OK;
+    }
+    
+    // Wait for write completion (or for the card to discard the block)
+    if (sd_wait_not_busy() != 0) {
+        LOG_ERROR("Write timeout\n");
+        return SD_BLOCK_ERROR;
+    }
+    
+    if (data_response == 0x0B) {
+        // Data rejected due to a CRC error
+        LOG_ERROR("Write CRC rejected\n");
+        sd.stats.crc_errors++;
+        sd_clock_downshift();
+        return SD_BLOCK_CRC;
+    }
+    
+    if (data_response != 0x05) {
+        LOG_ERROR("Write response error: 0x%02X\n", data_response);
+        return SD_BLOCK_ERROR;
+    }
+    
+    sd.stats.sectors_written++;
+    return SD_BLOCK_OK;
+}
+
+// One CMD24 per sector; kept for single sectors and for benchmarking
+static int sd_write_blocks_single(const void* buffer, uint32_t sector, uint32_t count) {
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
         return -1;
     }
     
+    sd_wait_request_idle();
+    
     const uint8_t* buf = (const uint8_t*)buffer;
     
     for (uint32_t i = 0; i < count; i++) {
+        int result;
+        int retries = 0;
+        
+        do {
+            sd_cs_select();
+            
+            uint8_t response = sd_send_command(SD_CMD24, sd_block_address(sector + i));
+            if (response != 0) {
+                LOG_ERROR("CMD24 failed: 0x%02X\n", response);
+                sd_cs_deselect();
+                return -1;
+            }
+            
+            result = sd_write_data_block(0xFE, buf + i * 512, true);
+            sd_cs_deselect();
+        } while (sd_should_retry(result, &retries));
+        
+        if (result != SD_BLOCK_OK) {
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int sd_erase_sectors(uint32_t sector, uint32_t count) {
+    sd_wait_request_idle();
+    return sd_driver_erase(&sd, sector, count);
+}
+
+static int sd_write_blocks(const void* buffer, uint32_t sector, uint32_t count) {
+    if (count <= 1) {
+        return sd_write_blocks_single(buffer, sector, count);
+    }
+    
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    sd_wait_request_idle();
+    
+    const uint8_t* buf = (const uint8_t*)buffer;
+    uint32_t done = 0;
+    int retries = 0;
+    
+    // A CRC-rejected block ends the burst; the blocks before it were
+    // accepted, so the next burst resumes at the rejected one
+    while (done < count) {
         sd_cs_select();
         
-        uint8_t response = sd_send_command(SD_CMD24, sector + i);
+        // ACMD23 lets the card pre-erase the whole run before CMD25 starts
+        sd_send_command(SD_CMD55, 0);
+        uint8_t response = sd_send_command(SD_ACMD23, count - done);
         if (response != 0) {
-            printf("CMD24 failed: 0x%02X\n", response);
+            // Only a hint; carry on without pre-erase
+            LOG_ERROR("ACMD23 failed: 0x%02X\n", response);
+        }
+        
+        response = sd_send_command(SD_CMD25, sd_block_address(sector + done));
+        if (response != 0) {
+            LOG_ERROR("CMD25 failed: 0x%02X\n", response);
             sd_cs_deselect();
             return -1;
         }
         
-        // Send data token
-        sd_spi_write(0xFE);
-        
-        // Send data
-        for (int j = 0; j < 512; j++) {
-            sd_spi_write(buf[i * 512 + j]);
+        int result = SD_BLOCK_OK;
+        while (done < count) {
+            result = sd_write_data_block(0xFC, buf + done * 512, false);
+            if (result != SD_BLOCK_OK) break;
+            done++;
         }
         
-        // Send dummy CRC
-        sd_spi_write(0xFF);
+        // Stop token ends the transfer even after a rejected block; the
+        // card's final programming is left to the next command
+        sd_spi_write(0xFD);
         sd_spi_write(0xFF);
+        sd_defer_busy(&sd, SD_WRITE_TIMEOUT_MS);
         
-        // Wait for response
-        uint8_t data_response = sd_spi_write(0xFF);
-        if ((data_response & 0x1F) != 0x05) {
-            printf("Write response error: 0x%02X\n", data_response);
+        sd_cs_deselect();
+        
+        if (sd_should_retry(result, &retries)) continue;
+        if (result != SD_BLOCK_OK) return -1;
+    }
+    
+    return 0;
+}
+
+//--------------------------------------------------------------------+
+// Driver hooks for sd_common.c
+//--------------------------------------------------------------------+
+
+static int sd_transfer_once(const sd_transfer_t* t) {
+    if (t->op == SD_OP_READ) {
+        return t->single ? sd_read_blocks_single(t->buffer, t->sector, t->count)
+                         : sd_read_blocks(t->buffer, t->sector, t->count);
+    }
+    return t->single ? sd_write_blocks_single(t->buffer, t->sector, t->count)
+                     : sd_write_blocks(t->buffer, t->sector, t->count);
+}
+
+static int sd_erase_run(uint32_t first, uint32_t last) {
+    sd_cs_select();
+    uint8_t response = sd_send_command(SD_CMD32, sd_block_address(first));
+    if (response == 0) response = sd_send_command(SD_CMD33, sd_block_address(last));
+    if (response == 0) response = sd_send_command(SD_CMD38, 0);
+    sd_cs_deselect();
+    
+    if (response != 0) {
+        LOG_ERROR("Erase command failed: 0x%02X\n", response);
+        return -1;
+    }
+    return 0;
+}
+
+// End a multi-block transfer the card may still be streaming
+static void sd_abort_transfer(void) {
+    sd_cs_select();
+    sd_send_command(SD_CMD12, 0);
+    sd_wait_not_busy();
+    sd_cs_deselect();
+}
+
+static int sd_check_status(void) {
+    int result = 0;
+    
+    sd_cs_select();     // Waits out the deferred write first
+    if (!sd.write_failed) {
+        // CMD13: SEND_STATUS, R2 (R1 plus a second status byte)
+        uint8_t response = sd_send_command(SD_CMD13, 0);
+        uint8_t status = sd_spi_write(0xFF);
+        if (response != 0 || status != 0) {
+            LOG_ERROR("Write status error: 0x%02X 0x%02X\n", response, status);
+            result = -1;
+        }
+    }
+    sd_cs_deselect();
+    return result;
+}
+
+static const sd_driver_ops_t sd_ops = {
+    .transfer = sd_transfer_once,
+    .erase = sd_erase_run,
+    .abort = sd_abort_transfer,
+    .identify = sd_identify,
+    .check_status = sd_check_status,
+    .read_csd = sd_read_csd,
+    .clock_apply = sd_clock_apply,
+    .clock_downshift = sd_clock_downshift,
+    .clock_steps = sd_clock_steps,
+    .clock_step_count = SD_CLOCK_STEP_COUNT,
+};
+
+// Public entry points: timed for the latency histograms, with recovery
+int sd_read_sectors_single(void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_READ, true, buffer, sector, count);
+}
+
+int sd_read_sectors(void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_READ, false, buffer, sector, count);
+}
+
+int sd_write_sectors_single(const void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_WRITE, true, (void*)buffer, sector, count);
+}
+
+int sd_write_sectors(const void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_WRITE, false, (void*)buffer, sector, count);
+}
+
+//--------------------------------------------------------------------+
+// Asynchronous requests
+//--------------------------------------------------------------------+
+
+int sd_submit(sd_request_t* request) {
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    if (request->count == 0 || request->sector + request->count > sd.info.sectors) {
+        LOG_ERROR("SD request out of range: %lu+%lu\n",
+               (unsigned long)request->sector, (unsigned long)request->count);
+        return -1;
+    }
+    
+    request->status = SD_REQUEST_QUEUED;
+    request->completed = 0;
+    request->cancel_requested = false;
+    sd_request_enqueue(&sd_queue, request);
+    return 0;
+}
+
+bool sd_request_pending(const sd_request_t* request) {
+    return request->status == SD_REQUEST_QUEUED || request->status == SD_REQUEST_ACTIVE;
+}
+
+void sd_cancel(sd_request_t* request) {
+    if (sd_request_unlink(&sd_queue, request)) {
+        sd_request_complete(request, SD_REQUEST_CANCELLED);
+    } else if (request == sd_active) {
+        request->cancel_requested = true;
+    }
+}
+
+// Release the bus and report the active request
+static void sd_finish_request(sd_request_status_t status) {
+    sd_request_t* request = sd_active;
+    
+    sd_stats_record(&sd.stats, request->write ? SD_OP_WRITE : SD_OP_READ, sd_active_since_us);
+    
+    sd_cs_deselect();
+    sd_active = NULL;
+    sd_request_complete(request, status);
+}
+
+// Start a write block: token, then the payload DMA
+static void sd_start_write_block(void) {
+    const uint8_t* buf = (const uint8_t*)sd_active->buffer + sd_active->completed * 512;
+    
+    sd_spi_write(sd_run_multi ? 0xFC : 0xFE);
+    sd_spi_transfer_start(buf, NULL, 512);
+    sd_phase = SD_PHASE_DATA;
+}
+
+// Issue the command for the rest of the active request
+static void sd_phase_start(void) {
+    uint32_t remaining = sd_active->count - sd_active->completed;
+    uint32_t address = sd_block_address(sd_active->sector + sd_active->completed);
+    uint8_t response;
+    
+    sd_run_multi = remaining > 1;
+    sd_run_result = SD_BLOCK_OK;
+    
+    sd_cs_select();
+    if (sd_active->write) {
+        if (sd_run_multi) {
+            sd_send_command(SD_CMD55, 0);
+            sd_send_command(SD_ACMD23, remaining);
+        }
+        response = sd_send_command(sd_run_multi ? SD_CMD25 : SD_CMD24, address);
+    } else {
+        response = sd_send_command(sd_run_multi ? SD_CMD18 : SD_CMD17, address);
+    }
+    
+    if (response != 0) {
+        LOG_ERROR(sd_active->write ? "Write command failed: 0x%02X\n" : "Read command failed: 0x%02X\n", response);
+        sd_finish_request(SD_REQUEST_ERROR);
+        return;
+    }
+    
+    if (sd_active->write) {
+        sd_start_write_block();
+    } else {
+        sd_phase = SD_PHASE_TOKEN;
+        sd_phase_deadline = make_timeout_time_ms(SD_READ_TIMEOUT_MS);
+        sd_phase_since_us = time_us_32();
+    }
+}
+
+// A block finished (or failed); pick the next block or end the run
+static void sd_block_done(int result) {
+    if (result == SD_BLOCK_OK) {
+        sd_active->completed++;
+        if (sd_active->write) {
+            sd.stats.sectors_written++;
+        } else {
+            sd.stats.sectors_read++;
+        }
+    }
+    
+    if (result != SD_BLOCK_OK || sd_active->completed == sd_active->count ||
+        sd_active->cancel_requested) {
+        sd_run_result = result;
+        sd_phase = SD_PHASE_STOP;
+    } else if (sd_active->write) {
+        sd_start_write_block();
+    } else {
+        sd_phase = SD_PHASE_TOKEN;
+        sd_phase_deadline = make_timeout_time_ms(SD_READ_TIMEOUT_MS);
+        sd_phase_since_us = time_us_32();
+    }
+}
+
+// The run is over and CS released; retry, finish or report
+static void sd_run_done(void) {
+    if (sd_should_retry(sd_run_result, &sd_run_retries)) {
+        sd_cs_deselect();
+        sd_phase = SD_PHASE_START;
+        sd_phase_since_us = time_us_32();
+    } else if (sd_run_result != SD_BLOCK_OK) {
+        sd_finish_request(SD_REQUEST_ERROR);
+    } else if (sd_active->completed < sd_active->count) {
+        sd_finish_request(SD_REQUEST_CANCELLED);
+    } else {
+        sd_finish_request(SD_REQUEST_DONE);
+    }
+}
+
+// Advance the active request by one step. Every branch either returns
+// right away or does a bounded amount of bus work.
+void sd_task(void) {
+    if (sd_bus_busy && !sd_active) return;  // Blocking call in progress
+    
+    if (!sd_active) {
+        sd_active = sd_request_dequeue(&sd_queue);
+        if (!sd_active) return;
+        
+        sd_active->status = SD_REQUEST_ACTIVE;
+        sd_run_retries = 0;
+        sd_phase = SD_PHASE_START;
+        sd_active_since_us = time_us_32();
+        sd_phase_since_us = sd_active_since_us;
+    }
+    
+    switch (sd_phase) {
+    case SD_PHASE_START:
+        if (sd_active->cancel_requested) {
+            sd_finish_request(SD_REQUEST_CANCELLED);
+            return;
+        }
+        // Poll out a deferred write here rather than in sd_cs_select()
+        if (sd.write_pending) {
+            sd_cs_assert();
+            uint8_t ready = sd_spi_write(0xFF);
             sd_cs_deselect();
-            return -1;
+            if (ready != 0xFF && !time_reached(sd.write_deadline)) return;
+            if (ready != 0xFF) {
+                LOG_ERROR("Deferred write busy timeout\n");
+                sd.write_failed = true;
+            }
+            sd.write_pending = false;
+            sd.stats.busy_wait_us += time_us_32() - sd_phase_since_us;
         }
+        sd_phase_start();
+        break;
         
-        // Wait for write completion
-        int timeout = 1000;
-        do {
-            response = sd_spi_write(0xFF);
-            timeout--;
-        } while (response == 0 && timeout > 0);
+    case SD_PHASE_TOKEN: {
+        uint8_t token;
+        if (sd_active->cancel_requested) {
+            sd_spi_cancel_token();
+            sd_phase = SD_PHASE_STOP;
+            return;
+        }
+        if (!sd_spi_poll_token(&token)) {
+            if (time_reached(sd_phase_deadline)) {
+                sd_spi_cancel_token();
+                LOG_ERROR("Data token timeout\n");
+                sd_clock_downshift();
+                sd_block_done(SD_BLOCK_ERROR);
+            }
+            return;
+        }
+        sd.stats.token_wait_us += time_us_32() - sd_phase_since_us;
+        if (token != 0xFE) {
+            LOG_ERROR("Data token error: 0x%02X\n", token);
+            sd_clock_downshift();
+            sd_block_done(SD_BLOCK_ERROR);
+            return;
+        }
+        uint8_t* buf = (uint8_t*)sd_active->buffer + sd_active->completed * 512;
+        sd_spi_transfer_start(NULL, buf, 512);
+        sd_phase = SD_PHASE_DATA;
+        break;
+    }
+    
+    case SD_PHASE_DATA: {
+        uint16_t crc;
+        if (!sd_spi_transfer_poll(&crc)) return;
         
-        if (timeout == 0) {
-            printf("Write timeout\n");
-            sd_cs_deselect();
-            return -1;
+        if (sd_active->write) {
+            sd_spi_write(crc >> 8);
+            sd_spi_write(crc & 0xFF);
+            sd_data_response = sd_spi_write(0xFF) & 0x1F;
+            if (!sd_run_multi && sd_data_response == 0x05) {
+                sd_defer_busy(&sd, SD_WRITE_TIMEOUT_MS);
+                sd_block_done(SD_BLOCK_OK);
+                return;
+            }
+            sd_phase = SD_PHASE_WRITE_BUSY;
+            sd_phase_deadline = make_timeout_time_ms(SD_WRITE_TIMEOUT_MS);
+            sd_phase_since_us = time_us_32();
+            return;
         }
         
-        sd_cs_deselect();
+        uint16_t card_crc = (uint16_t)sd_spi_write(0xFF) << 8;
+        card_crc |= sd_spi_write(0xFF);
+        if (crc != card_crc) {
+            LOG_WARN("Read CRC mismatch: 0x%04X != 0x%04X\n", crc, card_crc);
+            sd.stats.crc_errors++;
+            sd_clock_downshift();
+            sd_block_done(SD_BLOCK_CRC);
+            return;
+        }
+        sd_block_done(SD_BLOCK_OK);
+        break;
     }
     
-    return 0;
+    case SD_PHASE_WRITE_BUSY:
+        if (sd_spi_write(0xFF) != 0xFF) {
+            if (time_reached(sd_phase_deadline)) {
+                LOG_ERROR("Write timeout\n");
+                sd_block_done(SD_BLOCK_ERROR);
+            }
+            return;
+        }
+        sd.stats.busy_wait_us += time_us_32() - sd_phase_since_us;
+        if (sd_data_response == 0x0B) {
+            LOG_ERROR("Write CRC rejected\n");
+            sd.stats.crc_errors++;
+            sd_clock_downshift();
+            sd_block_done(SD_BLOCK_CRC);
+        } else if (sd_data_response != 0x05) {
+            LOG_ERROR("Write response error: 0x%02X\n", sd_data_response);
+            sd_block_done(SD_BLOCK_ERROR);
+        } else {
+            sd_block_done(SD_BLOCK_OK);
+        }
+        break;
+        
+    case SD_PHASE_STOP:
+        if (!sd_run_multi) {
+            sd_run_done();
+        } else if (sd_active->write) {
+            sd_spi_write(0xFD);
+            sd_spi_write(0xFF);
+            sd_defer_busy(&sd, SD_WRITE_TIMEOUT_MS);
+            sd_run_done();
+        } else {
+            if (sd_stop_transmission() != 0) {
+                sd_run_result = SD_BLOCK_ERROR;
+            }
+            sd_run_done();
+        }
+        break;
+    }
+}
+
+int sd_sync(void) {
+    sd_wait_request_idle();
+    return sd_driver_sync(&sd);
+}
+
+// Let the active request run to completion before a blocking transfer
+static void sd_wait_request_idle(void) {
+    while (sd_active) {
+        sd_task();
+    }
+}
+
+//--------------------------------------------------------------------+
+// SPI clock management
+//--------------------------------------------------------------------+
+
+static void sd_clock_apply(int step) {
+    sd.clock_step = step;
+    uint32_t target = (step < 0) ? SD_INIT_CLOCK_HZ : sd_clock_steps[step];
+    sd_clock_hz = sd_spi_set_baudrate(target);
+}
+
+// Drop one step after a CRC or token error
+static void sd_clock_downshift(void) {
+    if (sd.clock_step < 0 || sd.clock_step >= SD_CLOCK_STEP_COUNT - 1) return;
+    
+    sd_clock_apply(sd.clock_step + 1);
+    LOG_WARN("SD clock downshift to %lu Hz\n", (unsigned long)sd_clock_hz);
+}
+
+uint32_t sd_get_clock_hz(void) {
+    return sd_clock_hz;
+}
+
+const char* sd_get_transport_name(void) {
+    return sd_spi_transport_name();
 }
 
 uint32_t sd_get_sectors_count(void) {
-    return sd_sectors;
+    return sd.info.sectors;
+}
+
+const sd_card_info_t* sd_get_card_info(void) {
+    return &sd.info;
+}
+
+void sd_get_stats(sd_stats_t* stats) {
+    *stats = sd.stats;
+}
+
+void sd_reset_stats(void) {
+    memset(&sd.stats, 0, sizeof(sd.stats));
+}
+
+bool sd_is_busy(void) {
+    return sd_bus_busy || sd_active != NULL || sd.recovering;
 }
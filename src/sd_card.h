@@ -19,9 +19,14 @@
 #define SD_CMD23    23  // SET_BLOCK_COUNT
 #define SD_CMD24    24  // WRITE_BLOCK
 #define SD_CMD25    25  // WRITE_MULTIPLE_BLOCK
+#define SD_CMD32    32  // ERASE_WR_BLK_START_ADDR
+#define SD_CMD33    33  // ERASE_WR_BLK_END_ADDR
+#define SD_CMD38    38  // ERASE
+#define SD_ACMD23   23  // SET_WR_BLK_ERASE_COUNT (ACMD)
 #define SD_CMD41    41  // SEND_OP_COND (ACMD)
 #define SD_CMD55    55  // APP_CMD
 #define SD_CMD58    58  // READ_OCR
+#define SD_CMD59    59  // CRC_ON_OFF
 
 // SD Card Response Types
 #define SD_R1_IDLE_STATE         0x01
@@ -32,17 +37,166 @@
 #define SD_R1_ADDRESS_ERROR      0x20
 #define SD_R1_PARAMETER_ERROR    0x40
 
+// OCR bits
+#define SD_OCR_CCS               0x40000000  // Card Capacity Status (block addressing)
+
+// Worst-case access times from the SD physical layer spec
+#define SD_READ_TIMEOUT_MS       100
+#define SD_WRITE_TIMEOUT_MS      500
+
+// Erase is split into CMD38s of at most this many sectors (4 MiB, the
+// largest allocation unit of an SDHC card), each allowed this long
+#define SD_ERASE_MAX_SECTORS     8192
+#define SD_ERASE_TIMEOUT_MS      1000
+
+// Resends allowed for a command or data block that failed its CRC
+#define SD_CRC_RETRIES           3
+
+// Recovery for a failed transfer: this many retries, the first after
+// SD_RECOVERY_BACKOFF_MS and each later one after twice the previous
+// delay, then re-identification and finally one clock step down
+#ifndef SD_RECOVERY_RETRIES
+#define SD_RECOVERY_RETRIES      3
+#endif
+#define SD_RECOVERY_BACKOFF_MS   2
+
+// SPI clock during card identification
+#define SD_INIT_CLOCK_HZ         400000
+
+// Upper bound for the post-init clock ramp
+#ifndef SD_MAX_CLOCK_HZ
+#define SD_MAX_CLOCK_HZ          50000000
+#endif
+
+// Reads of sector 0 at the identification clock before the ramp falls
+// back to the CSD and status registers as its probe
+#define SD_CLOCK_RAMP_TRIES      3
+
+#if SD_BUS_SDIO
+// GPIO pins for the 4-bit SD bus (defined in main.c). DAT0-DAT3 are
+// consecutive from SD_PIN_D0 and CLK must be SD_PIN_D0 + 4.
+extern const uint SD_PIN_CLK;
+extern const uint SD_PIN_CMD;
+extern const uint SD_PIN_D0;
+#else
 // GPIO pins for SD card SPI (defined in main.c)
 extern const uint SD_PIN_MISO;
 extern const uint SD_PIN_CS;
 extern const uint SD_PIN_SCK;
 extern const uint SD_PIN_MOSI;
 extern spi_inst_t* const SD_SPI_PORT;
+#endif
+
+typedef enum {
+    SD_CARD_TYPE_UNKNOWN = 0,
+    SD_CARD_TYPE_SDSC_V1,   // Byte addressed, CMD8 not supported
+    SD_CARD_TYPE_SDSC_V2,   // Byte addressed
+    SD_CARD_TYPE_SDHC,      // Block addressed (SDHC and SDXC)
+} sd_card_type_t;
+
+// Geometry and registers read during sd_init_driver()
+typedef struct {
+    sd_card_type_t type;
+    bool block_addressing;
+    uint32_t ocr;
+    uint8_t csd[16];
+    uint32_t sectors;
+    uint32_t max_clock_hz;  // From CSD TRAN_SPEED
+    uint32_t erase_sectors; // Erase unit, 0 if the card lacks the erase class
+} sd_card_info_t;
+
+typedef enum {
+    SD_REQUEST_QUEUED = 0,
+    SD_REQUEST_ACTIVE,
+    SD_REQUEST_DONE,
+    SD_REQUEST_ERROR,
+    SD_REQUEST_CANCELLED,
+} sd_request_status_t;
+
+typedef struct sd_request sd_request_t;
+typedef void (*sd_request_callback_t)(sd_request_t* request);
+
+// Asynchronous transfer, owned by the caller. The descriptor and its buffer
+// must stay valid until status leaves QUEUED/ACTIVE. Requests run in
+// submission order, one at a time, advanced by sd_task().
+struct sd_request {
+    bool write;
+    void* buffer;
+    uint32_t sector;
+    uint32_t count;
+    sd_request_callback_t callback;     // Optional, called from sd_task()
+    void* context;
+    
+    // Driver owned
+    volatile sd_request_status_t status;
+    uint32_t completed;                 // Sectors transferred so far
+    bool cancel_requested;
+    sd_request_t* next;
+};
+
+// Latency histograms: bucket i counts operations that took [2^i, 2^(i+1))
+// microseconds; the last bucket is open-ended
+#define SD_STATS_BUCKETS 20
+
+typedef enum {
+    SD_OP_READ = 0,     // One sd_read_* call or read request
+    SD_OP_WRITE,        // One sd_write_* call or write request
+    SD_OP_ERASE,
+    SD_OP_SYNC,
+    SD_OP_COUNT,
+} sd_op_t;
+
+typedef struct {
+    uint32_t commands;          // Command frames sent, resends included
+    uint32_t sectors_read;
+    uint32_t sectors_written;
+    uint32_t retries;           // Commands and blocks resent after an error
+    uint32_t crc_errors;        // Command, read and write CRC failures
+    uint64_t token_wait_us;     // Waiting for read data (the 0xFE token in SPI mode)
+    uint64_t busy_wait_us;      // Waiting for the card to finish programming
+    uint32_t recoveries;        // Failed transfers that entered recovery
+    uint32_t recovered;         // ... and succeeded on a later rung
+    uint32_t media_errors;      // ... and failed every rung
+    uint32_t reinits;           // In-place re-identifications
+    uint64_t recovery_us;       // Time spent recovering
+    uint32_t latency[SD_OP_COUNT][SD_STATS_BUCKETS];
+} sd_stats_t;
 
 // Function prototypes
+void sd_bus_init(void);
 int sd_init_driver(void);
 int sd_read_sectors(void* buffer, uint32_t sector, uint32_t count);
+int sd_read_sectors_single(void* buffer, uint32_t sector, uint32_t count);
 int sd_write_sectors(const void* buffer, uint32_t sector, uint32_t count);
+int sd_write_sectors_single(const void* buffer, uint32_t sector, uint32_t count);
+
+// Discard: erase the whole erase units inside the range and leave partial
+// units at either end alone. Erased sectors read back as all zeros or all
+// ones. Like writes, the erase finishes in the background; sd_sync() waits.
+int sd_erase_sectors(uint32_t sector, uint32_t count);
 uint32_t sd_get_sectors_count(void);
+uint32_t sd_get_clock_hz(void);
+const char* sd_get_transport_name(void);
+const sd_card_info_t* sd_get_card_info(void);
+bool sd_is_busy(void);
+
+// Writes return once the card has accepted the data; programming finishes
+// in the background and the next command waits for it. sd_sync() is the
+// fence: it waits for any such write and returns -1 if one failed.
+int sd_sync(void);
+
+// Asynchronous API. sd_task() must be called from the main loop; each call
+// does a bounded slice of work and never waits for the card. Cancelling an
+// active request stops it at the next block boundary. The blocking calls
+// above wait for the active request to finish before touching the card.
+int sd_submit(sd_request_t* request);
+void sd_task(void);
+bool sd_request_pending(const sd_request_t* request);
+void sd_cancel(sd_request_t* request);
+
+// Driver counters, cleared by sd_reset_stats()
+void sd_get_stats(sd_stats_t* stats);
+void sd_reset_stats(void);
+void sd_print_stats(void);
 
 #endif // SD_CARD_H
@@ -0,0 +1,389 @@
+#include "sd_common.h"
+#include "log.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+// CRC7 over a command frame (polynomial x^7 + x^3 + 1)
+uint8_t sd_crc7(const uint8_t* data, size_t len) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t byte = data[i];
+        for (int bit = 0; bit < 8; bit++) {
+            crc <<= 1;
+            if ((byte ^ crc) & 0x80) crc ^= 0x09;
+            byte <<= 1;
+        }
+    }
+    return crc & 0x7F;
+}
+
+// Extract CSD bits msb..lsb (register bit 127 is csd[0] bit 7)
+static uint32_t sd_csd_bits(const uint8_t* csd, int msb, int lsb) {
+    uint32_t value = 0;
+    for (int bit = msb; bit >= lsb; bit--) {
+        int byte = 15 - bit / 8;
+        value = (value << 1) | ((csd[byte] >> (bit % 8)) & 1);
+    }
+    return value;
+}
+
+int sd_parse_csd(const uint8_t* csd, sd_card_info_t* info) {
+    uint32_t structure = sd_csd_bits(csd, 127, 126);
+    
+    if (structure == 0) {
+        // CSD v1 (SDSC): capacity = (C_SIZE+1) * 2^(C_SIZE_MULT+2) * 2^READ_BL_LEN
+        uint32_t c_size = sd_csd_bits(csd, 73, 62);
+        uint32_t c_size_mult = sd_csd_bits(csd, 49, 47);
+        uint32_t read_bl_len = sd_csd_bits(csd, 83, 80);
+        uint32_t blocks = (c_size + 1) << (c_size_mult + 2);
+        info->sectors = blocks << (read_bl_len - 9);
+    } else if (structure == 1) {
+        // CSD v2 (SDHC/SDXC): capacity = (C_SIZE+1) * 512 KiB
+        uint32_t c_size = sd_csd_bits(csd, 69, 48);
+        info->sectors = (c_size + 1) * 1024;
+    } else {
+        LOG_ERROR("Unsupported CSD structure %lu\n", (unsigned long)structure);
+        return -1;
+    }
+    
+    // TRAN_SPEED: rate unit in bits 2:0, multiplier (x10) in bits 6:3
+    static const uint32_t units[] = { 100000, 1000000, 10000000, 100000000 };
+    static const uint8_t mult_x10[] = { 0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80 };
+    uint8_t tran_speed = csd[3];
+    uint32_t unit = tran_speed & 0x07;
+    info->max_clock_hz = (unit < 4) ? units[unit] / 10 * mult_x10[(tran_speed >> 3) & 0x0F] : 0;
+    if (info->max_clock_hz == 0) info->max_clock_hz = 25000000;
+    
+    // CCC class 5 is erase. SDSC cards without ERASE_BLK_EN erase in
+    // groups of SECTOR_SIZE + 1 write blocks of 2^WRITE_BL_LEN bytes (1 and
+    // 2 KiB on 2 and 4 GB cards); CSD v2 always allows single blocks. A
+    // unit that is too small would make the card widen the erase past the
+    // range asked for, so an unexpected block length turns discard off.
+    if (!(sd_csd_bits(csd, 95, 84) & (1u << 5))) {
+        info->erase_sectors = 0;
+    } else if (structure == 0 && !sd_csd_bits(csd, 46, 46)) {
+        uint32_t write_bl_len = sd_csd_bits(csd, 25, 22);
+        if (write_bl_len < 9 || write_bl_len > 11) {
+            LOG_WARN("WRITE_BL_LEN %lu not supported, erase disabled\n", (unsigned long)write_bl_len);
+            info->erase_sectors = 0;
+        } else {
+            info->erase_sectors = (sd_csd_bits(csd, 45, 39) + 1) << (write_bl_len - 9);
+        }
+    } else {
+        info->erase_sectors = 1;
+    }
+    
+    return 0;
+}
+
+bool sd_erase_clip(const sd_card_info_t* info, uint32_t* sector, uint32_t* count) {
+    uint32_t unit = info->erase_sectors;
+    if (unit == 0 || *count == 0 || *sector >= info->sectors) return false;
+    
+    uint32_t end = *sector + *count;
+    if (end > info->sectors || end < *sector) end = info->sectors;
+    
+    // Card ignores address bits below the erase unit, so round inwards
+    uint32_t first = (*sector + unit - 1) / unit * unit;
+    uint32_t last = end / unit * unit;
+    if (first >= last) return false;
+    
+    *sector = first;
+    *count = last - first;
+    return true;
+}
+
+uint8_t sd_sdio_resp_length(int resp_bits) {
+    return resp_bits > 0 ? (uint8_t)(resp_bits - 1) : 0;
+}
+
+int sd_sdio_resp_words(int resp_bits) {
+    return resp_bits / 32 + 1;  // The closing push always adds a word
+}
+
+void sd_sdio_unpack_response(const uint32_t* words, int resp_bits, uint8_t* out) {
+    int full_words = resp_bits / 32;
+    memset(out, 0, (resp_bits + 8) / 8);
+    for (int k = 0; k < resp_bits; k++) {
+        int w = k / 32;
+        int width = (w < full_words) ? 32 : resp_bits % 32;
+        int pos = width - 1 - (k % 32);
+        if ((words[w] >> pos) & 1) {
+            out[(k + 1) / 8] |= 0x80 >> ((k + 1) % 8);
+        }
+    }
+}
+
+void sd_stats_record(sd_stats_t* stats, sd_op_t op, uint32_t start_us) {
+    uint32_t elapsed = time_us_32() - start_us;
+    int bucket = elapsed ? 31 - __builtin_clz(elapsed) : 0;
+    if (bucket >= SD_STATS_BUCKETS) bucket = SD_STATS_BUCKETS - 1;
+    stats->latency[op][bucket]++;
+}
+
+// One line per counter group, then "<lower bound in us>:<count>" pairs for
+// each non-empty histogram bucket, so the output is easy to parse
+void sd_print_stats(void) {
+    static const char* const op_names[SD_OP_COUNT] = { "read", "write", "erase", "sync" };
+    sd_stats_t stats;
+    sd_get_stats(&stats);
+    
+    printf("SD stats: %lu commands, %lu sectors read, %lu written, %lu retries, %lu CRC errors\n",
+           (unsigned long)stats.commands, (unsigned long)stats.sectors_read,
+           (unsigned long)stats.sectors_written, (unsigned long)stats.retries,
+           (unsigned long)stats.crc_errors);
+    printf("SD waits: token %llu us, busy %llu us\n",
+           (unsigned long long)stats.token_wait_us, (unsigned long long)stats.busy_wait_us);
+    printf("SD recovery: %lu entered, %lu recovered, %lu media errors, %lu re-inits, %llu us\n",
+           (unsigned long)stats.recoveries, (unsigned long)stats.recovered,
+           (unsigned long)stats.media_errors, (unsigned long)stats.reinits,
+           (unsigned long long)stats.recovery_us);
+    
+    for (int op = 0; op < SD_OP_COUNT; op++) {
+        printf("SD %s latency (us):", op_names[op]);
+        for (int i = 0; i < SD_STATS_BUCKETS; i++) {
+            if (stats.latency[op][i]) {
+                printf(" %lu:%lu", i ? 1ul << i : 0ul, (unsigned long)stats.latency[op][i]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+void sd_request_enqueue(sd_request_t** head, sd_request_t* request) {
+    request->next = NULL;
+    while (*head) {
+        head = &(*head)->next;
+    }
+    *head = request;
+}
+
+sd_request_t* sd_request_dequeue(sd_request_t** head) {
+    sd_request_t* request = *head;
+    if (request) {
+        *head = request->next;
+        request->next = NULL;
+    }
+    return request;
+}
+
+bool sd_request_unlink(sd_request_t** head, sd_request_t* request) {
+    while (*head) {
+        if (*head == request) {
+            *head = request->next;
+            request->next = NULL;
+            return true;
+        }
+        head = &(*head)->next;
+    }
+    return false;
+}
+
+void sd_request_complete(sd_request_t* request, sd_request_status_t status) {
+    request->status = status;
+    if (request->callback) {
+        request->callback(request);
+    }
+}
+
+//--------------------------------------------------------------------+
+// Recovery, erase and write-behind
+//--------------------------------------------------------------------+
+
+void sd_pause_ms(uint32_t ms) {
+    absolute_time_t deadline = make_timeout_time_ms(ms);
+    while (!time_reached(deadline)) {
+        tight_loop_contents();
+    }
+}
+
+void sd_defer_busy(sd_driver_t* drv, uint32_t timeout_ms) {
+    drv->write_pending = true;
+    drv->write_deadline = make_timeout_time_ms(timeout_ms);
+    drv->status_unchecked = true;
+}
+
+// Reset and re-identify the card in place, then go back to the clock that
+// was working before the failure. A different card (CSD changed) is not
+// taken over: the driver stops until sd_init_driver() is called again.
+static int sd_reinit(sd_driver_t* drv, int clock_step) {
+    sd_card_info_t previous = drv->info;
+    
+    drv->stats.reinits++;
+    drv->ops->abort();
+    
+    // Programming of an earlier write is lost with the reset
+    if (drv->write_pending) drv->write_failed = true;
+    drv->write_pending = false;
+    
+    if (drv->ops->identify() != 0) {
+        drv->info = previous;
+        return -1;
+    }
+    
+    if (memcmp(previous.csd, drv->info.csd, sizeof(previous.csd)) != 0) {
+        LOG_ERROR("SD card replaced, re-initialization required\n");
+        drv->initialized = false;
+        return -1;
+    }
+    
+    if (clock_step >= 0) drv->ops->clock_apply(clock_step);
+    return 0;
+}
+
+// Bounded recovery for a failed transfer: retries with backoff, then a
+// re-identification at the last good clock, then one clock step down.
+// Every rung is limited by the driver timeouts; sd_is_busy() tells the
+// block layer's background work to keep off the card meanwhile.
+static int sd_recover(sd_driver_t* drv, const sd_transfer_t* t) {
+    uint32_t start = time_us_32();
+    int clock_step = drv->clock_step;
+    int result = -1;
+    
+    drv->recovering = true;
+    drv->stats.recoveries++;
+    
+    for (int i = 0; i < SD_RECOVERY_RETRIES && result != 0; i++) {
+        sd_pause_ms(SD_RECOVERY_BACKOFF_MS << i);
+        result = drv->ops->transfer(t);
+    }
+    
+    if (result != 0 && sd_reinit(drv, clock_step) == 0) {
+        result = drv->ops->transfer(t);
+    }
+    
+    if (result != 0 && drv->initialized) {
+        int before = drv->clock_step;
+        drv->ops->clock_downshift();
+        if (drv->clock_step != before) result = drv->ops->transfer(t);
+    }
+    
+    drv->recovering = false;
+    drv->stats.recovery_us += time_us_32() - start;
+    
+    if (result == 0) {
+        drv->stats.recovered++;
+        LOG_WARN("SD transfer %lu+%lu recovered\n", t->sector, t->count);
+    } else {
+        drv->stats.media_errors++;
+        LOG_ERROR("SD media error at %lu+%lu\n", t->sector, t->count);
+    }
+    return result;
+}
+
+int sd_driver_transfer(sd_driver_t* drv, sd_op_t op, bool single, void* buffer,
+                       uint32_t sector, uint32_t count) {
+    sd_transfer_t t = { op, single, buffer, sector, count };
+    uint32_t start = time_us_32();
+    
+    int result = drv->ops->transfer(&t);
+    if (result != 0 && drv->initialized && !drv->recovering) {
+        result = sd_recover(drv, &t);
+    }
+    
+    sd_stats_record(&drv->stats, op, start);
+    return result;
+}
+
+int sd_driver_erase(sd_driver_t* drv, uint32_t sector, uint32_t count) {
+    if (!drv->initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    if (!sd_erase_clip(&drv->info, &sector, &count)) return 0;
+    
+    uint32_t start = time_us_32();
+    int result = 0;
+    
+    while (count > 0) {
+        uint32_t run = count;
+        if (run > SD_ERASE_MAX_SECTORS) {
+            run = SD_ERASE_MAX_SECTORS - SD_ERASE_MAX_SECTORS % drv->info.erase_sectors;
+        }
+        
+        if (drv->ops->erase(sector, sector + run - 1) != 0) {
+            LOG_ERROR("Erase of %lu+%lu failed\n", (unsigned long)sector, (unsigned long)run);
+            result = -1;
+            break;
+        }
+        
+        // R1b: the card stays busy while erasing, much longer than a write
+        sd_defer_busy(drv, SD_ERASE_TIMEOUT_MS);
+        
+        sector += run;
+        count -= run;
+    }
+    
+    sd_stats_record(&drv->stats, SD_OP_ERASE, start);
+    return result;
+}
+
+// Fence for write-behind: returns once the card has finished programming
+// every accepted write. Reports -1 if one of them failed since the last
+// call (busy timeout or a write error flagged in the card status).
+int sd_driver_sync(sd_driver_t* drv) {
+    if (!drv->initialized) return -1;
+    
+    uint32_t start = time_us_32();
+    
+    // Kept until CMD13 succeeds, so a status that could not be read is
+    // asked for again by the next sync
+    if (drv->status_unchecked) {
+        if (drv->ops->check_status() == 0) {
+            drv->status_unchecked = false;
+        } else {
+            drv->write_failed = true;
+        }
+    }
+    
+    sd_stats_record(&drv->stats, SD_OP_SYNC, start);
+    
+    int result = drv->write_failed ? -1 : 0;
+    drv->write_failed = false;
+    return result;
+}
+
+// Whether the card answers at the current clock as it did at the
+// identification clock: sector 0 against reference, or without one the
+// CSD against the copy from identification plus a clean CMD13
+static bool sd_clock_probe(sd_driver_t* drv, const uint8_t* reference) {
+    static uint8_t probe[512];
+    
+    if (reference) {
+        // Raw read: a failing probe is expected here, not a reason to recover
+        sd_transfer_t t = { SD_OP_READ, true, probe, 0, 1 };
+        return drv->ops->transfer(&t) == 0 && memcmp(reference, probe, sizeof(probe)) == 0;
+    }
+    return drv->ops->read_csd(probe) == 0 &&
+           memcmp(drv->info.csd, probe, sizeof(drv->info.csd)) == 0 &&
+           drv->ops->check_status() == 0;
+}
+
+// Sector 0 is the better probe, since it runs through the data path. A
+// card that cannot read it even at the identification clock would stay
+// there for good, so after a few tries the registers stand in.
+void sd_driver_clock_ramp(sd_driver_t* drv) {
+    static uint8_t reference[512];
+    const uint8_t* probe_reference = NULL;
+    sd_transfer_t t = { SD_OP_READ, true, reference, 0, 1 };
+    
+    for (int i = 0; i < SD_CLOCK_RAMP_TRIES && !probe_reference; i++) {
+        if (drv->ops->transfer(&t) == 0) probe_reference = reference;
+    }
+    if (!probe_reference) {
+        LOG_WARN("SD clock ramp: sector 0 unreadable, probing with CSD and status\n");
+    }
+    
+    for (int step = 0; step < drv->ops->clock_step_count; step++) {
+        if (drv->ops->clock_steps[step] > SD_MAX_CLOCK_HZ) continue;
+        if (drv->ops->clock_steps[step] > drv->info.max_clock_hz) continue;
+        
+        drv->ops->clock_apply(step);
+        if (sd_clock_probe(drv, probe_reference)) return;
+    }
+    
+    LOG_WARN("SD clock ramp failed, staying at identification clock\n");
+    drv->ops->clock_apply(-1);
+}
@@ -0,0 +1,116 @@
+#ifndef SD_COMMON_H
+#define SD_COMMON_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sd_card.h"
+#include "pico/stdlib.h"
+
+// Protocol helpers shared by the SPI-mode (sd_card.c) and SD-mode
+// (sd_sdio.c) drivers
+
+uint8_t sd_crc7(const uint8_t* data, size_t len);
+
+// Fill sectors and max_clock_hz from a raw 16-byte CSD (v1 or v2 layout)
+int sd_parse_csd(const uint8_t* csd, sd_card_info_t* info);
+
+// Shrink an erase range to whole erase units; false if none is left
+bool sd_erase_clip(const sd_card_info_t* info, uint32_t* sector, uint32_t* count);
+
+// SD-mode command machine (sd_sdio.pio). It takes a length byte per
+// command and samples length + 1 response bits after the start bit, 0
+// meaning no response. The bits come back left-shifted in 32-bit words,
+// the last one partial and right-aligned. resp_bits counts the bits after
+// the start bit (47 for R1, 135 for R2).
+uint8_t sd_sdio_resp_length(int resp_bits);
+int sd_sdio_resp_words(int resp_bits);
+
+// Unpack those words into response bytes, start bit (0) first
+void sd_sdio_unpack_response(const uint32_t* words, int resp_bits, uint8_t* out);
+
+// Add one operation that started at start_us to its latency histogram
+void sd_stats_record(sd_stats_t* stats, sd_op_t op, uint32_t start_us);
+
+// Request queue for the asynchronous API, in submission order
+void sd_request_enqueue(sd_request_t** head, sd_request_t* request);
+sd_request_t* sd_request_dequeue(sd_request_t** head);
+bool sd_request_unlink(sd_request_t** head, sd_request_t* request);
+
+// Set a request's final status and run its callback
+void sd_request_complete(sd_request_t* request, sd_request_status_t status);
+
+// A blocking transfer, as retried by the recovery ladder
+typedef struct {
+    sd_op_t op;             // SD_OP_READ or SD_OP_WRITE
+    bool single;            // CMD17/CMD24 per sector
+    void* buffer;
+    uint32_t sector;
+    uint32_t count;
+} sd_transfer_t;
+
+// Transport side of the recovery, erase and sync code below. Each driver
+// fills in one of these; everything else stays private to the driver.
+typedef struct {
+    // One attempt at a transfer, with the driver's own CRC retries
+    int (*transfer)(const sd_transfer_t* t);
+    // CMD32/CMD33/CMD38 over first..last; the erase is left running
+    int (*erase)(uint32_t first, uint32_t last);
+    // End a multi-block transfer the card may still be in; best effort
+    void (*abort)(void);
+    // Identify the card again, filling in info
+    int (*identify)(void);
+    // Wait out a deferred write, then CMD13; -1 if either failed
+    int (*check_status)(void);
+    // CMD9 into csd (16 bytes)
+    int (*read_csd)(uint8_t* csd);
+    void (*clock_apply)(int step);
+    void (*clock_downshift)(void);
+    
+    // Bus clock steps tried after identification, fastest first
+    const uint32_t* clock_steps;
+    int clock_step_count;
+} sd_driver_ops_t;
+
+// Driver state shared with the code below
+typedef struct {
+    const sd_driver_ops_t* ops;
+    sd_card_info_t info;
+    sd_stats_t stats;
+    bool initialized;
+    bool recovering;
+    int clock_step;         // -1 = still at SD_INIT_CLOCK_HZ
+    
+    // Write-behind: the last accepted write or erase may still be
+    // programming. The busy wait happens before the next command (or in
+    // sd_sync()) instead of at the end of the write.
+    bool write_pending;
+    bool write_failed;
+    absolute_time_t write_deadline;
+    
+    // A write or erase was accepted since the last good CMD13. A program
+    // failure only shows in the card status after busy ends, and by then
+    // the next command may already have waited write_pending out.
+    bool status_unchecked;
+} sd_driver_t;
+
+// Plain delay; core1 owns the card and has nothing else to run meanwhile
+void sd_pause_ms(uint32_t ms);
+
+// Leave the card programming for up to timeout_ms. Every accepted write
+// and erase ends here, so sd_sync() knows to check the card status.
+void sd_defer_busy(sd_driver_t* drv, uint32_t timeout_ms);
+
+// Blocking transfer with bounded recovery, timed for the latency histograms
+int sd_driver_transfer(sd_driver_t* drv, sd_op_t op, bool single, void* buffer,
+                       uint32_t sector, uint32_t count);
+
+// sd_erase_sectors(): whole erase units, SD_ERASE_MAX_SECTORS per command
+int sd_driver_erase(sd_driver_t* drv, uint32_t sector, uint32_t count);
+
+// sd_sync(): wait for write-behind, then report and clear a failure
+int sd_driver_sync(sd_driver_t* drv);
+
+// Move from the identification clock to the fastest step that works
+void sd_driver_clock_ramp(sd_driver_t* drv);
+
+#endif // SD_COMMON_H
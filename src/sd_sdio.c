@@ -0,0 +1,996 @@
+#include "sd_card.h"
+#include "sd_common.h"
+#include "log.h"
+#include "hardware/pio.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#include "pico/stdlib.h"
+#include "sd_sdio.pio.h"
+#include <string.h>
+#include <stdio.h>
+
+// SD-mode driver: CLK + CMD + DAT0-3 driven by PIO. Implements the same
+// public API as the SPI-mode driver in sd_card.c; only one of the two is
+// built, selected by SD_BUS in CMakeLists.txt.
+
+// SD-mode commands not used in SPI mode
+#define SD_CMD2     2   // ALL_SEND_CID
+#define SD_CMD3     3   // SEND_RELATIVE_ADDR
+#define SD_CMD7     7   // SELECT_CARD
+#define SD_ACMD6    6   // SET_BUS_WIDTH
+
+// Response lengths in bits after the start bit; see sd_sdio_resp_length()
+#define SD_RESP_NONE    0
+#define SD_RESP_48      47
+#define SD_RESP_136     135
+
+// Card status bits that mean the previous command failed
+#define SD_STATUS_ERROR_MASK    0xFDF90008u
+
+// One block on the wire: 512 data bytes + 8 bytes of CRC16 (one per line)
+#define SD_BLOCK_WORDS          128
+#define SD_BLOCK_NIBBLES        ((512 + 8) * 2)
+
+// Blocks moved per CMD18/CMD25 before the DMA chain is re-armed
+#define SD_SDIO_MAX_RUN         32
+
+// Result of a single data block transfer
+#define SD_BLOCK_OK      0
+#define SD_BLOCK_ERROR  -1  // Response, status or busy timeout
+#define SD_BLOCK_CRC    -2  // CRC16 mismatch on either side; worth retrying
+
+static const sd_driver_ops_t sd_ops;
+static sd_driver_t sd = { .ops = &sd_ops, .clock_step = -1 };
+static volatile bool sd_bus_busy = false;
+static uint32_t sd_rca = 0;
+
+// Asynchronous requests waiting for sd_task()
+static sd_request_t* sd_queue = NULL;
+
+// Command SM and receive SM on one PIO, transmit SM on the other so all
+// three programs fit
+static PIO sd_pio_cmd = pio0;
+static PIO sd_pio_tx = pio1;
+static uint sd_sm_cmd, sd_sm_rx, sd_sm_tx;
+static uint sd_offset_cmd, sd_offset_rx, sd_offset_tx;
+
+// Data channel plus a control channel that feeds it from a block list
+static int sd_dma_data = -1;
+static int sd_dma_ctrl = -1;
+
+// DMA control blocks: {address, count} for RX, {count, address} for TX,
+// terminated by a zero pair
+static uint32_t sd_dma_chain[(SD_SDIO_MAX_RUN * 2 + 1) * 2];
+static uint32_t sd_block_crc[SD_SDIO_MAX_RUN * 2];
+
+// Bus clock steps tried after identification, fastest first. Default
+// speed mode tops out at 25 MHz; the rate actually produced by the
+// divider is kept in sd_clock_hz.
+static const uint32_t sd_clock_steps[] = { 25000000, 12500000, 6250000 };
+#define SD_CLOCK_STEP_COUNT ((int)(sizeof(sd_clock_steps) / sizeof(sd_clock_steps[0])))
+
+static uint32_t sd_clock_hz = SD_INIT_CLOCK_HZ;
+
+static void sd_clock_apply(int step);
+static void sd_clock_downshift(void);
+static void sd_settle_write(void);
+
+// Whether a CRC failure gets another attempt; counted in the stats
+static bool sd_should_retry(int result, int* retries) {
+    if (result != SD_BLOCK_CRC || ++*retries > SD_CRC_RETRIES) return false;
+    sd.stats.retries++;
+    return true;
+}
+
+//--------------------------------------------------------------------+
+// CRC16 over four DAT lines
+//--------------------------------------------------------------------+
+
+// Each line carries its own CRC16, so the DMA sniffer (which sees one
+// serial stream) cannot check a 4-bit block. The four CRCs are kept
+// interleaved instead: nibble k of the 64-bit state holds bit k of each
+// line's CRC, just as each nibble of the data holds one clock of the four
+// lines. Stepping a CRC16 (x^16 + x^12 + x^5 + 1) by up to four bits is
+//   f = top bits ^ input bits;  crc = (crc << n) ^ (f << 12) ^ (f << 5) ^ f
+// since a feedback bit added at bit 12 needs four shifts to reach bit 15.
+// Spread over nibbles, four clocks are 16 bits and every shift is four
+// times as wide. The result is the 16 CRC nibbles in wire order.
+static uint64_t sd_crc16_4bit(const uint32_t* data, uint32_t words) {
+    uint64_t lanes = 0;
+    for (uint32_t i = 0; i < words; i++) {
+        uint32_t clocks = __builtin_bswap32(data[i]);     // First clock on top
+        for (int shift = 16; shift >= 0; shift -= 16) {
+            uint64_t feedback = (lanes >> 48) ^ ((clocks >> shift) & 0xFFFF);
+            lanes = (lanes << 16) ^ (feedback << 48) ^ (feedback << 20) ^ feedback;
+        }
+    }
+    return lanes;
+}
+
+//--------------------------------------------------------------------+
+// Command line
+//--------------------------------------------------------------------+
+
+// Abandon a command whose response never came and park the SM on its
+// idle loop with CMD released
+static void sd_cmd_reset(void) {
+    pio_sm_set_enabled(sd_pio_cmd, sd_sm_cmd, false);
+    pio_sm_clear_fifos(sd_pio_cmd, sd_sm_cmd);
+    pio_sm_restart(sd_pio_cmd, sd_sm_cmd);
+    pio_sm_exec(sd_pio_cmd, sd_sm_cmd, pio_encode_set(pio_pindirs, 0));
+    pio_sm_exec(sd_pio_cmd, sd_sm_cmd, pio_encode_jmp(sd_offset_cmd + sd_sdio_cmd_offset_wait_cmd));
+    pio_sm_set_enabled(sd_pio_cmd, sd_sm_cmd, true);
+}
+
+// Send a command and collect its response. resp must hold 6 bytes for a
+// 48-bit response or 17 for R2. Returns -1 on timeout or a bad response
+// CRC; R3 (ACMD41) carries no CRC and is not checked.
+static int sd_send_command(uint8_t cmd, uint32_t arg, int resp_bits, uint8_t* resp) {
+    uint8_t frame[6] = {
+        0x40 | cmd,
+        (arg >> 24) & 0xFF,
+        (arg >> 16) & 0xFF,
+        (arg >> 8) & 0xFF,
+        arg & 0xFF,
+        0
+    };
+    frame[5] = (sd_crc7(frame, 5) << 1) | 0x01;
+    
+    if (sd.write_pending) sd_settle_write();
+    
+    for (int attempt = 0; attempt <= SD_CRC_RETRIES; attempt++) {
+        sd.stats.commands++;
+        if (attempt > 0) sd.stats.retries++;
+        
+        pio_sm_put(sd_pio_cmd, sd_sm_cmd, (47u << 24) | ((uint32_t)frame[0] << 16) |
+                                          ((uint32_t)frame[1] << 8) | frame[2]);
+        pio_sm_put(sd_pio_cmd, sd_sm_cmd, ((uint32_t)frame[3] << 24) | ((uint32_t)frame[4] << 16) |
+                                          ((uint32_t)frame[5] << 8) | sd_sdio_resp_length(resp_bits));
+    
+        uint32_t words[5];
+        int word_count = sd_sdio_resp_words(resp_bits);
+        absolute_time_t deadline = make_timeout_time_ms(10);
+        bool timed_out = false;
+        for (int i = 0; i < word_count; i++) {
+            while (pio_sm_is_rx_fifo_empty(sd_pio_cmd, sd_sm_cmd)) {
+                if (time_reached(deadline)) {
+                    timed_out = true;
+                    break;
+                }
+            }
+            if (timed_out) break;
+            words[i] = pio_sm_get(sd_pio_cmd, sd_sm_cmd);
+        }
+    
+        if (timed_out) {
+            sd_cmd_reset();
+            return -1;
+        }
+    
+        if (resp_bits == SD_RESP_NONE) return 0;
+    
+        sd_sdio_unpack_response(words, resp_bits, resp);
+    
+        if (cmd == SD_CMD41) return 0;
+    
+        // R2 covers the register only, from the byte after the header
+        bool crc_ok = (resp_bits == SD_RESP_136)
+            ? (sd_crc7(resp + 1, 15) == (resp[16] >> 1))
+            : (sd_crc7(resp, 5) == (resp[5] >> 1));
+        if (crc_ok) return 0;
+    
+        LOG_WARN("CMD%d response CRC error\n", cmd);
+        sd.stats.crc_errors++;
+    }
+    
+    return -1;
+}
+
+// Card status word from a 48-bit R1 response
+static uint32_t sd_r1_status(const uint8_t* resp) {
+    return ((uint32_t)resp[1] << 24) | ((uint32_t)resp[2] << 16) |
+           ((uint32_t)resp[3] << 8) | resp[4];
+}
+
+// Send an R1 command and check the returned card status
+static int sd_command_r1(uint8_t cmd, uint32_t arg) {
+    uint8_t resp[6];
+    if (sd_send_command(cmd, arg, SD_RESP_48, resp) != 0) {
+        LOG_ERROR("CMD%d no response\n", cmd);
+        return -1;
+    }
+    uint32_t status = sd_r1_status(resp);
+    if (status & SD_STATUS_ERROR_MASK) {
+        LOG_ERROR("CMD%d status error: 0x%08lX\n", cmd, (unsigned long)status);
+        return -1;
+    }
+    return 0;
+}
+
+static int sd_app_command_r1(uint8_t cmd, uint32_t arg) {
+    if (sd_command_r1(SD_CMD55, sd_rca << 16) != 0) return -1;
+    return sd_command_r1(cmd, arg);
+}
+
+// Wait for the card to release DAT0 after an R1b response or a write
+static int sd_wait_not_busy(void) {
+    uint32_t wait_start = time_us_32();
+    absolute_time_t deadline = make_timeout_time_ms(SD_WRITE_TIMEOUT_MS);
+    int result = 0;
+    while (!gpio_get(SD_PIN_D0)) {
+        if (time_reached(deadline)) {
+            result = -1;
+            break;
+        }
+        tight_loop_contents();
+    }
+    sd.stats.busy_wait_us += time_us_32() - wait_start;
+    return result;
+}
+
+static void sd_settle_write(void) {
+    uint32_t wait_start = time_us_32();
+    sd.write_pending = false;
+    while (!gpio_get(SD_PIN_D0)) {
+        if (time_reached(sd.write_deadline)) {
+            LOG_ERROR("Deferred write busy timeout\n");
+            sd.write_failed = true;
+            break;
+        }
+        tight_loop_contents();
+    }
+    sd.stats.busy_wait_us += time_us_32() - wait_start;
+}
+
+//--------------------------------------------------------------------+
+// Data lines
+//--------------------------------------------------------------------+
+
+static void sd_data_sm_reset(PIO pio, uint sm, uint entry) {
+    pio_sm_set_enabled(pio, sm, false);
+    pio_sm_clear_fifos(pio, sm);
+    pio_sm_restart(pio, sm);
+    pio_sm_exec(pio, sm, pio_encode_jmp(entry));
+}
+
+// Start the control channel on a chain built in sd_dma_chain. Each control
+// block is two words written into the data channel's alias registers; the
+// last of them retriggers the data channel, which chains back here.
+static void sd_dma_start(bool rx, uint32_t* chain) {
+    io_rw_32* target = rx ? &dma_hw->ch[sd_dma_data].al1_write_addr
+                          : &dma_hw->ch[sd_dma_data].al3_transfer_count;
+    
+    dma_channel_config c = dma_channel_get_default_config(sd_dma_ctrl);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, 3);   // Wrap the write over two registers
+    dma_channel_configure(sd_dma_ctrl, &c, target, chain, 2, false);
+    
+    c = dma_channel_get_default_config(sd_dma_data);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_bswap(&c, true);     // PIO shifts MSB first
+    channel_config_set_chain_to(&c, sd_dma_ctrl);
+    if (rx) {
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, true);
+        channel_config_set_dreq(&c, pio_get_dreq(sd_pio_cmd, sd_sm_rx, false));
+        dma_channel_configure(sd_dma_data, &c, NULL, &sd_pio_cmd->rxf[sd_sm_rx], 0, false);
+    } else {
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_dreq(&c, pio_get_dreq(sd_pio_tx, sd_sm_tx, true));
+        dma_channel_configure(sd_dma_data, &c, &sd_pio_tx->txf[sd_sm_tx], NULL, 0, false);
+    }
+    
+    dma_channel_start(sd_dma_ctrl);
+}
+
+static void sd_dma_stop(void) {
+    dma_channel_abort(sd_dma_ctrl);
+    dma_channel_abort(sd_dma_data);
+}
+
+static bool sd_dma_busy(void) {
+    return dma_channel_is_busy(sd_dma_ctrl) || dma_channel_is_busy(sd_dma_data);
+}
+
+// Check one received block against the CRC words captured after it
+static bool sd_rx_block_crc_ok(const uint8_t* buf, uint32_t block) {
+    uint64_t crc = sd_crc16_4bit((const uint32_t*)(buf + block * 512), SD_BLOCK_WORDS);
+    uint64_t card_crc = ((uint64_t)__builtin_bswap32(sd_block_crc[block * 2]) << 32) |
+                        __builtin_bswap32(sd_block_crc[block * 2 + 1]);
+    if (crc != card_crc) {
+        LOG_WARN("Read CRC mismatch in block %lu\n", (unsigned long)block);
+        sd.stats.crc_errors++;
+        return false;
+    }
+    return true;
+}
+
+// Read count (<= SD_SDIO_MAX_RUN) consecutive blocks with CMD17 or CMD18.
+// CRCs are checked block by block while the rest are still arriving.
+static int sd_read_run(uint8_t* buf, uint32_t address, uint32_t count, bool multi) {
+    uint32_t* p = sd_dma_chain;
+    for (uint32_t i = 0; i < count; i++) {
+        *p++ = (uint32_t)(uintptr_t)(buf + i * 512);
+        *p++ = SD_BLOCK_WORDS;
+        *p++ = (uint32_t)(uintptr_t)&sd_block_crc[i * 2];
+        *p++ = 2;
+    }
+    *p++ = 0;
+    *p++ = 0;
+    
+    sd_data_sm_reset(sd_pio_cmd, sd_sm_rx, sd_offset_rx);
+    sd_dma_start(true, sd_dma_chain);
+    pio_sm_set_enabled(sd_pio_cmd, sd_sm_rx, true);
+    
+    int result = SD_BLOCK_OK;
+    if (sd_command_r1(multi ? SD_CMD18 : SD_CMD17, address) != 0) {
+        result = SD_BLOCK_ERROR;
+    }
+    
+    // The control channel's read pointer says which control block is
+    // running; every block before the current one has fully landed.
+    // There is no start token in SD mode, so the stats count the wait
+    // until the first block is in.
+    uint32_t checked = 0;
+    uint32_t wait_start = time_us_32();
+    absolute_time_t deadline = make_timeout_time_ms(SD_READ_TIMEOUT_MS);
+    while (result == SD_BLOCK_OK && sd_dma_busy()) {
+        uint32_t fetched = (dma_hw->ch[sd_dma_ctrl].read_addr - (uint32_t)(uintptr_t)sd_dma_chain) / 8;
+        if (fetched >= 2 * checked + 3) {
+            if (checked == 0) sd.stats.token_wait_us += time_us_32() - wait_start;
+            if (!sd_rx_block_crc_ok(buf, checked)) result = SD_BLOCK_CRC;
+            checked++;
+            deadline = make_timeout_time_ms(SD_READ_TIMEOUT_MS);
+        } else if (time_reached(deadline)) {
+            LOG_ERROR("Read data timeout\n");
+            result = SD_BLOCK_ERROR;
+        } else {
+            tight_loop_contents();
+        }
+    }
+    
+    sd_dma_stop();
+    pio_sm_set_enabled(sd_pio_cmd, sd_sm_rx, false);
+    
+    while (result == SD_BLOCK_OK && checked < count) {
+        if (!sd_rx_block_crc_ok(buf, checked)) result = SD_BLOCK_CRC;
+        checked++;
+    }
+    
+    // The card streams CMD18 data until told to stop
+    if (multi) {
+        if (sd_command_r1(SD_CMD12, 0) != 0 || sd_wait_not_busy() != 0) {
+            LOG_ERROR("CMD12 failed\n");
+            result = SD_BLOCK_ERROR;
+        }
+    }
+    
+    if (result == SD_BLOCK_OK) sd.stats.sectors_read += count;
+    if (result == SD_BLOCK_CRC) sd_clock_downshift();
+    return result;
+}
+
+static void sd_tx_crc(const uint8_t* buf, uint32_t* crc);
+
+// Send one block and wait for the CRC status token and the busy period.
+// The CRC words for the block are prepared by the caller; when next is
+// given, its CRC is computed into next_crc while this block is on the wire.
+// With defer_busy an accepted block returns without waiting for busy.
+static int sd_write_block(const uint8_t* buf, const uint32_t* crc,
+                          const uint8_t* next, uint32_t* next_crc, bool defer_busy) {
+    uint32_t chain[6] = {
+        SD_BLOCK_WORDS, (uint32_t)(uintptr_t)buf,
+        2, (uint32_t)(uintptr_t)crc,
+        0, 0
+    };
+    
+    sd_data_sm_reset(sd_pio_tx, sd_sm_tx, sd_offset_tx);
+    sd_dma_start(false, chain);
+    pio_sm_set_enabled(sd_pio_tx, sd_sm_tx, true);
+    
+    if (next) sd_tx_crc(next, next_crc);
+    
+    absolute_time_t deadline = make_timeout_time_ms(SD_WRITE_TIMEOUT_MS);
+    while (pio_sm_is_rx_fifo_empty(sd_pio_tx, sd_sm_tx)) {
+        if (time_reached(deadline)) {
+            LOG_ERROR("Write CRC status timeout\n");
+            sd_dma_stop();
+            pio_sm_set_enabled(sd_pio_tx, sd_sm_tx, false);
+            return SD_BLOCK_ERROR;
+        }
+        tight_loop_contents();
+    }
+    uint32_t status = pio_sm_get(sd_pio_tx, sd_sm_tx) & 0x7;
+    sd_dma_stop();
+    pio_sm_set_enabled(sd_pio_tx, sd_sm_tx, false);
+    
+    if (defer_busy && status == 0x2) {
+        sd_defer_busy(&sd, SD_WRITE_TIMEOUT_MS);
+        sd.stats.sectors_written++;
+        return SD_BLOCK_OK;
+    }
+    
+    if (sd_wait_not_busy() != 0) {
+        LOG_ERROR("Write timeout\n");
+        return SD_BLOCK_ERROR;
+    }
+    
+    if (status == 0x5) {
+        LOG_ERROR("Write CRC rejected\n");
+        sd.stats.crc_errors++;
+        sd_clock_downshift();
+        return SD_BLOCK_CRC;
+    }
+    
+    if (status != 0x2) {
+        LOG_ERROR("Write status error: 0x%lX\n", (unsigned long)status);
+        return SD_BLOCK_ERROR;
+    }
+    
+    sd.stats.sectors_written++;
+    return SD_BLOCK_OK;
+}
+
+// CRC words laid out so the byte-swapping DMA puts them on the wire in order
+static void sd_tx_crc(const uint8_t* buf, uint32_t* crc) {
+    uint64_t value = sd_crc16_4bit((const uint32_t*)buf, SD_BLOCK_WORDS);
+    crc[0] = __builtin_bswap32((uint32_t)(value >> 32));
+    crc[1] = __builtin_bswap32((uint32_t)value);
+}
+
+// Command argument for a sector: SDSC cards take a byte address
+static uint32_t sd_block_address(uint32_t sector) {
+    return sd.info.block_addressing ? sector : sector * 512;
+}
+
+//--------------------------------------------------------------------+
+// Bus setup and identification
+//--------------------------------------------------------------------+
+
+static void sd_clock_set(uint32_t hz) {
+    // SM runs four cycles per bus clock
+    uint32_t sys_hz = clock_get_hz(clk_sys);
+    uint32_t div = (sys_hz + 4 * hz - 1) / (4 * hz);
+    if (div < 1) div = 1;
+    if (div > 0xFFFF) div = 0xFFFF;
+    pio_sm_set_clkdiv_int_frac(sd_pio_cmd, sd_sm_cmd, div, 0);
+    pio_sm_clkdiv_restart(sd_pio_cmd, sd_sm_cmd);
+    sd_clock_hz = sys_hz / (4 * div);
+}
+
+void sd_bus_init(void) {
+    sd_offset_cmd = pio_add_program(sd_pio_cmd, &sd_sdio_cmd_program);
+    sd_offset_rx = pio_add_program(sd_pio_cmd, &sd_sdio_rx_program);
+    sd_offset_tx = pio_add_program(sd_pio_tx, &sd_sdio_tx_program);
+    sd_sm_cmd = pio_claim_unused_sm(sd_pio_cmd, true);
+    sd_sm_rx = pio_claim_unused_sm(sd_pio_cmd, true);
+    sd_sm_tx = pio_claim_unused_sm(sd_pio_tx, true);
+    
+    // Command SM: CLK on side-set, CMD for out/set/in/jmp
+    pio_sm_config c = sd_sdio_cmd_program_get_default_config(sd_offset_cmd);
+    sm_config_set_sideset_pins(&c, SD_PIN_CLK);
+    sm_config_set_out_pins(&c, SD_PIN_CMD, 1);
+    sm_config_set_set_pins(&c, SD_PIN_CMD, 1);
+    sm_config_set_in_pins(&c, SD_PIN_CMD);
+    sm_config_set_jmp_pin(&c, SD_PIN_CMD);
+    sm_config_set_out_shift(&c, false, true, 32);
+    sm_config_set_in_shift(&c, false, true, 32);
+    sm_config_set_mov_status(&c, STATUS_TX_LESSTHAN, 1);
+    
+    pio_sm_set_pins_with_mask(sd_pio_cmd, sd_sm_cmd, 1u << SD_PIN_CMD,
+                              (1u << SD_PIN_CMD) | (1u << SD_PIN_CLK));
+    pio_sm_set_pindirs_with_mask(sd_pio_cmd, sd_sm_cmd, 1u << SD_PIN_CLK,
+                                 (1u << SD_PIN_CMD) | (1u << SD_PIN_CLK));
+    pio_gpio_init(sd_pio_cmd, SD_PIN_CLK);
+    pio_gpio_init(sd_pio_cmd, SD_PIN_CMD);
+    gpio_pull_up(SD_PIN_CMD);
+    pio_sm_init(sd_pio_cmd, sd_sm_cmd, sd_offset_cmd, &c);
+    
+    // Receive SM: DAT0-3 in, CLK seen as in pin 4; full speed so it never
+    // misses a bus clock edge
+    c = sd_sdio_rx_program_get_default_config(sd_offset_rx);
+    sm_config_set_in_pins(&c, SD_PIN_D0);
+    sm_config_set_in_shift(&c, false, true, 32);
+    sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
+    pio_sm_init(sd_pio_cmd, sd_sm_rx, sd_offset_rx, &c);
+    
+    // Transmit SM: DAT0-3 out, CRC status read back on DAT0
+    c = sd_sdio_tx_program_get_default_config(sd_offset_tx);
+    sm_config_set_out_pins(&c, SD_PIN_D0, 4);
+    sm_config_set_set_pins(&c, SD_PIN_D0, 4);
+    sm_config_set_in_pins(&c, SD_PIN_D0);
+    sm_config_set_out_shift(&c, false, true, 32);
+    sm_config_set_in_shift(&c, false, false, 32);
+    pio_sm_set_pins_with_mask(sd_pio_tx, sd_sm_tx, 0xFu << SD_PIN_D0, 0xFu << SD_PIN_D0);
+    pio_sm_set_pindirs_with_mask(sd_pio_tx, sd_sm_tx, 0, 0xFu << SD_PIN_D0);
+    pio_sm_init(sd_pio_tx, sd_sm_tx, sd_offset_tx, &c);
+    
+    for (uint i = 0; i < 4; i++) {
+        pio_gpio_init(sd_pio_tx, SD_PIN_D0 + i);
+        gpio_pull_up(SD_PIN_D0 + i);
+    }
+    
+    // Both data SMs count nibbles from Y, loaded once here
+    pio_sm_put(sd_pio_cmd, sd_sm_rx, SD_BLOCK_NIBBLES - 1);
+    pio_sm_exec(sd_pio_cmd, sd_sm_rx, pio_encode_pull(false, true));
+    pio_sm_exec(sd_pio_cmd, sd_sm_rx, pio_encode_mov(pio_y, pio_osr));
+    pio_sm_put(sd_pio_tx, sd_sm_tx, SD_BLOCK_NIBBLES - 1);
+    pio_sm_exec(sd_pio_tx, sd_sm_tx, pio_encode_pull(false, true));
+    pio_sm_exec(sd_pio_tx, sd_sm_tx, pio_encode_mov(pio_y, pio_osr));
+    
+    if (sd_dma_data < 0) sd_dma_data = dma_claim_unused_channel(true);
+    if (sd_dma_ctrl < 0) sd_dma_ctrl = dma_claim_unused_channel(true);
+    
+    sd_clock_set(SD_INIT_CLOCK_HZ);
+    pio_sm_set_enabled(sd_pio_cmd, sd_sm_cmd, true);
+}
+
+// Card identification at the identification clock, through to the 4-bit
+// bus. Leaves sd.info and sd_rca filled in; the caller holds the bus.
+static int sd_identify(void) {
+    // Identification must run at 100-400 kHz. The command SM clocks
+    // continuously, so the 74-cycle power-up delay is a short sleep.
+    sd.clock_step = -1;
+    sd_clock_set(SD_INIT_CLOCK_HZ);
+    sd_rca = 0;
+    sleep_ms(1);
+    
+    uint8_t resp[17];
+    
+    // CMD0: GO_IDLE_STATE (no response in SD mode)
+    sd_send_command(SD_CMD0, 0, SD_RESP_NONE, NULL);
+    
+    // CMD8: SEND_IF_COND. Version 1 cards do not answer.
+    bool v2_card = false;
+    if (sd_send_command(SD_CMD8, 0x1AA, SD_RESP_48, resp) == 0) {
+        if ((resp[3] & 0x0F) != 0x01 || resp[4] != 0xAA) {
+            LOG_ERROR("CMD8 voltage/check pattern mismatch\n");
+            return -1;
+        }
+        v2_card = true;
+    }
+    
+    // ACMD41 with the 3.2-3.4 V window; HCS only for cards that knew CMD8
+    memset(&sd.info, 0, sizeof(sd.info));
+    int timeout = 1000;
+    bool ready = false;
+    do {
+        if (sd_send_command(SD_CMD55, 0, SD_RESP_48, resp) == 0 &&
+            sd_send_command(SD_CMD41, (v2_card ? 0x40000000 : 0) | 0x00FF8000,
+                            SD_RESP_48, resp) == 0) {
+            sd.info.ocr = sd_r1_status(resp);
+            ready = (sd.info.ocr & 0x80000000) != 0;
+        }
+        if (ready) break;
+    
+        sd_pause_ms(1);
+        timeout--;
+    } while (timeout > 0);
+    
+    if (!ready) {
+        LOG_ERROR("ACMD41 failed: OCR 0x%08lX\n", (unsigned long)sd.info.ocr);
+        return -1;
+    }
+    
+    sd.info.block_addressing = v2_card && (sd.info.ocr & SD_OCR_CCS) != 0;
+    sd.info.type = !v2_card ? SD_CARD_TYPE_SDSC_V1 :
+                   sd.info.block_addressing ? SD_CARD_TYPE_SDHC : SD_CARD_TYPE_SDSC_V2;
+    
+    // CMD2: ALL_SEND_CID, CMD3: SEND_RELATIVE_ADDR
+    if (sd_send_command(SD_CMD2, 0, SD_RESP_136, resp) != 0 ||
+        sd_send_command(SD_CMD3, 0, SD_RESP_48, resp) != 0) {
+        LOG_ERROR("Card identification failed\n");
+        return -1;
+    }
+    sd_rca = ((uint32_t)resp[1] << 8) | resp[2];
+    
+    // CMD9: SEND_CSD, returned on CMD as an R2 response
+    if (sd_send_command(SD_CMD9, sd_rca << 16, SD_RESP_136, resp) != 0) {
+        LOG_ERROR("CMD9 failed\n");
+        return -1;
+    }
+    memcpy(sd.info.csd, resp + 1, sizeof(sd.info.csd));
+    
+    if (sd_parse_csd(sd.info.csd, &sd.info) != 0) {
+        return -1;
+    }
+    
+    // CMD7: select the card, ACMD6: switch to the 4-bit bus
+    if (sd_command_r1(SD_CMD7, sd_rca << 16) != 0 || sd_wait_not_busy() != 0 ||
+        sd_app_command_r1(SD_ACMD6, 2) != 0) {
+        LOG_ERROR("4-bit bus setup failed\n");
+        return -1;
+    }
+    
+    // Set block size to 512 bytes (fixed on block-addressed cards)
+    if (!sd.info.block_addressing && sd_command_r1(SD_CMD16, 512) != 0) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+int sd_init_driver(void) {
+    sd.initialized = false;
+    sd_bus_busy = true;
+    sd.write_pending = false;
+    sd.write_failed = false;
+    sd.status_unchecked = false;
+    
+    if (sd_identify() != 0) {
+        sd_bus_busy = false;
+        return -1;
+    }
+    
+    // One literal per card type: log arguments cannot be strings
+    const char* card_fmt =
+        sd.info.type == SD_CARD_TYPE_SDHC ? "SD card: SDHC/SDXC, %lu sectors (%lu MB), max %lu Hz\n" :
+        sd.info.type == SD_CARD_TYPE_SDSC_V2 ? "SD card: SDSC v2, %lu sectors (%lu MB), max %lu Hz\n" :
+        "SD card: SDSC v1, %lu sectors (%lu MB), max %lu Hz\n";
+    LOG_INFO(card_fmt, sd.info.sectors, sd.info.sectors / 2048, sd.info.max_clock_hz);
+    
+    sd_bus_busy = false;
+    sd.initialized = true;
+    sd_driver_clock_ramp(&sd);
+    LOG_INFO("SD card initialized successfully at %lu Hz\n", (unsigned long)sd_clock_hz);
+    return 0;
+}
+
+//--------------------------------------------------------------------+
+// Sector access
+//--------------------------------------------------------------------+
+
+// One CMD17 per sector; kept for single sectors and for benchmarking
+static int sd_read_blocks_single(void* buffer, uint32_t sector, uint32_t count) {
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    uint8_t* buf = (uint8_t*)buffer;
+    int result = SD_BLOCK_OK;
+    
+    sd_bus_busy = true;
+    for (uint32_t i = 0; i < count && result == SD_BLOCK_OK; i++) {
+        int retries = 0;
+        do {
+            result = sd_read_run(buf + i * 512, sd_block_address(sector + i), 1, false);
+        } while (sd_should_retry(result, &retries));
+    }
+    sd_bus_busy = false;
+    
+    return result == SD_BLOCK_OK ? 0 : -1;
+}
+
+static int sd_read_blocks(void* buffer, uint32_t sector, uint32_t count) {
+    if (count <= 1) {
+        return sd_read_blocks_single(buffer, sector, count);
+    }
+    
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    uint8_t* buf = (uint8_t*)buffer;
+    uint32_t done = 0;
+    int retries = 0;
+    int result = SD_BLOCK_OK;
+    
+    // CMD18 in runs of up to SD_SDIO_MAX_RUN blocks; a CRC error repeats
+    // the run it occurred in
+    sd_bus_busy = true;
+    while (done < count) {
+        uint32_t run = count - done;
+        if (run > SD_SDIO_MAX_RUN) run = SD_SDIO_MAX_RUN;
+    
+        result = sd_read_run(buf + done * 512, sd_block_address(sector + done), run, true);
+        if (result == SD_BLOCK_OK) {
+            done += run;
+        } else if (!sd_should_retry(result, &retries)) {
+            break;
+        }
+    }
+    sd_bus_busy = false;
+    
+    return result == SD_BLOCK_OK ? 0 : -1;
+}
+
+// One CMD24 per sector; kept for single sectors and for benchmarking
+static int sd_write_blocks_single(const void* buffer, uint32_t sector, uint32_t count) {
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    const uint8_t* buf = (const uint8_t*)buffer;
+    uint32_t crc[2];
+    int result = SD_BLOCK_OK;
+    
+    sd_bus_busy = true;
+    for (uint32_t i = 0; i < count && result == SD_BLOCK_OK; i++) {
+        sd_tx_crc(buf + i * 512, crc);
+        int retries = 0;
+        do {
+            if (sd_command_r1(SD_CMD24, sd_block_address(sector + i)) != 0) {
+                result = SD_BLOCK_ERROR;
+                break;
+            }
+            result = sd_write_block(buf + i * 512, crc, NULL, NULL, true);
+        } while (sd_should_retry(result, &retries));
+    }
+    sd_bus_busy = false;
+    
+    return result == SD_BLOCK_OK ? 0 : -1;
+}
+
+int sd_erase_sectors(uint32_t sector, uint32_t count) {
+    return sd_driver_erase(&sd, sector, count);
+}
+
+static int sd_write_blocks(const void* buffer, uint32_t sector, uint32_t count) {
+    if (count <= 1) {
+        return sd_write_blocks_single(buffer, sector, count);
+    }
+    
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    const uint8_t* buf = (const uint8_t*)buffer;
+    uint32_t crc[2][2];
+    uint32_t done = 0;
+    int retries = 0;
+    int result = SD_BLOCK_OK;
+    
+    // A CRC-rejected block ends the burst; the blocks before it were
+    // accepted, so the next burst resumes at the rejected one
+    sd_bus_busy = true;
+    while (done < count) {
+        // ACMD23 lets the card pre-erase the whole run; only a hint
+        if (sd_app_command_r1(SD_ACMD23, count - done) != 0) {
+            LOG_ERROR("ACMD23 failed\n");
+        }
+    
+        if (sd_command_r1(SD_CMD25, sd_block_address(sector + done)) != 0) {
+            result = SD_BLOCK_ERROR;
+            break;
+        }
+    
+        // The CRC for the first block is computed up front, each later
+        // one while its predecessor is being sent
+        sd_tx_crc(buf + done * 512, crc[done & 1]);
+        while (done < count) {
+            const uint8_t* next = (done + 1 < count) ? buf + (done + 1) * 512 : NULL;
+            result = sd_write_block(buf + done * 512, crc[done & 1], next, crc[(done + 1) & 1], false);
+            if (result != SD_BLOCK_OK) break;
+            done++;
+        }
+    
+        // CMD12 ends the transfer even after a rejected block; its busy
+        // period is left to the next command
+        if (sd_command_r1(SD_CMD12, 0) != 0) {
+            LOG_ERROR("CMD25 stop failed\n");
+            result = SD_BLOCK_ERROR;
+        }
+        sd_defer_busy(&sd, SD_WRITE_TIMEOUT_MS);
+    
+        if (sd_should_retry(result, &retries)) continue;
+        if (result != SD_BLOCK_OK) break;
+    }
+    sd_bus_busy = false;
+    
+    return result == SD_BLOCK_OK ? 0 : -1;
+}
+
+//--------------------------------------------------------------------+
+// Driver hooks for sd_common.c
+//--------------------------------------------------------------------+
+
+static int sd_transfer_once(const sd_transfer_t* t) {
+    if (t->op == SD_OP_READ) {
+        return t->single ? sd_read_blocks_single(t->buffer, t->sector, t->count)
+                         : sd_read_blocks(t->buffer, t->sector, t->count);
+    }
+    return t->single ? sd_write_blocks_single(t->buffer, t->sector, t->count)
+                     : sd_write_blocks(t->buffer, t->sector, t->count);
+}
+
+static int sd_erase_run(uint32_t first, uint32_t last) {
+    sd_bus_busy = true;
+    int result = 0;
+    if (sd_command_r1(SD_CMD32, sd_block_address(first)) != 0 ||
+        sd_command_r1(SD_CMD33, sd_block_address(last)) != 0 ||
+        sd_command_r1(SD_CMD38, 0) != 0) {
+        result = -1;
+    }
+    sd_bus_busy = false;
+    return result;
+}
+
+// End a multi-block transfer the card may still be in; the card may not
+// answer, which CMD0 in sd_identify() deals with
+static void sd_abort_transfer(void) {
+    uint8_t resp[6];
+    
+    sd_bus_busy = true;
+    if (sd_send_command(SD_CMD12, 0, SD_RESP_48, resp) == 0) sd_wait_not_busy();
+    sd_bus_busy = false;
+}
+
+// Identification after a failure; the old RCA stays if it does not work
+static int sd_reidentify(void) {
+    uint32_t previous_rca = sd_rca;
+    
+    sd_bus_busy = true;
+    int result = sd_identify();
+    if (result != 0) sd_rca = previous_rca;
+    sd_bus_busy = false;
+    return result;
+}
+
+static int sd_check_status(void) {
+    sd_bus_busy = true;
+    if (sd.write_pending) sd_settle_write();
+    int result = sd.write_failed ? -1 : sd_command_r1(SD_CMD13, sd_rca << 16);
+    sd_bus_busy = false;
+    return result;
+}
+
+// CMD9 is only answered in stand-by state, so the card is deselected
+// around it
+static int sd_read_csd(uint8_t* csd) {
+    uint8_t resp[17];
+    int result = -1;
+    
+    sd_bus_busy = true;
+    // CMD7 to RCA 0 deselects; no card answers it
+    sd_send_command(SD_CMD7, 0, SD_RESP_NONE, NULL);
+    if (sd_send_command(SD_CMD9, sd_rca << 16, SD_RESP_136, resp) == 0) {
+        memcpy(csd, resp + 1, 16);
+        result = 0;
+    }
+    if (sd_command_r1(SD_CMD7, sd_rca << 16) != 0 || sd_wait_not_busy() != 0) result = -1;
+    sd_bus_busy = false;
+    return result;
+}
+
+static const sd_driver_ops_t sd_ops = {
+    .transfer = sd_transfer_once,
+    .erase = sd_erase_run,
+    .abort = sd_abort_transfer,
+    .identify = sd_reidentify,
+    .check_status = sd_check_status,
+    .read_csd = sd_read_csd,
+    .clock_apply = sd_clock_apply,
+    .clock_downshift = sd_clock_downshift,
+    .clock_steps = sd_clock_steps,
+    .clock_step_count = SD_CLOCK_STEP_COUNT,
+};
+
+// Public entry points: timed for the latency histograms, with recovery
+int sd_read_sectors_single(void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_READ, true, buffer, sector, count);
+}
+
+int sd_read_sectors(void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_READ, false, buffer, sector, count);
+}
+
+int sd_write_sectors_single(const void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_WRITE, true, (void*)buffer, sector, count);
+}
+
+int sd_write_sectors(const void* buffer, uint32_t sector, uint32_t count) {
+    return sd_driver_transfer(&sd, SD_OP_WRITE, false, (void*)buffer, sector, count);
+}
+
+//--------------------------------------------------------------------+
+// Asynchronous requests
+//--------------------------------------------------------------------+
+
+int sd_submit(sd_request_t* request) {
+    if (!sd.initialized) {
+        LOG_ERROR("SD card not initialized\n");
+        return -1;
+    }
+    
+    if (request->count == 0 || request->sector + request->count > sd.info.sectors) {
+        LOG_ERROR("SD request out of range: %lu+%lu\n",
+               (unsigned long)request->sector, (unsigned long)request->count);
+        return -1;
+    }
+    
+    request->status = SD_REQUEST_QUEUED;
+    request->completed = 0;
+    request->cancel_requested = false;
+    sd_request_enqueue(&sd_queue, request);
+    return 0;
+}
+
+bool sd_request_pending(const sd_request_t* request) {
+    return request->status == SD_REQUEST_QUEUED || request->status == SD_REQUEST_ACTIVE;
+}
+
+void sd_cancel(sd_request_t* request) {
+    if (sd_request_unlink(&sd_queue, request)) {
+        sd_request_complete(request, SD_REQUEST_CANCELLED);
+    }
+}
+
+int sd_sync(void) {
+    if (sd_bus_busy) return -1;
+    return sd_driver_sync(&sd);
+}
+
+// The DMA chain already keeps the CPU out of the data phase, so each
+// request runs to completion here through the blocking path; core1 has
+// nothing else to do meanwhile
+void sd_task(void) {
+    if (sd_bus_busy) return;
+    
+    sd_request_t* request = sd_request_dequeue(&sd_queue);
+    if (!request) return;
+    
+    request->status = SD_REQUEST_ACTIVE;
+    int result = request->write
+        ? sd_write_sectors(request->buffer, request->sector, request->count)
+        : sd_read_sectors(request->buffer, request->sector, request->count);
+    
+    if (result == 0) {
+        request->completed = request->count;
+        sd_request_complete(request, SD_REQUEST_DONE);
+    } else {
+        sd_request_complete(request, SD_REQUEST_ERROR);
+    }
+}
+
+//--------------------------------------------------------------------+
+// Bus clock management
+//--------------------------------------------------------------------+
+
+static void sd_clock_apply(int step) {
+    sd.clock_step = step;
+    sd_clock_set((step < 0) ? SD_INIT_CLOCK_HZ : sd_clock_steps[step]);
+}
+
+// Drop one step after a CRC error
+static void sd_clock_downshift(void) {
+    if (sd.clock_step < 0 || sd.clock_step >= SD_CLOCK_STEP_COUNT - 1) return;
+    
+    sd_clock_apply(sd.clock_step + 1);
+    LOG_WARN("SD clock downshift to %lu Hz\n", (unsigned long)sd_clock_hz);
+}
+
+uint32_t sd_get_clock_hz(void) {
+    return sd_clock_hz;
+}
+
+const char* sd_get_transport_name(void) {
+    return "SDIO";
+}
+
+uint32_t sd_get_sectors_count(void) {
+    return sd.info.sectors;
+}
+
+const sd_card_info_t* sd_get_card_info(void) {
+    return &sd.info;
+}
+
+void sd_get_stats(sd_stats_t* stats) {
+    *stats = sd.stats;
+}
+
+void sd_reset_stats(void) {
+    memset(&sd.stats, 0, sizeof(sd.stats));
+}
+
+bool sd_is_busy(void) {
+    return sd_bus_busy || sd.recovering;
+}
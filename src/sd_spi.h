@@ -0,0 +1,44 @@
+#ifndef SD_SPI_H
+#define SD_SPI_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "pico/stdlib.h"
+#include "sd_card.h"
+
+// Byte and block transport underneath sd_card.c. Exactly one
+// implementation is linked, picked by the SD_TRANSPORT CMake option:
+//   SPI - sd_spi_hw.c, RP2040 SPI block with a DMA channel pair
+//   PIO - sd_spi_pio.c, PIO state machine with DMA
+
+// Claim pins, peripheral and DMA channels; starts at SD_INIT_CLOCK_HZ
+void sd_spi_init(void);
+
+// Returns the clock rate actually produced
+uint32_t sd_spi_set_baudrate(uint32_t hz);
+
+// Full-duplex single byte
+uint8_t sd_spi_write(uint8_t data);
+
+// Move len bytes; tx == NULL sends 0xFF, rx == NULL discards. Returns the
+// CRC16 of the payload (rx for reads, tx for writes) from the DMA sniffer.
+uint16_t sd_spi_transfer_block(const uint8_t* tx, uint8_t* rx, size_t len);
+
+// Clock 0xFF until something other than 0xFF arrives or the deadline
+// passes. Returns 0xFE for a start block token, 0xFF on timeout.
+uint8_t sd_spi_wait_token(absolute_time_t deadline);
+
+// Non-blocking halves of the above for the request state machine in
+// sd_card.c. sd_spi_transfer_poll() returns true, with the CRC16, once the
+// transfer started by sd_spi_transfer_start() has finished.
+void sd_spi_transfer_start(const uint8_t* tx, uint8_t* rx, size_t len);
+bool sd_spi_transfer_poll(uint16_t* crc);
+
+// Returns true with the token once something other than 0xFF has arrived.
+// A hunt abandoned before that must be ended with sd_spi_cancel_token().
+bool sd_spi_poll_token(uint8_t* token);
+void sd_spi_cancel_token(void);
+
+const char* sd_spi_transport_name(void);
+
+#endif // SD_SPI_H
@@ -0,0 +1,114 @@
+#include "sd_spi.h"
+#include "hardware/spi.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+
+// DMA channels for the data phase of block transfers
+static int sd_dma_tx = -1;
+static int sd_dma_rx = -1;
+
+void sd_spi_init(void) {
+    gpio_init(SD_PIN_MISO);
+    gpio_init(SD_PIN_CS);
+    gpio_init(SD_PIN_SCK);
+    gpio_init(SD_PIN_MOSI);
+    
+    gpio_set_function(SD_PIN_MISO, GPIO_FUNC_SPI);
+    gpio_set_function(SD_PIN_SCK, GPIO_FUNC_SPI);
+    gpio_set_function(SD_PIN_MOSI, GPIO_FUNC_SPI);
+    gpio_set_function(SD_PIN_CS, GPIO_FUNC_SIO);
+    
+    gpio_set_dir(SD_PIN_CS, GPIO_OUT);
+    gpio_put(SD_PIN_CS, 1);
+    
+    spi_init(SD_SPI_PORT, SD_INIT_CLOCK_HZ); // Raised by the driver after init
+    
+    if (sd_dma_tx < 0) sd_dma_tx = dma_claim_unused_channel(true);
+    if (sd_dma_rx < 0) sd_dma_rx = dma_claim_unused_channel(true);
+}
+
+uint32_t sd_spi_set_baudrate(uint32_t hz) {
+    return spi_set_baudrate(SD_SPI_PORT, hz);
+}
+
+uint8_t sd_spi_write(uint8_t data) {
+    uint8_t rx_data;
+    spi_write_read_blocking(SD_SPI_PORT, &data, &rx_data, 1);
+    return rx_data;
+}
+
+// Move len bytes through the SPI data register with a TX/RX channel pair.
+// tx == NULL clocks out 0xFF from a fixed address, rx == NULL discards.
+// The DMA sniffer watches whichever channel carries the payload and the
+// CRC16 (SD data CRC, CCITT polynomial, zero seed) of it is returned.
+void sd_spi_transfer_start(const uint8_t* tx, uint8_t* rx, size_t len) {
+    static const uint8_t fill_tx = 0xFF;
+    static uint8_t discard_rx;
+    io_rw_32* dr = &spi_get_hw(SD_SPI_PORT)->dr;
+    
+    dma_channel_config c = dma_channel_get_default_config(sd_dma_tx);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_dreq(&c, spi_get_dreq(SD_SPI_PORT, true));
+    channel_config_set_read_increment(&c, tx != NULL);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_sniff_enable(&c, tx != NULL);
+    dma_channel_configure(sd_dma_tx, &c, dr, tx ? tx : &fill_tx, len, false);
+    
+    c = dma_channel_get_default_config(sd_dma_rx);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_dreq(&c, spi_get_dreq(SD_SPI_PORT, false));
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, rx != NULL);
+    channel_config_set_sniff_enable(&c, tx == NULL);
+    dma_channel_configure(sd_dma_rx, &c, rx ? rx : &discard_rx, dr, len, false);
+    
+    dma_sniffer_enable(tx ? sd_dma_tx : sd_dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, false);
+    dma_sniffer_set_data_accumulator(0);
+    
+    // Start both together so the RX FIFO never overflows
+    dma_start_channel_mask((1u << sd_dma_tx) | (1u << sd_dma_rx));
+}
+
+bool sd_spi_transfer_poll(uint16_t* crc) {
+    if (dma_channel_is_busy(sd_dma_rx)) return false;
+    
+    *crc = (uint16_t)dma_sniffer_get_data_accumulator();
+    return true;
+}
+
+uint16_t sd_spi_transfer_block(const uint8_t* tx, uint8_t* rx, size_t len) {
+    uint16_t crc;
+    
+    sd_spi_transfer_start(tx, rx, len);
+    while (!sd_spi_transfer_poll(&crc)) {
+        tight_loop_contents();
+    }
+    
+    return crc;
+}
+
+// The SPI block has no pattern matching, so the CPU polls byte by byte
+uint8_t sd_spi_wait_token(absolute_time_t deadline) {
+    uint8_t token;
+    do {
+        token = sd_spi_write(0xFF);
+    } while (token == 0xFF && !time_reached(deadline));
+    return token;
+}
+
+// A few bytes per call, so one poll stays short even at the init clock
+bool sd_spi_poll_token(uint8_t* token) {
+    for (int i = 0; i < 8; i++) {
+        *token = sd_spi_write(0xFF);
+        if (*token != 0xFF) return true;
+    }
+    return false;
+}
+
+void sd_spi_cancel_token(void) {
+    // Nothing in flight between polls
+}
+
+const char* sd_spi_transport_name(void) {
+    return "SPI";
+}
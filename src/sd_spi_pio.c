@@ -0,0 +1,213 @@
+#include "sd_spi.h"
+#include "hardware/pio.h"
+#include "hardware/gpio.h"
+#include "hardware/dma.h"
+#include "hardware/clocks.h"
+#include "sd_spi.pio.h"
+
+static PIO sd_pio = pio0;
+static uint sd_sm;
+static uint sd_offset;
+
+// DMA channels for the data phase of block transfers
+static int sd_dma_tx = -1;
+static int sd_dma_rx = -1;
+static bool sd_hunting = false;
+
+static inline io_rw_8* sd_pio_txfifo(void) {
+    return (io_rw_8*)&sd_pio->txf[sd_sm];
+}
+
+static inline io_rw_8* sd_pio_rxfifo(void) {
+    return (io_rw_8*)&sd_pio->rxf[sd_sm];
+}
+
+// Redirect the machine once it is parked on the empty-FIFO stall at the
+// top of the byte loop, i.e. between bytes
+static void sd_pio_enter(uint entry) {
+    while (pio_sm_get_pc(sd_pio, sd_sm) != sd_offset + sd_spi_offset_xfer) {
+        tight_loop_contents();
+    }
+    pio_sm_exec(sd_pio, sd_sm, pio_encode_jmp(sd_offset + entry));
+}
+
+// Put the machine back at the byte loop after an abandoned hunt
+static void sd_pio_reset(void) {
+    pio_sm_set_enabled(sd_pio, sd_sm, false);
+    pio_sm_clear_fifos(sd_pio, sd_sm);
+    pio_sm_restart(sd_pio, sd_sm);
+    pio_sm_exec(sd_pio, sd_sm, pio_encode_jmp(sd_offset + sd_spi_offset_xfer));
+    pio_sm_set_enabled(sd_pio, sd_sm, true);
+}
+
+static void sd_dma_wait(int channel) {
+    while (dma_channel_is_busy(channel)) {
+        tight_loop_contents();
+    }
+}
+
+void sd_spi_init(void) {
+    gpio_init(SD_PIN_CS);
+    gpio_set_dir(SD_PIN_CS, GPIO_OUT);
+    gpio_put(SD_PIN_CS, 1);
+    
+    sd_offset = pio_add_program(sd_pio, &sd_spi_program);
+    sd_sm = pio_claim_unused_sm(sd_pio, true);
+    
+    pio_sm_config c = sd_spi_program_get_default_config(sd_offset);
+    sm_config_set_out_pins(&c, SD_PIN_MOSI, 1);
+    sm_config_set_in_pins(&c, SD_PIN_MISO);
+    sm_config_set_sideset_pins(&c, SD_PIN_SCK);
+    sm_config_set_jmp_pin(&c, SD_PIN_MISO);
+    sm_config_set_out_shift(&c, false, true, 8);
+    sm_config_set_in_shift(&c, false, true, 8);
+    
+    // SCK idles low, MOSI idles high
+    uint32_t out_mask = (1u << SD_PIN_SCK) | (1u << SD_PIN_MOSI);
+    pio_sm_set_pins_with_mask(sd_pio, sd_sm, 1u << SD_PIN_MOSI, out_mask);
+    pio_sm_set_pindirs_with_mask(sd_pio, sd_sm, out_mask, out_mask | (1u << SD_PIN_MISO));
+    pio_gpio_init(sd_pio, SD_PIN_SCK);
+    pio_gpio_init(sd_pio, SD_PIN_MOSI);
+    pio_gpio_init(sd_pio, SD_PIN_MISO);
+    gpio_pull_up(SD_PIN_MISO);
+    
+    // The 2-cycle bit loop samples right at the rising edge; the two-stage
+    // synchronizer would return the level from before the card drove it
+    hw_set_bits(&sd_pio->input_sync_bypass, 1u << SD_PIN_MISO);
+    
+    pio_sm_init(sd_pio, sd_sm, sd_offset + sd_spi_offset_xfer, &c);
+    sd_spi_set_baudrate(SD_INIT_CLOCK_HZ);
+    pio_sm_set_enabled(sd_pio, sd_sm, true);
+    
+    if (sd_dma_tx < 0) sd_dma_tx = dma_claim_unused_channel(true);
+    if (sd_dma_rx < 0) sd_dma_rx = dma_claim_unused_channel(true);
+}
+
+// Integer dividers only: a fractional divider would jitter SCK. At least
+// 2, so the card gets a full PIO cycle to drive MISO before the sample.
+uint32_t sd_spi_set_baudrate(uint32_t hz) {
+    uint32_t sys_hz = clock_get_hz(clk_sys);
+    uint32_t div = (sys_hz + 2 * hz - 1) / (2 * hz);
+    if (div < 2) div = 2;
+    if (div > 65535) div = 65535;
+    
+    pio_sm_set_clkdiv_int_frac(sd_pio, sd_sm, div, 0);
+    pio_sm_clkdiv_restart(sd_pio, sd_sm);
+    return sys_hz / (2 * div);
+}
+
+uint8_t sd_spi_write(uint8_t data) {
+    while (pio_sm_is_tx_fifo_full(sd_pio, sd_sm)) tight_loop_contents();
+    *sd_pio_txfifo() = data;
+    while (pio_sm_is_rx_fifo_empty(sd_pio, sd_sm)) tight_loop_contents();
+    return *sd_pio_rxfifo();
+}
+
+// Writes stream through the full-duplex loop; reads use the receive-only
+// entry, which generates the 0xFF fill itself and needs only the RX channel.
+void sd_spi_transfer_start(const uint8_t* tx, uint8_t* rx, size_t len) {
+    static uint8_t discard_rx;
+    
+    dma_channel_config c = dma_channel_get_default_config(sd_dma_rx);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_dreq(&c, pio_get_dreq(sd_pio, sd_sm, false));
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, rx != NULL);
+    channel_config_set_sniff_enable(&c, tx == NULL);
+    dma_channel_configure(sd_dma_rx, &c, rx ? rx : &discard_rx, sd_pio_rxfifo(), len, false);
+    
+    if (tx == NULL) {
+        dma_sniffer_enable(sd_dma_rx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, false);
+        dma_sniffer_set_data_accumulator(0);
+        
+        dma_channel_start(sd_dma_rx);
+        sd_pio_enter(sd_spi_offset_rx);
+        pio_sm_put(sd_pio, sd_sm, len * 8 - 1);
+    } else {
+        c = dma_channel_get_default_config(sd_dma_tx);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+        channel_config_set_dreq(&c, pio_get_dreq(sd_pio, sd_sm, true));
+        channel_config_set_read_increment(&c, true);
+        channel_config_set_write_increment(&c, false);
+        channel_config_set_sniff_enable(&c, true);
+        dma_channel_configure(sd_dma_tx, &c, sd_pio_txfifo(), tx, len, false);
+        
+        dma_sniffer_enable(sd_dma_tx, DMA_SNIFF_CTRL_CALC_VALUE_CRC16, false);
+        dma_sniffer_set_data_accumulator(0);
+        
+        dma_start_channel_mask((1u << sd_dma_tx) | (1u << sd_dma_rx));
+    }
+}
+
+bool sd_spi_transfer_poll(uint16_t* crc) {
+    if (dma_channel_is_busy(sd_dma_rx)) return false;
+    
+    *crc = (uint16_t)dma_sniffer_get_data_accumulator();
+    return true;
+}
+
+uint16_t sd_spi_transfer_block(const uint8_t* tx, uint8_t* rx, size_t len) {
+    uint16_t crc;
+    
+    sd_spi_transfer_start(tx, rx, len);
+    sd_dma_wait(sd_dma_rx);
+    sd_spi_transfer_poll(&crc);
+    
+    return crc;
+}
+
+// The hunt stopped at the first 0 bit, consumed bits into a byte: clock
+// in the rest of that byte so the next command starts on a byte boundary.
+// The consumed bits were ones up to that 0, so the token can be rebuilt.
+static uint8_t sd_pio_finish_token(uint32_t consumed) {
+    // Leading bits go into the ISR as zeros; autopush fires at the 8th bit
+    while (pio_sm_get_pc(sd_pio, sd_sm) != sd_offset + sd_spi_offset_xfer) {
+        tight_loop_contents();
+    }
+    pio_sm_exec(sd_pio, sd_sm, pio_encode_in(pio_null, consumed));
+    pio_sm_exec(sd_pio, sd_sm, pio_encode_jmp(sd_offset + sd_spi_offset_rx));
+    pio_sm_put(sd_pio, sd_sm, 8 - consumed - 1);
+    
+    uint8_t rest = (uint8_t)pio_sm_get_blocking(sd_pio, sd_sm);
+    return (uint8_t)(0xFF << (9 - consumed)) | rest;
+}
+
+// Token hunting runs in the state machine; the CPU only checks for the
+// bit count it pushes
+bool sd_spi_poll_token(uint8_t* token) {
+    if (!sd_hunting) {
+        sd_pio_enter(sd_spi_offset_hunt);
+        sd_hunting = true;
+    }
+    
+    if (pio_sm_is_rx_fifo_empty(sd_pio, sd_sm)) return false;
+    
+    uint32_t bits = pio_sm_get(sd_pio, sd_sm);
+    sd_hunting = false;
+    *token = (bits % 8 == 0) ? 0xFE : sd_pio_finish_token(bits % 8);
+    return true;
+}
+
+void sd_spi_cancel_token(void) {
+    if (sd_hunting) {
+        sd_pio_reset();
+        sd_hunting = false;
+    }
+}
+
+uint8_t sd_spi_wait_token(absolute_time_t deadline) {
+    uint8_t token;
+    
+    while (!sd_spi_poll_token(&token)) {
+        if (time_reached(deadline)) {
+            sd_spi_cancel_token();
+            return 0xFF;
+        }
+    }
+    
+    return token;
+}
+
+const char* sd_spi_transport_name(void) {
+    return "PIO";
+}
@@ -0,0 +1,280 @@
+#include "storage_bench.h"
+#include "storage_pipe.h"
+#include "sd_card.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+static uint8_t bench_buf[STORAGE_BENCH_MAX_BLOCK];
+static uint32_t bench_rng;
+static int bench_failures;
+
+static const uint32_t bench_blocks[] = { 512, 4096, 32768 };
+#define BENCH_BLOCK_COUNT ((int)(sizeof(bench_blocks) / sizeof(bench_blocks[0])))
+
+// CFG_TUD_MSC_EP_BUFSIZE candidates for the MSC data path tests
+static const uint32_t bench_msc_buffers[] = { 512, 4096, 16384, 32768 };
+#define BENCH_MSC_COUNT ((int)(sizeof(bench_msc_buffers) / sizeof(bench_msc_buffers[0])))
+
+#define BENCH_LARGE_FILE   "BENCH.BIN"
+#define BENCH_SCRATCH_FILE "BENCH.RAW"
+
+// Helper functions
+static uint32_t bench_random(void) {
+    // xorshift32 with a fixed seed: every run visits the same sectors
+    bench_rng ^= bench_rng << 13;
+    bench_rng ^= bench_rng >> 17;
+    bench_rng ^= bench_rng << 5;
+    return bench_rng;
+}
+
+static void bench_small_name(char* name, int index) {
+    snprintf(name, 13, "BENCH%02d.TXT", index);
+}
+
+// One row of the results table; us == 0 marks a failed test
+static void bench_report(const char* test, uint32_t block, uint32_t ops, uint32_t bytes, uint64_t us) {
+    if (us == 0) {
+        bench_failures++;
+        printf("bench,%s,%lu,%lu,%lu,0,0,0,fail\n", test, (unsigned long)block,
+               (unsigned long)ops, (unsigned long)bytes);
+        return;
+    }
+    printf("bench,%s,%lu,%lu,%lu,%llu,%llu,%llu,ok\n", test, (unsigned long)block,
+           (unsigned long)ops, (unsigned long)bytes, (unsigned long long)us,
+           (unsigned long long)((uint64_t)bytes * 1000000 / 1024 / us),
+           (unsigned long long)((uint64_t)ops * 1000000 / us));
+}
+
+//--------------------------------------------------------------------+
+// Block layer
+//--------------------------------------------------------------------+
+
+// Sector of the next operation: consecutive, or a random aligned block
+static uint32_t bench_next_sector(bool random, uint32_t op, uint32_t block_sectors, uint32_t span) {
+    uint32_t slots = span / block_sectors;
+    uint32_t slot = random ? bench_random() % slots : op % slots;
+    return slot * block_sectors;
+}
+
+// One pass of block I/O over [base, base + span). Reads start cold:
+// nothing cached and no stream detected yet. Writes include the final
+// sync, so data left in the write-back buffer is not free.
+static uint64_t bench_block_pass(bool write, bool random, uint32_t block, uint32_t base, uint32_t span) {
+    uint32_t block_sectors = block / 512;
+    uint32_t ops = STORAGE_BENCH_BYTES / block;
+    
+    if (storage_sync() != 0) return 0;
+    storage_invalidate_all();
+    
+    uint64_t start = time_us_64();
+    for (uint32_t op = 0; op < ops; op++) {
+        uint32_t sector = base + bench_next_sector(random, op, block_sectors, span);
+        int result = write ? storage_write(bench_buf, sector, block_sectors)
+                           : storage_read(bench_buf, sector, block_sectors);
+        if (result != 0) return 0;
+    }
+    if (write && storage_sync() != 0) return 0;
+    return time_us_64() - start;
+}
+
+uint32_t storage_bench_scratch_create(FATFS* fs, const char* path, uint32_t sectors,
+                                      uint32_t min_sectors, uint32_t* base) {
+    FIL file;
+    uint32_t span = 0;
+    
+    if (f_open(&file, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) return 0;
+    
+    for (; sectors >= min_sectors && sectors > 0; sectors /= 2) {
+        if (f_expand(&file, (FSIZE_t)sectors * 512, 1) == FR_OK) {
+            *base = fs->database + (file.obj.sclust - 2) * fs->csize;
+            span = sectors;
+            break;
+        }
+    }
+    
+    if (f_close(&file) != FR_OK) return 0;
+    return span;
+}
+
+// Sequential host transfer through the MSC data path: READ10/WRITE10
+// commands of STORAGE_BENCH_MSC_COMMAND bytes, each split into callbacks
+// of buffer bytes, with the flush the firmware does after every WRITE10.
+// USB time is not included.
+static uint64_t bench_msc_pass(bool write, uint32_t buffer, uint32_t base, uint32_t span) {
+    uint32_t buffer_sectors = buffer / 512;
+    uint32_t per_command = STORAGE_BENCH_MSC_COMMAND / buffer;
+    uint32_t ops = STORAGE_BENCH_BYTES / buffer;
+    
+    if (storage_sync() != 0) return 0;
+    storage_invalidate_all();
+    
+    uint64_t start = time_us_64();
+    for (uint32_t op = 0; op < ops; op++) {
+        uint32_t sector = base + (op * buffer_sectors) % span;
+        int32_t result;
+        while ((result = write ? storage_msc_write(bench_buf, sector, buffer_sectors)
+                               : storage_msc_read(bench_buf, sector, buffer_sectors)) == 0) {
+            storage_pipe_task();
+        }
+        if (result != (int32_t)buffer) return 0;
+        if (write && (op + 1) % per_command == 0) storage_msc_flush();
+    }
+    if (write && storage_sync() != 0) return 0;
+    return time_us_64() - start;
+}
+
+static void bench_msc_tests(uint32_t base, uint32_t span) {
+    for (int write = 0; write < 2; write++) {
+        for (int i = 0; i < BENCH_MSC_COUNT; i++) {
+            uint32_t buffer = bench_msc_buffers[i];
+            if (buffer > STORAGE_BENCH_MAX_BLOCK || buffer > STORAGE_BENCH_MSC_COMMAND) continue;
+            
+            uint64_t us = span ? bench_msc_pass(write, buffer, base, span) : 0;
+            bench_report(write ? "msc_write" : "msc_read", buffer, STORAGE_BENCH_BYTES / buffer,
+                         STORAGE_BENCH_BYTES, us);
+        }
+    }
+}
+
+static void bench_block_tests(FATFS* fs) {
+    static const char* const names[2][2] = {
+        { "seq_read", "rand_read" },
+        { "seq_write", "rand_write" },
+    };
+    uint32_t base;
+    uint32_t span = storage_bench_scratch_create(fs, BENCH_SCRATCH_FILE, STORAGE_BENCH_SPAN_SECTORS,
+                                                 STORAGE_BENCH_MAX_BLOCK / 512, &base);
+    
+    for (int write = 0; write < 2; write++) {
+        for (int random = 0; random < 2; random++) {
+            bench_rng = 0x2545F491;
+            for (int i = 0; i < BENCH_BLOCK_COUNT; i++) {
+                uint32_t block = bench_blocks[i];
+                if (block > STORAGE_BENCH_MAX_BLOCK) continue;
+                
+                uint64_t us = span ? bench_block_pass(write, random, block, base, span) : 0;
+                bench_report(names[write][random], block, STORAGE_BENCH_BYTES / block,
+                             STORAGE_BENCH_BYTES, us);
+            }
+        }
+    }
+    bench_msc_tests(base, span);
+    
+    f_unlink(BENCH_SCRATCH_FILE);
+    storage_sync();
+}
+
+//--------------------------------------------------------------------+
+// FatFs
+//--------------------------------------------------------------------+
+
+// Unmount, then time a full mount: card re-initialization, boot sector
+// and FSInfo. Buffered writes must reach the card first, since
+// disk_initialize() drops the block layer's state.
+static uint64_t bench_mount(FATFS* fs) {
+    if (storage_sync() != 0) return 0;
+    f_mount(NULL, "", 0);
+    
+    uint64_t start = time_us_64();
+    if (f_mount(fs, "", 1) != FR_OK) return 0;
+    return time_us_64() - start;
+}
+
+// Write len bytes from bench_buf in chunks of at most chunk bytes
+static FRESULT bench_file_write(FIL* file, uint32_t len, uint32_t chunk) {
+    UINT written;
+    for (uint32_t done = 0; done < len; done += chunk) {
+        uint32_t n = len - done < chunk ? len - done : chunk;
+        FRESULT fr = f_write(file, bench_buf, n, &written);
+        if (fr != FR_OK) return fr;
+        if (written != n) return FR_DENIED;   // Volume full
+    }
+    return FR_OK;
+}
+
+static FRESULT bench_file_read(FIL* file, uint32_t len, uint32_t chunk) {
+    UINT read;
+    for (uint32_t done = 0; done < len; done += chunk) {
+        uint32_t n = len - done < chunk ? len - done : chunk;
+        FRESULT fr = f_read(file, bench_buf, n, &read);
+        if (fr != FR_OK) return fr;
+        if (read != n) return FR_INT_ERR;
+    }
+    return FR_OK;
+}
+
+// Every file open/write/close of the small file tests goes through here;
+// mode FA_CREATE_ALWAYS creates, FA_OPEN_APPEND appends, FA_READ reads
+static uint64_t bench_small_files(BYTE mode, uint32_t len) {
+    char name[13];
+    FIL file;
+    
+    uint64_t start = time_us_64();
+    for (int i = 0; i < STORAGE_BENCH_SMALL_FILES; i++) {
+        bench_small_name(name, i);
+        FRESULT fr = f_open(&file, name, mode == FA_READ ? FA_READ : FA_WRITE | mode);
+        if (fr != FR_OK) return 0;
+    
+        fr = mode == FA_READ ? bench_file_read(&file, len, len) : bench_file_write(&file, len, len);
+        FRESULT close_fr = f_close(&file);
+        if (fr != FR_OK || close_fr != FR_OK) return 0;
+    }
+    return time_us_64() - start;
+}
+
+static uint64_t bench_large_file(bool write, uint32_t chunk) {
+    FIL file;
+    
+    uint64_t start = time_us_64();
+    FRESULT fr = f_open(&file, BENCH_LARGE_FILE, write ? FA_WRITE | FA_CREATE_ALWAYS : FA_READ);
+    if (fr != FR_OK) return 0;
+    
+    fr = write ? bench_file_write(&file, STORAGE_BENCH_BYTES, chunk)
+               : bench_file_read(&file, STORAGE_BENCH_BYTES, chunk);
+    FRESULT close_fr = f_close(&file);
+    if (fr != FR_OK || close_fr != FR_OK) return 0;
+    return time_us_64() - start;
+}
+
+static void bench_fs_tests(FATFS* fs) {
+    uint32_t small = STORAGE_BENCH_SMALL_BYTES;
+    uint32_t files = STORAGE_BENCH_SMALL_FILES;
+    uint32_t chunk = STORAGE_BENCH_MAX_BLOCK;
+    char name[13];
+    
+    bench_report("mount", 0, 1, 0, bench_mount(fs));
+    
+    // Script-sized files: the cost is in directory and FAT updates
+    memset(bench_buf, 'A', small);
+    bench_report("fs_create_small", small, files, files * small,
+                 bench_small_files(FA_CREATE_ALWAYS, small));
+    bench_report("fs_append_small", 64, files, files * 64,
+                 bench_small_files(FA_OPEN_APPEND, 64));
+    bench_report("fs_read_small", small, files, files * small,
+                 bench_small_files(FA_READ, small));
+    
+    // One multi-megabyte file in MSC-sized chunks: the cost is in the data
+    bench_report("fs_write_large", chunk, STORAGE_BENCH_BYTES / chunk, STORAGE_BENCH_BYTES,
+                 bench_large_file(true, chunk));
+    bench_report("fs_read_large", chunk, STORAGE_BENCH_BYTES / chunk, STORAGE_BENCH_BYTES,
+                 bench_large_file(false, chunk));
+    
+    for (int i = 0; i < STORAGE_BENCH_SMALL_FILES; i++) {
+        bench_small_name(name, i);
+        f_unlink(name);
+    }
+    f_unlink(BENCH_LARGE_FILE);
+    storage_sync();
+}
+
+int storage_bench_run(FATFS* fs) {
+    bench_failures = 0;
+    
+    printf("bench_info,transport,%s,clock_hz,%lu\n", sd_get_transport_name(), (unsigned long)sd_get_clock_hz());
+    printf("bench,test,block,ops,bytes,us,kb_per_s,ops_per_s,result\n");
+    bench_fs_tests(fs);
+    bench_block_tests(fs);
+    
+    return bench_failures;
+}
@@ -0,0 +1,64 @@
+#ifndef STORAGE_BENCH_H
+#define STORAGE_BENCH_H
+
+#include <stdint.h>
+#include "ff.h"
+
+// Benchmark suite for the whole storage stack: block layer I/O (sequential
+// and random, 512 B to 32 KiB), the MSC data path at each candidate
+// CFG_TUD_MSC_EP_BUFSIZE, FatFs small and large files, and mount time. Built into the firmware (console command "bench") and into the
+// host build (sd_host --bench), so both produce the same CSV table:
+//
+//   bench_info,transport,SPI,clock_hz,31250000
+//   bench,test,block,ops,bytes,us,kb_per_s,ops_per_s,result
+//   bench,seq_read,4096,256,1048576,483834,2116,529,ok
+//
+// Block layer and MSC tests run inside a contiguous scratch file
+// (f_expand), so no existing data is touched. All test files go in the
+// root directory and are deleted again.
+
+// Bytes moved by each block layer test and by the large file tests
+#ifndef STORAGE_BENCH_BYTES
+#define STORAGE_BENCH_BYTES         (1024 * 1024)
+#endif
+
+// Size of the scratch file the block layer tests run in; halved until it
+// fits on a fuller card
+#ifndef STORAGE_BENCH_SPAN_SECTORS
+#define STORAGE_BENCH_SPAN_SECTORS  32768   // 16 MiB
+#endif
+
+// Largest block size tested; also the size of the test buffer
+#ifndef STORAGE_BENCH_MAX_BLOCK
+#define STORAGE_BENCH_MAX_BLOCK     32768
+#endif
+
+// Host command size for the MSC tests; Windows issues 64 KiB READ10 and
+// WRITE10 commands for large copies
+#ifndef STORAGE_BENCH_MSC_COMMAND
+#define STORAGE_BENCH_MSC_COMMAND   (64 * 1024)
+#endif
+
+// Small files: ducky.txt-sized, created, appended to and read back
+#ifndef STORAGE_BENCH_SMALL_FILES
+#define STORAGE_BENCH_SMALL_FILES   16
+#endif
+
+#ifndef STORAGE_BENCH_SMALL_BYTES
+#define STORAGE_BENCH_SMALL_BYTES   1024
+#endif
+
+// Contiguous scratch file at path for tests that write raw sectors, so no
+// one's data is touched. Tries sectors, then halves it down to
+// min_sectors on a fuller card. f_close() syncs, so the FAT entries are on
+// the card before the raw writes. Returns the span in sectors and the
+// first sector in *base, 0 on failure.
+uint32_t storage_bench_scratch_create(FATFS* fs, const char* path, uint32_t sectors,
+                                      uint32_t min_sectors, uint32_t* base);
+
+// Run every test on the mounted volume and print the table. fs must be
+// the object mounted as the default drive; the mount test remounts it.
+// Returns the number of failed tests.
+int storage_bench_run(FATFS* fs);
+
+#endif // STORAGE_BENCH_H
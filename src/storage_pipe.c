@@ -0,0 +1,549 @@
+#include "storage_pipe.h"
+#include "block_dev.h"
+#include "sd_card.h"
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include <stdio.h>
+#include <string.h>
+
+// Core that owns the card once the pipeline is enabled
+#define STORAGE_PIPE_CORE 1
+
+// Queue depth, a power of two. Core0 never has more requests in flight, so
+// neither queue can overflow.
+#define STORAGE_QUEUE_SIZE 16
+
+typedef enum {
+    STORAGE_OP_INIT,
+    STORAGE_OP_READ,
+    STORAGE_OP_MSC_READ,    // block_read_bulk()
+    STORAGE_OP_WRITE,
+    STORAGE_OP_SYNC,
+    STORAGE_OP_DISCARD,
+    STORAGE_OP_INVALIDATE,
+    STORAGE_OP_PRINT_STATS,
+    STORAGE_OP_RESET_STATS,
+} storage_op_t;
+
+// Owned by core0 except between being queued and coming back, when core1
+// may fill in the buffer and result
+typedef struct {
+    storage_op_t op;
+    void* buffer;
+    uint32_t sector;
+    uint32_t count;
+    int slot;               // Slot index, -1 for other requests
+    int result;             // Written by core1
+    volatile bool done;     // Set by core0 when the request comes back
+} storage_req_t;
+
+// Single producer, single consumer; indices run freely and are masked
+typedef struct {
+    storage_req_t* entries[STORAGE_QUEUE_SIZE];
+    volatile uint32_t head;     // Written by the producer only
+    volatile uint32_t tail;     // Written by the consumer only
+} storage_queue_t;
+
+typedef enum {
+    STORAGE_SLOT_FREE = 0,
+    STORAGE_SLOT_READING,   // Read queued
+    STORAGE_SLOT_STALE,     // Read queued, data no longer wanted
+    STORAGE_SLOT_READY,     // Read back; req.result tells how it went
+    STORAGE_SLOT_WRITING,   // Write queued
+} storage_slot_state_t;
+
+// Part of an UNMAP still to be discarded; count 0 marks a free entry
+typedef struct {
+    uint32_t sector;
+    uint32_t count;
+} storage_range_t;
+
+typedef struct {
+    storage_slot_state_t state;
+    bool prefetch;          // Queued ahead of the host
+    storage_req_t req;
+    uint8_t data[STORAGE_PIPE_SLOT_SIZE] __attribute__((aligned(4)));
+} storage_slot_t;
+
+static storage_queue_t storage_requests;       // Core0 to core1
+static storage_queue_t storage_completions;    // Core1 to core0
+static volatile bool storage_pipe_enabled = false;
+
+// Core0 state
+static storage_slot_t storage_slots[STORAGE_PIPE_SLOTS];
+static uint32_t storage_outstanding = 0;       // Queued and not yet collected
+static storage_req_t storage_flush_req;
+static bool storage_flush_pending = false;
+static bool storage_write_failed = false;      // Until reported
+static storage_range_t storage_discards[STORAGE_PIPE_DISCARDS];
+static storage_req_t storage_discard_req;
+static bool storage_discard_pending = false;
+static void (*storage_wait_callback)(void) = NULL;
+static storage_pipe_stats_t storage_stats;
+
+// Helper functions
+static void storage_queue_push(storage_queue_t* queue, storage_req_t* req) {
+    uint32_t head = queue->head;
+    queue->entries[head & (STORAGE_QUEUE_SIZE - 1)] = req;
+    
+    // The request must be visible to the other core before the index
+    __mem_fence_release();
+    queue->head = head + 1;
+}
+
+static storage_req_t* storage_queue_pop(storage_queue_t* queue) {
+    uint32_t tail = queue->tail;
+    if (queue->head == tail) return NULL;
+    
+    __mem_fence_acquire();
+    storage_req_t* req = queue->entries[tail & (STORAGE_QUEUE_SIZE - 1)];
+    __mem_fence_release();
+    queue->tail = tail + 1;
+    return req;
+}
+
+// Whether a synchronous call has to go through core1
+static bool storage_forwarded(void) {
+    return storage_pipe_enabled && get_core_num() != STORAGE_PIPE_CORE;
+}
+
+static int storage_execute(storage_req_t* req) {
+    int result;
+    
+    switch (req->op) {
+    case STORAGE_OP_INIT:
+        if (sd_init_driver() != 0) return -1;
+        block_invalidate_all();
+        return 0;
+    case STORAGE_OP_READ:
+        return block_read(req->buffer, req->sector, req->count);
+    case STORAGE_OP_MSC_READ:
+        return block_read_bulk(req->buffer, req->sector, req->count);
+    case STORAGE_OP_WRITE:
+        return block_write(req->buffer, req->sector, req->count);
+    case STORAGE_OP_SYNC:
+        return block_sync();
+    case STORAGE_OP_DISCARD:
+        return block_discard(req->sector, req->count);
+    case STORAGE_OP_INVALIDATE:
+        result = block_sync();
+        block_invalidate_all();
+        return result;
+    case STORAGE_OP_PRINT_STATS:
+        sd_print_stats();
+        block_print_stats();
+        return 0;
+    case STORAGE_OP_RESET_STATS:
+        sd_reset_stats();
+        block_reset_stats();
+        return 0;
+    }
+    return -1;
+}
+
+//--------------------------------------------------------------------+
+// Core1
+//--------------------------------------------------------------------+
+
+void storage_pipe_enable(void) {
+    storage_pipe_enabled = true;
+}
+
+void storage_pipe_core1_run(void) {
+    while (true) {
+        storage_req_t* req = storage_queue_pop(&storage_requests);
+        if (req) {
+            req->result = storage_execute(req);
+            storage_queue_push(&storage_completions, req);
+        }
+    
+        // Write-back timeout, read-ahead and queued SD requests
+        sd_task();
+        block_task();
+    }
+}
+
+//--------------------------------------------------------------------+
+// Core0: requests and completions
+//--------------------------------------------------------------------+
+
+// Queue a request; false if core1 already has as many as the queues hold
+static bool storage_submit(storage_req_t* req) {
+    if (storage_outstanding >= STORAGE_QUEUE_SIZE) return false;
+    
+    req->done = false;
+    storage_outstanding++;
+    storage_queue_push(&storage_requests, req);
+    return true;
+}
+
+static void storage_slot_release(storage_slot_t* slot) {
+    if (slot->prefetch && slot->state != STORAGE_SLOT_WRITING) storage_stats.wasted++;
+    slot->state = STORAGE_SLOT_FREE;
+}
+
+static void storage_complete(storage_req_t* req) {
+    if (req == &storage_flush_req) {
+        if (req->result != 0) storage_write_failed = true;
+        storage_flush_pending = false;
+        return;
+    }
+    if (req == &storage_discard_req) {
+        // Discarding is a hint; the block layer has logged a failure
+        storage_discard_pending = false;
+        return;
+    }
+    if (req->slot < 0) return;
+    
+    storage_slot_t* slot = &storage_slots[req->slot];
+    switch (slot->state) {
+    case STORAGE_SLOT_READING:
+        slot->state = STORAGE_SLOT_READY;
+        break;
+    case STORAGE_SLOT_STALE:
+        storage_slot_release(slot);
+        break;
+    case STORAGE_SLOT_WRITING:
+        if (req->result != 0) storage_write_failed = true;
+        slot->state = STORAGE_SLOT_FREE;
+        break;
+    default:
+        break;
+    }
+}
+
+// Queue the next erase-sized piece of an UNMAP. One piece at a time, so
+// core1 serves the reads and writes queued meanwhile between erases.
+static void storage_discard_next(void) {
+    if (storage_discard_pending) return;
+    
+    for (int i = 0; i < STORAGE_PIPE_DISCARDS; i++) {
+        storage_range_t* range = &storage_discards[i];
+        if (!range->count) continue;
+    
+        // End pieces on erase chunk boundaries so no erase unit is split
+        uint32_t run = SD_ERASE_MAX_SECTORS - range->sector % SD_ERASE_MAX_SECTORS;
+        if (run > range->count) run = range->count;
+    
+        storage_discard_req.op = STORAGE_OP_DISCARD;
+        storage_discard_req.sector = range->sector;
+        storage_discard_req.count = run;
+        storage_discard_req.slot = -1;
+        if (!storage_submit(&storage_discard_req)) return;
+    
+        storage_discard_pending = true;
+        range->sector += run;
+        range->count -= run;
+        return;
+    }
+}
+
+static bool storage_discard_add(uint32_t sector, uint32_t count) {
+    for (int i = 0; i < STORAGE_PIPE_DISCARDS; i++) {
+        if (storage_discards[i].count) continue;
+        storage_discards[i].sector = sector;
+        storage_discards[i].count = count;
+        return true;
+    }
+    return false;
+}
+
+// A write is queued after the discards still waiting here, so take its
+// sectors out of them. A remainder that finds no free entry is dropped.
+static void storage_discard_trim(uint32_t sector, uint32_t count) {
+    for (int i = 0; i < STORAGE_PIPE_DISCARDS; i++) {
+        storage_range_t* range = &storage_discards[i];
+        if (!range->count) continue;
+        if (range->sector >= sector + count || sector >= range->sector + range->count) continue;
+    
+        uint32_t end = range->sector + range->count;
+        range->count = range->sector < sector ? sector - range->sector : 0;
+        if (end > sector + count && !storage_discard_add(sector + count, end - sector - count)) {
+            storage_stats.unmap_dropped++;
+        }
+    }
+}
+
+void storage_pipe_task(void) {
+    storage_req_t* req;
+    while ((req = storage_queue_pop(&storage_completions)) != NULL) {
+        storage_outstanding--;
+        req->done = true;
+        storage_complete(req);
+    }
+    storage_discard_next();
+}
+
+void storage_pipe_set_wait_callback(void (*callback)(void)) {
+    storage_wait_callback = callback;
+}
+
+static void storage_wait(void) {
+    storage_pipe_task();
+    if (storage_wait_callback) {
+        storage_wait_callback();
+    } else {
+        tight_loop_contents();
+    }
+}
+
+// Drop read slots overlapping [sector, sector + count); count 0 drops all.
+// A read still queued is marked stale and freed when it comes back.
+static void storage_drop_reads(uint32_t sector, uint32_t count) {
+    for (int i = 0; i < STORAGE_PIPE_SLOTS; i++) {
+        storage_slot_t* slot = &storage_slots[i];
+        if (slot->state != STORAGE_SLOT_READING && slot->state != STORAGE_SLOT_READY) continue;
+        if (count && (slot->req.sector >= sector + count ||
+                      sector >= slot->req.sector + slot->req.count)) continue;
+    
+        if (slot->state == STORAGE_SLOT_READY) {
+            storage_slot_release(slot);
+        } else {
+            slot->state = STORAGE_SLOT_STALE;
+        }
+    }
+}
+
+//--------------------------------------------------------------------+
+// Synchronous calls
+//--------------------------------------------------------------------+
+
+static int storage_call(storage_op_t op, void* buffer, uint32_t sector, uint32_t count) {
+    storage_req_t req = {
+        .op = op,
+        .buffer = buffer,
+        .sector = sector,
+        .count = count,
+        .slot = -1,
+    };
+    
+    if (!storage_forwarded()) return storage_execute(&req);
+    
+    // Anything that changes the card makes prefetched MSC data suspect
+    if (op == STORAGE_OP_WRITE || op == STORAGE_OP_DISCARD) {
+        storage_drop_reads(sector, count);
+    } else if (op == STORAGE_OP_INIT || op == STORAGE_OP_INVALIDATE) {
+        storage_drop_reads(0, 0);
+    }
+    if (op == STORAGE_OP_WRITE) {
+        storage_discard_trim(sector, count);
+    } else if (op == STORAGE_OP_INIT) {
+        memset(storage_discards, 0, sizeof(storage_discards));  // Maybe another card
+    }
+    
+    storage_stats.forwarded++;
+    while (!storage_submit(&req)) {
+        storage_wait();
+    }
+    while (!req.done) {
+        storage_wait();
+    }
+    return req.result;
+}
+
+int storage_init_card(void) {
+    return storage_call(STORAGE_OP_INIT, NULL, 0, 0);
+}
+
+int storage_read(void* buffer, uint32_t sector, uint32_t count) {
+    return storage_call(STORAGE_OP_READ, buffer, sector, count);
+}
+
+int storage_write(const void* buffer, uint32_t sector, uint32_t count) {
+    return storage_call(STORAGE_OP_WRITE, (void*)buffer, sector, count);
+}
+
+int storage_sync(void) {
+    return storage_call(STORAGE_OP_SYNC, NULL, 0, 0);
+}
+
+int storage_discard(uint32_t sector, uint32_t count) {
+    return storage_call(STORAGE_OP_DISCARD, NULL, sector, count);
+}
+
+void storage_invalidate_all(void) {
+    storage_call(STORAGE_OP_INVALIDATE, NULL, 0, 0);
+}
+
+void storage_print_card_stats(void) {
+    storage_call(STORAGE_OP_PRINT_STATS, NULL, 0, 0);
+}
+
+void storage_reset_card_stats(void) {
+    storage_call(STORAGE_OP_RESET_STATS, NULL, 0, 0);
+}
+
+//--------------------------------------------------------------------+
+// MSC data path
+//--------------------------------------------------------------------+
+
+static storage_slot_t* storage_find_read(uint32_t sector, uint32_t count) {
+    for (int i = 0; i < STORAGE_PIPE_SLOTS; i++) {
+        storage_slot_t* slot = &storage_slots[i];
+        if ((slot->state == STORAGE_SLOT_READING || slot->state == STORAGE_SLOT_READY) &&
+            slot->req.sector == sector && slot->req.count == count) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// A slot for a new request: a free one, or else, for a request the host
+// is waiting on, a filled read slot the host has not asked for (yet)
+static int storage_slot_take(bool prefetch) {
+    int ready = -1;
+    
+    for (int i = 0; i < STORAGE_PIPE_SLOTS; i++) {
+        if (storage_slots[i].state == STORAGE_SLOT_FREE) return i;
+        if (storage_slots[i].state == STORAGE_SLOT_READY) ready = i;
+    }
+    if (prefetch || ready < 0) return -1;
+    
+    storage_slot_release(&storage_slots[ready]);
+    return ready;
+}
+
+// Take a slot and queue its request; NULL if there is no room. A write's
+// data must be in the slot before core1 can see the request.
+static storage_slot_t* storage_start(storage_op_t op, const void* data, uint32_t sector, uint32_t count,
+                                     bool prefetch) {
+    if (storage_outstanding >= STORAGE_QUEUE_SIZE) return NULL;
+    
+    int i = storage_slot_take(prefetch);
+    if (i < 0) return NULL;
+    
+    storage_slot_t* slot = &storage_slots[i];
+    if (data) memcpy(slot->data, data, count * 512);
+    slot->req.op = op;
+    slot->req.buffer = slot->data;
+    slot->req.sector = sector;
+    slot->req.count = count;
+    slot->req.slot = i;
+    slot->prefetch = prefetch;
+    storage_submit(&slot->req);
+    
+    // Completions are only collected on this core, so this is in time
+    slot->state = op == STORAGE_OP_MSC_READ ? STORAGE_SLOT_READING : STORAGE_SLOT_WRITING;
+    return slot;
+}
+
+// Keep the blocks after the one the host just asked for in flight
+static void storage_prefetch(uint32_t sector, uint32_t count) {
+    uint32_t sectors = sd_get_sectors_count();
+    
+    for (int i = 0; i < STORAGE_PIPE_READAHEAD; i++, sector += count) {
+        if (sector + count > sectors) break;
+        if (storage_find_read(sector, count)) continue;
+        if (!storage_start(STORAGE_OP_MSC_READ, NULL, sector, count, true)) break;
+        storage_stats.prefetched++;
+    }
+}
+
+int32_t storage_msc_read(void* buffer, uint32_t sector, uint32_t count) {
+    uint32_t bytes = count * 512;
+    
+    if (!storage_forwarded() || bytes > STORAGE_PIPE_SLOT_SIZE) {
+        return storage_call(STORAGE_OP_MSC_READ, buffer, sector, count) == 0 ? (int32_t)bytes : -1;
+    }
+    
+    storage_pipe_task();
+    
+    storage_slot_t* slot = storage_find_read(sector, count);
+    if (slot && slot->state == STORAGE_SLOT_READY) {
+        int result = slot->req.result;
+        if (result == 0) memcpy(buffer, slot->data, bytes);
+        if (slot->prefetch) storage_stats.read_hits++;
+        storage_stats.reads++;
+        slot->state = STORAGE_SLOT_FREE;
+    
+        storage_prefetch(sector + count, count);
+        return result == 0 ? (int32_t)bytes : -1;
+    }
+    
+    if (!slot) {
+        // Not the stream that was being prefetched: start over here
+        storage_drop_reads(0, 0);
+        storage_start(STORAGE_OP_MSC_READ, NULL, sector, count, false);
+    }
+    storage_prefetch(sector + count, count);
+    
+    storage_stats.busy++;
+    return 0;
+}
+
+int32_t storage_msc_write(const void* buffer, uint32_t sector, uint32_t count) {
+    uint32_t bytes = count * 512;
+    
+    // A queued write that failed stays latched for storage_sync(): failing
+    // this callback would blame the wrong LBAs and drop its data
+    storage_pipe_task();
+    
+    if (!storage_forwarded() || bytes > STORAGE_PIPE_SLOT_SIZE) {
+        return storage_write(buffer, sector, count) == 0 ? (int32_t)bytes : -1;
+    }
+    
+    storage_drop_reads(sector, count);
+    storage_discard_trim(sector, count);
+    
+    if (!storage_start(STORAGE_OP_WRITE, buffer, sector, count, false)) {
+        storage_stats.busy++;
+        return 0;
+    }
+    storage_stats.writes++;
+    return (int32_t)bytes;
+}
+
+int storage_msc_sync(void) {
+    int result = storage_sync();
+    
+    // Queued MSC writes came back before the sync did
+    if (storage_write_failed) {
+        storage_write_failed = false;
+        result = -1;
+    }
+    return result;
+}
+
+int storage_msc_discard(uint32_t sector, uint32_t count) {
+    if (!storage_forwarded()) return storage_discard(sector, count);
+    
+    storage_drop_reads(sector, count);
+    storage_stats.unmapped++;
+    if (!storage_discard_add(sector, count)) {
+        storage_stats.unmap_dropped++;
+        return 0;
+    }
+    storage_discard_next();
+    return 0;
+}
+
+void storage_msc_flush(void) {
+    if (!storage_forwarded()) {
+        storage_sync();
+        return;
+    }
+    if (storage_flush_pending) return;
+    
+    storage_flush_req.op = STORAGE_OP_SYNC;
+    storage_flush_req.slot = -1;
+    if (storage_submit(&storage_flush_req)) storage_flush_pending = true;
+}
+
+void storage_pipe_get_stats(storage_pipe_stats_t* stats) {
+    *stats = storage_stats;
+}
+
+void storage_pipe_reset_stats(void) {
+    memset(&storage_stats, 0, sizeof(storage_stats));
+}
+
+void storage_pipe_print_stats(void) {
+    printf("MSC pipe: %lu reads (%lu prefetched), %lu writes, %lu busy, %lu forwarded\n",
+           (unsigned long)storage_stats.reads, (unsigned long)storage_stats.read_hits,
+           (unsigned long)storage_stats.writes, (unsigned long)storage_stats.busy,
+           (unsigned long)storage_stats.forwarded);
+    printf("MSC prefetch: %lu slots filled, %lu dropped unused\n",
+           (unsigned long)storage_stats.prefetched, (unsigned long)storage_stats.wasted);
+    printf("MSC unmap: %lu ranges queued, %lu dropped\n",
+           (unsigned long)storage_stats.unmapped, (unsigned long)storage_stats.unmap_dropped);
+}
@@ -0,0 +1,123 @@
+#ifndef STORAGE_PIPE_H
+#define STORAGE_PIPE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Cross-core storage pipeline. Once the boot on core1 is done, core1 owns
+// the SD card, the block layer and their background work (sd_task(),
+// block_task()). Core0 reaches them through two lock-free single-producer
+// single-consumer queues: requests go to core1, finished requests come
+// back. Neither core ever blocks the other.
+//
+// The MSC callbacks use a ring of slot buffers and never wait. A write is
+// copied into a slot and acknowledged at once. A read is served from a
+// slot that core1 has already filled; otherwise the read is queued and the
+// callback reports busy. Sequential reads keep the next slots in flight,
+// so USB transfers and card I/O overlap.
+//
+// The storage_* calls are synchronous, for FatFs (diskio.c) and the
+// SCSI commands. On core1, and before the pipeline is enabled (boot, or
+// the host build), they go straight to the block layer. On core0 they go
+// through the queue and wait, running the wait callback meanwhile.
+
+// Slot ring for the MSC data path. A slot holds one MSC callback's worth
+// of data, so STORAGE_PIPE_SLOT_SIZE must be at least
+// CFG_TUD_MSC_EP_BUFSIZE; the build sets both from MSC_BUFFER_SIZE.
+#ifndef STORAGE_PIPE_SLOT_SIZE
+#define STORAGE_PIPE_SLOT_SIZE  4096
+#endif
+
+// RAM for the ring. It holds as many slots as fit, at least 2 and at most 8.
+#ifndef STORAGE_PIPE_RAM
+#define STORAGE_PIPE_RAM        (32 * 1024)
+#endif
+
+#ifndef STORAGE_PIPE_SLOTS
+#if STORAGE_PIPE_RAM / STORAGE_PIPE_SLOT_SIZE < 2
+#define STORAGE_PIPE_SLOTS      2
+#elif STORAGE_PIPE_RAM / STORAGE_PIPE_SLOT_SIZE > 8
+#define STORAGE_PIPE_SLOTS      8
+#else
+#define STORAGE_PIPE_SLOTS      (STORAGE_PIPE_RAM / STORAGE_PIPE_SLOT_SIZE)
+#endif
+#endif
+
+// Slots a sequential read stream keeps in flight ahead of the host. Two
+// are left for the host's own read and a write; a two-slot ring keeps one.
+#ifndef STORAGE_PIPE_READAHEAD
+#if STORAGE_PIPE_SLOTS > 2
+#define STORAGE_PIPE_READAHEAD  (STORAGE_PIPE_SLOTS - 2)
+#else
+#define STORAGE_PIPE_READAHEAD  1
+#endif
+#endif
+
+// UNMAP ranges waiting to be discarded. core1 gets them one erase chunk
+// (SD_ERASE_MAX_SECTORS) at a time; a range that finds no free entry is
+// not discarded, which UNMAP allows.
+#ifndef STORAGE_PIPE_DISCARDS
+#define STORAGE_PIPE_DISCARDS   8
+#endif
+
+typedef struct {
+    uint32_t reads;         // MSC read callbacks served
+    uint32_t read_hits;     // ... from a slot that was already filled
+    uint32_t prefetched;    // Slots filled ahead of the host
+    uint32_t wasted;        // Prefetched slots dropped unused
+    uint32_t writes;        // MSC write callbacks queued
+    uint32_t busy;          // Callbacks answered with "busy"
+    uint32_t forwarded;     // Synchronous calls sent to core1
+    uint32_t unmapped;      // UNMAP ranges queued
+    uint32_t unmap_dropped; // ... or parts of them left in place
+} storage_pipe_stats_t;
+
+// Core1, after the boot: from now on core0 goes through the queues
+void storage_pipe_enable(void);
+
+// Core1: serve requests and run the SD and block layer tasks. Never returns.
+void storage_pipe_core1_run(void);
+
+// Core0 main loop: collect finished requests
+void storage_pipe_task(void);
+
+// Called while a synchronous call on core0 waits for core1 (usb_task)
+void storage_pipe_set_wait_callback(void (*callback)(void));
+
+// Synchronous block access; 0 on success, -1 on error
+int storage_init_card(void);    // sd_init_driver() and a cold block layer
+int storage_read(void* buffer, uint32_t sector, uint32_t count);
+int storage_write(const void* buffer, uint32_t sector, uint32_t count);
+int storage_sync(void);
+int storage_discard(uint32_t sector, uint32_t count);
+void storage_invalidate_all(void);  // Flushed first; for cold benchmarks
+
+// SD driver and block layer counters. Core1 updates them without locks,
+// so they are printed and cleared there rather than read from core0.
+void storage_print_card_stats(void);
+void storage_reset_card_stats(void);
+
+// MSC data path, core0 only. Both return count * 512 when done, 0 for
+// "busy, call again" and -1 on error. Before the pipeline is enabled they
+// are synchronous, like the calls above. A queued write that fails is
+// reported by the next storage_msc_sync() only, since the callback that
+// queued it has already been acknowledged.
+int32_t storage_msc_read(void* buffer, uint32_t sector, uint32_t count);
+int32_t storage_msc_write(const void* buffer, uint32_t sector, uint32_t count);
+
+// SYNCHRONIZE CACHE: storage_sync(), and -1 if a queued write failed
+int storage_msc_sync(void);
+
+// UNMAP: queue a discard and return without waiting for the erase. Later
+// writes to the range cancel that part. 0 unless a synchronous discard
+// (pipeline not enabled) fails.
+int storage_msc_discard(uint32_t sector, uint32_t count);
+
+// Start flushing MSC writes to the card without waiting
+void storage_msc_flush(void);
+
+void storage_pipe_get_stats(storage_pipe_stats_t* stats);
+void storage_pipe_reset_stats(void);
+void storage_pipe_print_stats(void);
+
+#endif // STORAGE_PIPE_H
@@ -0,0 +1,206 @@
+#include "storage_share.h"
+#include "log.h"
+#include "pico/stdlib.h"
+#include <stdio.h>
+#include <string.h>
+
+// A run of sectors holding part of ducky.txt
+typedef struct {
+    uint32_t sector;
+    uint32_t count;
+} share_run_t;
+
+static FATFS* share_fs = NULL;
+
+// Where the script lives
+static share_run_t share_runs[STORAGE_SHARE_FRAGMENTS];
+static uint32_t share_run_count = 0;
+static bool share_runs_complete = true;     // False if the file had more fragments
+static uint32_t share_dir_sector = 0;       // 0 without a script file
+
+// Fast seek map for storage_share_track(): size, then (length, cluster)
+// pairs and a terminating 0
+static DWORD share_clmt[1 + 2 * STORAGE_SHARE_FRAGMENTS + 1];
+
+static bool share_fs_stale = false;         // FatFs state predates a host write
+static bool share_script_dirty = false;
+static bool share_host_writing = false;     // Inside a host WRITE command
+static uint64_t share_last_write_us = 0;
+static bool share_session = false;
+static bool share_withdrawn = false;        // Host kept off the card
+static bool share_medium_changed = false;   // Not yet reported to the host
+static storage_share_stats_t share_stats;
+
+// Helper functions
+static uint32_t share_cluster_sector(DWORD cluster) {
+    return (uint32_t)share_fs->database + (cluster - 2) * share_fs->csize;
+}
+
+static bool share_overlaps(uint32_t sector, uint32_t count, uint32_t start, uint32_t len) {
+    return sector < start + len && start < sector + count;
+}
+
+static bool share_settled(void) {
+    return time_us_64() - share_last_write_us >= (uint64_t)STORAGE_SHARE_SETTLE_MS * 1000;
+}
+
+// Forget everything FatFs keeps about the volume between calls. A dirty
+// window would hold the firmware's unsynced change; the host's data wins.
+static void share_invalidate(void) {
+    share_fs->winsect = (LBA_t)0 - 1;
+    share_fs->wflag = 0;
+    share_fs->last_clst = 0xFFFFFFFF;
+    share_fs->free_clst = 0xFFFFFFFF;
+    share_fs->fsi_flag &= ~1;
+    share_stats.invalidations++;
+}
+
+void storage_share_init(FATFS* fs) {
+    share_fs = fs;
+    share_fs_stale = false;
+    share_script_dirty = false;
+    share_host_writing = false;
+    share_run_count = 0;
+    share_runs_complete = true;
+    share_dir_sector = 0;
+}
+
+void storage_share_track(FIL* file) {
+    share_run_count = 0;
+    share_runs_complete = true;
+    share_dir_sector = 0;
+    share_script_dirty = false;
+    if (!file || !share_fs) return;
+    
+    share_dir_sector = (uint32_t)file->dir_sect;
+    
+    file->cltbl = share_clmt;
+    share_clmt[0] = sizeof(share_clmt) / sizeof(share_clmt[0]);
+    if (f_lseek(file, CREATE_LINKMAP) != FR_OK) {
+        // Too fragmented to map: treat the whole data area as the script's
+        file->cltbl = NULL;
+        share_runs_complete = false;
+        return;
+    }
+    
+    for (uint32_t i = 1; share_clmt[i] != 0 && share_run_count < STORAGE_SHARE_FRAGMENTS; i += 2) {
+        share_runs[share_run_count].sector = share_cluster_sector(share_clmt[i + 1]);
+        share_runs[share_run_count].count = share_clmt[i] * share_fs->csize;
+        share_run_count++;
+    }
+}
+
+//--------------------------------------------------------------------+
+// Host side
+//--------------------------------------------------------------------+
+
+bool storage_share_host_may_write(void) {
+    if (!share_session) return true;
+    
+    share_stats.held_writes++;
+    return false;
+}
+
+void storage_share_host_write(uint32_t sector, uint32_t count) {
+    if (!share_fs) return;
+    
+    share_host_writing = true;
+    share_last_write_us = time_us_64();
+    
+    uint32_t database = (uint32_t)share_fs->database;
+    bool directory = share_dir_sector && share_overlaps(sector, count, share_dir_sector, 1);
+    if (share_fs->fs_type == FS_FAT32) {
+        directory |= share_overlaps(sector, count, share_cluster_sector(share_fs->dirbase), share_fs->csize);
+    }
+    
+    bool script = !share_runs_complete && sector + count > database;
+    for (uint32_t i = 0; i < share_run_count && !script; i++) {
+        script = share_overlaps(sector, count, share_runs[i].sector, share_runs[i].count);
+    }
+    
+    if (sector < database) {
+        share_stats.metadata_writes++;
+    } else if (directory) {
+        share_stats.directory_writes++;
+    } else if (script) {
+        share_stats.script_writes++;
+    } else {
+        return;     // Some other file's data
+    }
+    
+    LOG_DEBUG("Host write %lu+%lu touches FatFs state\n", sector, count);
+    share_fs_stale = true;
+    share_script_dirty = true;
+}
+
+void storage_share_host_write_done(void) {
+    share_host_writing = false;
+}
+
+//--------------------------------------------------------------------+
+// Firmware side
+//--------------------------------------------------------------------+
+
+bool storage_share_begin(void) {
+    if (!share_fs || share_session) return false;
+    
+    // A WRITE whose completion never came (host reset) expires on its own
+    if (share_host_writing && !share_settled()) return false;
+    share_host_writing = false;
+    
+    if (share_fs_stale) {
+        share_invalidate();
+        share_fs_stale = false;
+    }
+    share_session = true;
+    share_stats.sessions++;
+    return true;
+}
+
+void storage_share_end(void) {
+    share_session = false;
+}
+
+bool storage_share_in_session(void) {
+    return share_session;
+}
+
+void storage_share_withdraw(void) {
+    share_withdrawn = true;
+}
+
+void storage_share_restore(void) {
+    if (!share_withdrawn) return;
+    
+    share_withdrawn = false;
+    share_medium_changed = true;
+}
+
+bool storage_share_withdrawn(void) {
+    return share_withdrawn;
+}
+
+bool storage_share_medium_changed(void) {
+    bool changed = share_medium_changed;
+    share_medium_changed = false;
+    return changed;
+}
+
+bool storage_share_script_stale(void) {
+    return share_script_dirty && !share_session && share_settled();
+}
+
+void storage_share_get_stats(storage_share_stats_t* stats) {
+    *stats = share_stats;
+}
+
+void storage_share_reset_stats(void) {
+    memset(&share_stats, 0, sizeof(share_stats));
+}
+
+void storage_share_print_stats(void) {
+    printf("Sharing: host wrote %lu metadata, %lu directory, %lu script; %lu sessions, %lu invalidations, %lu held\n",
+           (unsigned long)share_stats.metadata_writes, (unsigned long)share_stats.directory_writes,
+           (unsigned long)share_stats.script_writes, (unsigned long)share_stats.sessions,
+           (unsigned long)share_stats.invalidations, (unsigned long)share_stats.held_writes);
+}
@@ -0,0 +1,85 @@
+#ifndef STORAGE_SHARE_H
+#define STORAGE_SHARE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ff.h"
+
+// Coherence between FatFs on the device and the USB host, which mount the
+// same volume. The block layer and the pipeline keep sector data coherent;
+// what goes stale is FatFs's own state (the sector window, the free
+// cluster hints) and the firmware's copy of ducky.txt.
+//
+// Host writes are classified as they are accepted:
+//   metadata  below the data area: boot sector, FSInfo, FATs, FAT12/16 root
+//   directory the sector holding ducky.txt's entry, and a FAT32 root
+//             directory's first cluster
+//   script    ducky.txt's data clusters
+// Any of them marks FatFs stale. Once the host has been quiet for
+// STORAGE_SHARE_SETTLE_MS, storage_share_script_stale() reports that
+// the script wants a reload.
+//
+// Firmware FatFs use goes in sessions: storage_share_begin() waits for
+// the host to finish its WRITE command, drops stale FatFs state and holds
+// off further host writes until storage_share_end().
+
+// Quiet time after the last host write before the script is reloaded.
+// Hosts write the data, FAT and directory entry of a save in one burst.
+#ifndef STORAGE_SHARE_SETTLE_MS
+#define STORAGE_SHARE_SETTLE_MS     1000
+#endif
+
+// Fragments of ducky.txt that are tracked; a more fragmented file makes
+// any host write to the data area count as a script write
+#ifndef STORAGE_SHARE_FRAGMENTS
+#define STORAGE_SHARE_FRAGMENTS     8
+#endif
+
+typedef struct {
+    uint32_t metadata_writes;   // Host write commands touching each class
+    uint32_t directory_writes;
+    uint32_t script_writes;
+    uint32_t invalidations;     // FatFs state dropped at a session start
+    uint32_t sessions;          // Firmware FatFs sessions
+    uint32_t held_writes;       // Host write callbacks held off by a session
+} storage_share_stats_t;
+
+// Volume mounted; call again after every mount
+void storage_share_init(FATFS* fs);
+
+// Record where the script lives. file is open for reading; this builds its
+// cluster map (fast seek), so reads after it use the map as well. Call with
+// NULL when there is no script file.
+void storage_share_track(FIL* file);
+
+// MSC write path: may the host write now, and what it wrote. done is
+// called at the end of each WRITE command.
+bool storage_share_host_may_write(void);
+void storage_share_host_write(uint32_t sector, uint32_t count);
+void storage_share_host_write_done(void);
+
+// Firmware FatFs session; false while the host is in a WRITE command
+bool storage_share_begin(void);
+void storage_share_end(void);
+bool storage_share_in_session(void);
+
+// Keep the host off the card for a firmware job that remounts the volume
+// or changes it behind the host's back (the benchmark). MSC reports NOT
+// READY meanwhile; afterwards the next TEST UNIT READY reports a medium
+// change, so the host drops what it has cached.
+void storage_share_withdraw(void);
+void storage_share_restore(void);
+bool storage_share_withdrawn(void);
+
+// True once after storage_share_restore()
+bool storage_share_medium_changed(void);
+
+// The host changed the script (or the FAT/directory around it) and has
+// been quiet since. Cleared by the next storage_share_track().
+bool storage_share_script_stale(void);
+
+void storage_share_get_stats(storage_share_stats_t* stats);
+void storage_share_reset_stats(void);
+void storage_share_print_stats(void);
+
+#endif // STORAGE_SHARE_H
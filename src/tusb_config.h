@@ -87,8 +87,12 @@
 // CDC Endpoint transfer buffer size, more is faster
 #define CFG_TUD_CDC_EP_BUFSIZE   (TUD_OPT_HIGH_SPEED ? 512 : 64)
 
-// MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_EP_BUFSIZE    512
+// MSC Buffer size of Device Mass storage: bytes per READ10/WRITE10
+// callback, a multiple of 512. Set with -DMSC_BUFFER_SIZE, which also
+// sizes the storage pipeline's slots (storage_pipe.h).
+#ifndef CFG_TUD_MSC_EP_BUFSIZE
+#define CFG_TUD_MSC_EP_BUFSIZE    4096
+#endif
 
 #ifdef __cplusplus
  }